@@ -1,17 +1,35 @@
 /* $begin sbufc */
 #include "sbuf.h"
-#include <stdio.h>
+#include <stdint.h>
 
-/* Create an empty, bounded, shared FIFO buffer with n slots */
+/*
+ * A bounded multi-producer, multi-consumer FIFO.  The ring itself is
+ * lock-free: each slot carries a sequence number, and a producer or
+ * consumer claims a position by advancing rear or front with a single
+ * compare-and-swap, then publishes its slot by bumping seq (D. Vyukov's
+ * bounded MPMC queue).  sbuf_insert() and sbuf_remove() only fall back to
+ * a mutex and condition variable when the buffer is full or empty and the
+ * caller has to sleep; otherwise a hand-off touches no lock at all.
+ */
+
+/* Create an empty, bounded, shared FIFO buffer with at least n slots */
 /* $begin sbuf_init */
 void sbuf_init(sbuf_t *sp, int n)
 {
-    sp->buf = calloc(n, sizeof(int)); 
-    sp->n = n;                       /* Buffer holds max of n items */
+    size_t i, size = 1;
+
+    while (size < (size_t)n)         /* Round up to a power of two */
+        size <<= 1;
+    sp->buf = calloc(size, sizeof(sbuf_slot_t));
+    for (i = 0; i < size; i++)
+        sp->buf[i].seq = i;          /* Slot i is free for insert #i */
+    sp->mask = size - 1;
     sp->front = sp->rear = 0;        /* Empty buffer iff front == rear */
-    sem_init(&sp->mutex, 0, 1);      /* Binary semaphore for locking */
-    sem_init(&sp->slots, 0, n);      /* Initially, buf has n empty slots */
-    sem_init(&sp->items, 0, 0);      /* Initially, buf has zero data items */
+    sp->slot_waiters = sp->item_waiters = 0;
+    pthread_mutex_init(&sp->slot_mutex, NULL);
+    pthread_mutex_init(&sp->item_mutex, NULL);
+    pthread_cond_init(&sp->slots, NULL);
+    pthread_cond_init(&sp->items, NULL);
 }
 /* $end sbuf_init */
 
@@ -20,18 +38,123 @@ void sbuf_init(sbuf_t *sp, int n)
 void sbuf_deinit(sbuf_t *sp)
 {
     free(sp->buf);
+    pthread_mutex_destroy(&sp->slot_mutex);
+    pthread_mutex_destroy(&sp->item_mutex);
+    pthread_cond_destroy(&sp->slots);
+    pthread_cond_destroy(&sp->items);
 }
 /* $end sbuf_deinit */
 
+/*
+ * Wake a thread sleeping in sbuf_insert() or sbuf_remove(), if there is
+ * one.  The fence orders the caller's publish of its slot before the load
+ * of *waiters; a sleeper increments *waiters before its last look at the
+ * ring, so either it sees the slot or we see it waiting.  It holds the
+ * mutex from then until pthread_cond_wait(), so the signal is not lost.
+ * Callers must not hold either mutex.
+ */
+static void wake(int *waiters, pthread_mutex_t *mutex, pthread_cond_t *cond)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiters, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(mutex);
+        pthread_cond_signal(cond);
+        pthread_mutex_unlock(mutex);
+    }
+}
+
+/* Claim the next slot at the rear and fill it.  Returns 0 if full. */
+static int ring_put(sbuf_t *sp, int item)
+{
+    size_t pos = __atomic_load_n(&sp->rear, __ATOMIC_RELAXED);
+    sbuf_slot_t *slot;
+    intptr_t diff;
+
+    while (1) {
+        slot = &sp->buf[pos & sp->mask];
+        diff = (intptr_t)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) -
+            (intptr_t)pos;
+        if (diff == 0) {
+            /* On failure, pos is reloaded with the current rear */
+            if (__atomic_compare_exchange_n(&sp->rear, &pos, pos + 1, 1,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return 0;                /* Slot still holds an old item */
+        } else {
+            pos = __atomic_load_n(&sp->rear, __ATOMIC_RELAXED);
+        }
+    }
+    slot->item = item;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* Claim the item at the front and free its slot.  Returns 0 if empty. */
+static int ring_get(sbuf_t *sp, int *itemp)
+{
+    size_t pos = __atomic_load_n(&sp->front, __ATOMIC_RELAXED);
+    sbuf_slot_t *slot;
+    intptr_t diff;
+
+    while (1) {
+        slot = &sp->buf[pos & sp->mask];
+        diff = (intptr_t)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) -
+            (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&sp->front, &pos, pos + 1, 1,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return 0;                /* Nothing inserted here yet */
+        } else {
+            pos = __atomic_load_n(&sp->front, __ATOMIC_RELAXED);
+        }
+    }
+    *itemp = slot->item;
+    /* Free the slot for the insert one lap later */
+    __atomic_store_n(&slot->seq, pos + sp->mask + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*
+ * Insert item without blocking.  Returns 1 on success, 0 if full.  Safe to
+ * mix with sbuf_remove(): a consumer asleep there is woken.
+ */
+int sbuf_try_insert(sbuf_t *sp, int item)
+{
+    if (!ring_put(sp, item))
+        return 0;
+    wake(&sp->item_waiters, &sp->item_mutex, &sp->items);
+    return 1;
+}
+
+/*
+ * Remove an item without blocking.  Returns 1 on success, 0 if empty.  A
+ * producer asleep in sbuf_insert() is woken.
+ */
+int sbuf_try_remove(sbuf_t *sp, int *itemp)
+{
+    if (!ring_get(sp, itemp))
+        return 0;
+    wake(&sp->slot_waiters, &sp->slot_mutex, &sp->slots);
+    return 1;
+}
+
 /* Insert item onto the rear of shared buffer sp */
 /* $begin sbuf_insert */
 void sbuf_insert(sbuf_t *sp, int item)
 {
-    printf(sem_wait(&sp->slots));                          /* Wait for available slot */
-    sem_wait(&sp->mutex);                          /* Lock the buffer */
-    sp->buf[(++sp->rear)%(sp->n)] = item;   /* Insert the item */
-    sem_post(&sp->mutex);                          /* Unlock the buffer */
-    printf(sem_post(&sp->items));                          /* Announce available item */
+    if (!ring_put(sp, item)) {                        /* Full: wait for a slot */
+        pthread_mutex_lock(&sp->slot_mutex);
+        __atomic_add_fetch(&sp->slot_waiters, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);      /* Pairs with wake() */
+        while (!ring_put(sp, item))
+            pthread_cond_wait(&sp->slots, &sp->slot_mutex);
+        __atomic_sub_fetch(&sp->slot_waiters, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&sp->slot_mutex);
+    }
+    wake(&sp->item_waiters, &sp->item_mutex, &sp->items);  /* Announce item */
 }
 /* $end sbuf_insert */
 
@@ -40,13 +163,18 @@ void sbuf_insert(sbuf_t *sp, int item)
 int sbuf_remove(sbuf_t *sp)
 {
     int item;
-    printf(sem_wait(&sp->items));                          /* Wait for available item */
-    sem_wait(&sp->mutex);                          /* Lock the buffer */
-    item = sp->buf[(++sp->front)%(sp->n)];  /* Remove the item */
-    sem_post(&sp->mutex);                          /* Unlock the buffer */
-    printf(sem_post(&sp->slots));                          /* Announce available slot */
+
+    if (!ring_get(sp, &item)) {                       /* Empty: wait for an item */
+        pthread_mutex_lock(&sp->item_mutex);
+        __atomic_add_fetch(&sp->item_waiters, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);      /* Pairs with wake() */
+        while (!ring_get(sp, &item))
+            pthread_cond_wait(&sp->items, &sp->item_mutex);
+        __atomic_sub_fetch(&sp->item_waiters, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&sp->item_mutex);
+    }
+    wake(&sp->slot_waiters, &sp->slot_mutex, &sp->slots);  /* Announce slot */
     return item;
 }
 /* $end sbuf_remove */
 /* $end sbufc */
-
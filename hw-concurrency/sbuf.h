@@ -2,17 +2,32 @@
 #define __SBUF_H__
 
 #include <stdlib.h>
-#include <semaphore.h>
+#include <pthread.h>
+
+#define SBUF_CACHE_LINE 64
+
+/* One slot of the ring; seq says whose turn it is to use it */
+typedef struct {
+    size_t seq;        /* == pos: free for the insert at pos;
+                          == pos + 1: holds the item inserted at pos */
+    int item;
+} sbuf_slot_t;
 
 /* $begin sbuft */
 typedef struct {
-    int *buf;          /* Buffer array */         
-    int n;             /* Maximum number of slots */
-    int front;         /* buf[(front+1)%n] is first item */
-    int rear;          /* buf[rear%n] is last item */
-    sem_t mutex;       /* Protects accesses to buf */
-    sem_t slots;       /* Counts available slots */
-    sem_t items;       /* Counts available items */
+    sbuf_slot_t *buf;  /* Ring of n slots */
+    size_t mask;       /* n - 1; n is a power of two */
+    /* Each index on its own cache line, so producers and consumers
+       do not invalidate each other's lines on every operation */
+    size_t rear __attribute__((aligned(SBUF_CACHE_LINE)));  /* Next insert */
+    size_t front __attribute__((aligned(SBUF_CACHE_LINE))); /* Next remove */
+    /* Used only when the buffer is full or empty */
+    int slot_waiters __attribute__((aligned(SBUF_CACHE_LINE)));
+    int item_waiters;
+    pthread_mutex_t slot_mutex;
+    pthread_mutex_t item_mutex;
+    pthread_cond_t slots;  /* Signaled when a slot frees up */
+    pthread_cond_t items;  /* Signaled when an item arrives */
 } sbuf_t;
 /* $end sbuft */
 
@@ -20,5 +35,7 @@ void sbuf_init(sbuf_t *sp, int n);
 void sbuf_deinit(sbuf_t *sp);
 void sbuf_insert(sbuf_t *sp, int item);
 int sbuf_remove(sbuf_t *sp);
+int sbuf_try_insert(sbuf_t *sp, int item);
+int sbuf_try_remove(sbuf_t *sp, int *itemp);
 
 #endif /* __SBUF_H__ */
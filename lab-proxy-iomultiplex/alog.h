@@ -0,0 +1,16 @@
+#ifndef __ALOG_H__
+#define __ALOG_H__
+
+#define ALOG_RING_SIZE (64 * 1024)      /* bytes buffered per thread; a power of two */
+#define ALOG_ENTRY_MAX 1024             /* longest entry; longer ones are cut short */
+#define ALOG_BATCH (256 * 1024)         /* most the writer gathers into one write() */
+#define ALOG_FLUSH_MS 50                /* how often the writer drains the rings */
+#define ALOG_MAP_CHUNK (16 * 1024 * 1024) /* a mapped log file grows by this much */
+
+int alog_open(const char *path, unsigned sample);
+void alog_close(void);
+int alog_sampled(void);
+int alog_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+unsigned long alog_dropped(void);
+
+#endif /* __ALOG_H__ */
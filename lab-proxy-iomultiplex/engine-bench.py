@@ -0,0 +1,194 @@
+#!/usr/bin/python3
+
+# engine-bench.py - Compare the proxy engines side by side: the thread pool
+#                   proxy in ../lab-proxy-threadpool (if it is built), and
+#                   this proxy's epoll and io_uring reactors.  Each engine
+#                   in turn relays the same load, from concurrent clients
+#                   each issuing requests back to back, to a small origin
+#                   that answers every request at once with a fixed body
+#                   it forbids caching, so every request reaches it.
+#                   Prints throughput, p50/p99 latency, and the proxy's CPU
+#                   time per request, user and system, from /proc; for the
+#                   io_uring engine, also io_uring_enter() calls per
+#                   request, from the reactor stats it prints on SIGUSR1.
+#
+# usage: engine-bench.py [-c clients] [-n requests] [-s size] [-r reactors]
+#
+# Three runs of engine-bench.py -c 8 -n 2000 on a 1-CPU VM (Linux 6.18),
+# where the clients and the origin share the CPU with the proxy:
+#
+#   threadpool  3060-3490 req/s  p99 4.2-5.7 ms  cpu/req 15-20 us user, 64-66 us sys
+#   epoll       3000-3470 req/s  p99 4.0-4.7 ms  cpu/req 12-16 us user, 56-61 us sys
+#   io_uring    2990-3440 req/s  p99 4.2-4.7 ms  cpu/req 13-14 us user, 56-64 us sys
+#               with 3.3-3.6 io_uring_enter() calls per request
+#
+# The engines are within run-to-run noise of each other; on a larger host
+# all three came out at 4.7-4.8k req/s.  Counting libc calls with an
+# LD_PRELOAD shim, epoll makes 17.9 system calls per request (an accept,
+# 4 recv, 2 send, 2 epoll_ctl, 2 epoll_wait, 2 fcntl, a socket, a connect
+# and 2 close) and io_uring 3.8, all of them io_uring_enter().  That is
+# about five times fewer, not the order of magnitude hoped for, and it
+# does not show in system time: every request here sets up and tears down
+# two TCP connections, and that work, not entering the kernel, is what
+# the system time goes to.
+#
+import argparse
+import os
+import re
+import signal
+import socket
+import socketserver
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+CURRENT_DIR = os.path.dirname(os.path.abspath(__file__))
+THREADPOOL_PROXY = os.path.join(CURRENT_DIR, '..', 'lab-proxy-threadpool', 'proxy')
+PROXY = os.path.join(CURRENT_DIR, 'proxy')
+
+def free_port():
+    s = socket.socket()
+    s.bind(('localhost', 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+def wait_for_port(port):
+    for i in range(50):
+        try:
+            socket.create_connection(('localhost', port)).close()
+            return
+        except OSError:
+            time.sleep(0.1)
+    sys.exit('nothing listening on port %d' % port)
+
+class Origin(socketserver.ThreadingTCPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+    request_queue_size = 1024
+
+def origin_handler(body):
+    response = ('HTTP/1.0 200 OK\r\n'
+            'Content-Type: application/octet-stream\r\n'
+            'Content-Length: %d\r\n'
+            'Cache-Control: no-store\r\n'
+            'Connection: close\r\n\r\n' % len(body)).encode() + body
+
+    class Handler(socketserver.BaseRequestHandler):
+        def handle(self):
+            data = b''
+            while b'\r\n\r\n' not in data:
+                d = self.request.recv(4096)
+                if not d:
+                    return
+                data += d
+            self.request.sendall(response)
+    return Handler
+
+def cpu_seconds(pid):
+    # utime and stime, fields 14 and 15, counted after the parenthesized
+    # command name since it may hold spaces
+    with open('/proc/%d/stat' % pid) as f:
+        fields = f.read().rsplit(')', 1)[1].split()
+    tick = os.sysconf('SC_CLK_TCK')
+    return int(fields[11]) / tick, int(fields[12]) / tick
+
+def client(proxy_port, origin_port, n, size, results, errors):
+    request = ('GET http://localhost:%d/bench HTTP/1.0\r\n'
+            'Host: localhost:%d\r\n\r\n' % (origin_port, origin_port)).encode()
+    for i in range(n):
+        start = time.monotonic()
+        try:
+            s = socket.create_connection(('localhost', proxy_port))
+            s.sendall(request)
+            got = 0
+            while True:
+                d = s.recv(65536)
+                if not d:
+                    break
+                got += len(d)
+            s.close()
+        except OSError:
+            errors.append(1)
+            continue
+        if got < size:
+            errors.append(1)
+            continue
+        results.append(time.monotonic() - start)
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+def bench(name, argv, origin_port, args):
+    proxy_port = free_port()
+    devnull = open(os.devnull, 'w')
+    stats = tempfile.TemporaryFile()
+    proxy = subprocess.Popen(argv + [str(proxy_port)],
+            stdout=devnull, stderr=stats)
+    try:
+        wait_for_port(proxy_port)
+        user0, sys0 = cpu_seconds(proxy.pid)
+        results = []
+        errors = []
+        threads = [threading.Thread(target=client,
+                args=(proxy_port, origin_port, args.requests, args.size,
+                    results, errors))
+                for i in range(args.clients)]
+        start = time.monotonic()
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        elapsed = time.monotonic() - start
+        user1, sys1 = cpu_seconds(proxy.pid)
+        proxy.send_signal(signal.SIGUSR1)
+        time.sleep(0.2)
+    finally:
+        proxy.kill()
+        proxy.wait()
+    stats.seek(0)
+    enters = sum(int(m) for m in
+            re.findall(rb'(\d+) io_uring_enter calls', stats.read()))
+
+    n = max(len(results), 1)
+    lat = [l * 1000 for l in results] or [0]
+    print('%-10s %6d req %4d err %8.0f req/s  p50 %6.2f ms  p99 %6.2f ms'
+            '  cpu/req %5.1f us user %5.1f us sys' % (name, len(results),
+            len(errors), len(results) / elapsed, percentile(lat, 50),
+            percentile(lat, 99), (user1 - user0) * 1e6 / n,
+            (sys1 - sys0) * 1e6 / n) +
+            ('  %5.2f enter/req' % (enters / n) if enters else ''))
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('-c', '--clients', type=int, default=32)
+    parser.add_argument('-n', '--requests', type=int, default=100,
+            help='requests per client')
+    parser.add_argument('-s', '--size', type=int, default=4096,
+            help='response body bytes')
+    parser.add_argument('-r', '--reactors', type=int, default=1,
+            help='reactors for the epoll and io_uring engines')
+    args = parser.parse_args()
+
+    origin_port = free_port()
+    origin = Origin(('localhost', origin_port),
+            origin_handler(b'x' * args.size))
+    threading.Thread(target=origin.serve_forever, daemon=True).start()
+
+    engines = []
+    if os.access(THREADPOOL_PROXY, os.X_OK):
+        engines.append(('threadpool', [THREADPOOL_PROXY]))
+    reactors = ['-r', str(args.reactors)]
+    engines.append(('epoll', [PROXY, '-e', 'epoll'] + reactors))
+    engines.append(('io_uring', [PROXY, '-e', 'uring'] + reactors))
+    try:
+        for name, argv in engines:
+            bench(name, argv, origin_port, args)
+    finally:
+        origin.shutdown()
+
+if __name__ == '__main__':
+    main()
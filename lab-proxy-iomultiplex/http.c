@@ -0,0 +1,394 @@
+#define _GNU_SOURCE
+#include "http.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+void http_resp_init(http_resp_t *hr, int head_request)
+{
+	hr->state = HTTP_HEADERS;
+	hr->status = 0;
+	hr->keep_alive = 0;
+	hr->content_length = -1;
+	hr->remaining = 0;
+	hr->head_request = head_request;
+	hr->line_state = 0;
+	hr->hdr_len = 0;
+}
+
+/* Does the header line starting at line (and ending before end) contain tok? */
+static int line_has(const char *line, const char *end, const char *tok)
+{
+	const char *eol = memchr(line, '\n', end - line);
+	const char *p = strcasestr(line, tok);
+
+	return p != NULL && (eol == NULL || p < eol);
+}
+
+/*
+ * Scan the header lines from line up to end (the CRLF that ends the
+ * headers) for the fields that decide framing and persistence.
+ * *keep_alive is only changed by an explicit Connection header.
+ */
+static void scan_headers(const char *line, const char *end,
+		long long *content_length, int *chunked, int *keep_alive)
+{
+	for (; line < end; line = memchr(line, '\n', end - line) + 1) {
+		if (strncasecmp(line, "Content-Length:", 15) == 0) {
+			*content_length = strtoll(line + 15, NULL, 10);
+		} else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+			*chunked = line_has(line, end, "chunked");
+		} else if (strncasecmp(line, "Connection:", 11) == 0) {
+			if (line_has(line, end, "close"))
+				*keep_alive = 0;
+			else if (line_has(line, end, "keep-alive"))
+				*keep_alive = 1;
+		}
+	}
+}
+
+/*
+ * Pick the body framing from the complete headers in hr->hdr, following
+ * RFC 9112 section 6.3: no body for HEAD, 1xx, 204 and 304; otherwise
+ * chunked beats Content-Length, and with neither the body runs to close.
+ */
+static void parse_headers(http_resp_t *hr)
+{
+	char *end = hr->hdr + hr->hdr_len - 2;
+	int chunked = 0, minor;
+
+	if (sscanf(hr->hdr, "HTTP/1.%d %d", &minor, &hr->status) != 2) {
+		hr->state = HTTP_ERROR;
+		return;
+	}
+	hr->keep_alive = minor >= 1;
+	scan_headers(memchr(hr->hdr, '\n', end - hr->hdr) + 1, end,
+			&hr->content_length, &chunked, &hr->keep_alive);
+
+	if (hr->head_request || hr->status / 100 == 1 ||
+			hr->status == 204 || hr->status == 304) {
+		hr->state = HTTP_DONE;
+	} else {
+		http_body_init(hr, hr->content_length, chunked);
+		if (hr->state == HTTP_BODY_CLOSE)
+			hr->keep_alive = 0;
+	}
+}
+
+/* Take in as much of the headers as buf holds; returns bytes used */
+static size_t feed_headers(http_resp_t *hr, const char *buf, size_t n)
+{
+	size_t old = hr->hdr_len, from, take;
+	char *end;
+
+	take = n < HTTP_MAX_HEADERS - 1 - old ? n : HTTP_MAX_HEADERS - 1 - old;
+	memcpy(hr->hdr + old, buf, take);
+	hr->hdr_len += take;
+	hr->hdr[hr->hdr_len] = '\0';
+
+	/* the terminator may straddle the previous feed */
+	from = old > 3 ? old - 3 : 0;
+	end = memmem(hr->hdr + from, hr->hdr_len - from, "\r\n\r\n", 4);
+	if (end == NULL) {
+		if (hr->hdr_len == HTTP_MAX_HEADERS - 1)
+			hr->state = HTTP_ERROR;
+		return take;
+	}
+	hr->hdr_len = end + 4 - hr->hdr;
+	hr->hdr[hr->hdr_len] = '\0';
+	parse_headers(hr);
+	return hr->hdr_len - old;
+}
+
+static int hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/*
+ * Start tracking a body whose headers were parsed elsewhere, such as a
+ * request body: chunked if chunked is set, else content_length bytes, else
+ * everything up to EOF.
+ */
+void http_body_init(http_resp_t *hr, long long content_length, int chunked)
+{
+	hr->content_length = content_length;
+	hr->line_state = 0;
+	if (chunked) {
+		hr->state = HTTP_CHUNK_SIZE;
+		hr->remaining = 0;
+	} else if (content_length >= 0) {
+		hr->remaining = content_length;
+		hr->state = content_length > 0 ? HTTP_BODY_LENGTH : HTTP_DONE;
+	} else {
+		hr->state = HTTP_BODY_CLOSE;
+	}
+}
+
+/*
+ * Request parsing.  http_req_parse() is handed the whole receive buffer
+ * each time more arrives, but only looks at bytes past rq->pos, a line at a
+ * time, so a request that trickles in is still scanned once in total.
+ * Nothing is copied: the results are offsets into the buffer, which the
+ * caller may therefore grow or move as long as its contents stay put.
+ */
+
+void http_req_init(http_req_t *rq)
+{
+	memset(rq, 0, sizeof(http_req_t));
+	rq->state = HTTP_REQ_LINE;
+}
+
+static http_str_t str_at(const char *buf, const char *p, size_t len)
+{
+	http_str_t s = { p - buf, len };
+	return s;
+}
+
+/* Does the n-byte value at v contain tok, ignoring case? */
+static int value_has(const char *v, size_t n, const char *tok)
+{
+	size_t tlen = strlen(tok);
+
+	for (; n >= tlen; v++, n--) {
+		if (strncasecmp(v, tok, tlen) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/* Split "host[:port]" (or "[v6addr][:port]") into rq->host and rq->port */
+static int parse_authority(http_req_t *rq, const char *buf, const char *p,
+		size_t n)
+{
+	const char *end = p + n;
+	const char *colon;
+
+	if (n > 0 && *p == '[') {
+		const char *rb = memchr(p, ']', n);
+		if (rb == NULL)
+			return -1;
+		rq->host = str_at(buf, p + 1, rb - p - 1);
+		colon = rb + 1 < end && rb[1] == ':' ? rb + 1 : NULL;
+	} else {
+		colon = memchr(p, ':', n);
+		rq->host = str_at(buf, p, (colon ? colon : end) - p);
+	}
+	rq->port = colon ? str_at(buf, colon + 1, end - colon - 1) :
+		str_at(buf, end, 0);
+	return rq->host.len > 0 ? 0 : -1;
+}
+
+/*
+ * The request line: method, then the target in absolute form
+ * ("http://host:port/path", as clients send to a proxy), origin form
+ * ("/path", with the host from the Host header), or authority form
+ * ("host:port", for CONNECT), then the version.
+ */
+static int parse_request_line(http_req_t *rq, const char *buf,
+		const char *p, size_t n)
+{
+	const char *end = p + n;
+	const char *sp1 = memchr(p, ' ', n);
+	const char *sp2, *uri, *auth, *slash;
+
+	if (sp1 == NULL || sp1 == p)
+		return -1;
+	uri = sp1 + 1;
+	if ((sp2 = memchr(uri, ' ', end - uri)) == NULL || sp2 == uri)
+		return -1;
+	if (end - sp2 - 1 != 8 || memcmp(sp2 + 1, "HTTP/1.", 7) != 0)
+		return -1;
+	rq->method = str_at(buf, p, sp1 - p);
+	rq->uri = str_at(buf, uri, sp2 - uri);
+	rq->version = str_at(buf, sp2 + 1, 8);
+	rq->keep_alive = sp2[8] != '0';
+
+	if (*uri == '/') {
+		rq->path = rq->uri;
+		return 0;
+	}
+	if (sp2 - uri > 7 && strncasecmp(uri, "http://", 7) == 0) {
+		auth = uri + 7;
+		if ((slash = memchr(auth, '/', sp2 - auth)) == NULL)
+			slash = sp2;
+		rq->path = str_at(buf, slash, sp2 - slash);
+		return parse_authority(rq, buf, auth, slash - auth);
+	}
+	rq->path = str_at(buf, sp2, 0);
+	return parse_authority(rq, buf, uri, sp2 - uri);
+}
+
+/* One header line (without its line ending) */
+static int parse_header_line(http_req_t *rq, const char *buf,
+		const char *p, size_t n)
+{
+	const char *colon = memchr(p, ':', n);
+	const char *v, *end = p + n;
+	size_t nlen;
+
+	if (colon == NULL || colon == p)
+		return -1;
+	nlen = colon - p;
+	for (v = colon + 1; v < end && (*v == ' ' || *v == '\t'); v++)
+		;
+	while (end > v && (end[-1] == ' ' || end[-1] == '\t'))
+		end--;
+	rq->nheaders++;
+
+	if (nlen == 4 && strncasecmp(p, "Host", 4) == 0) {
+		// an absolute URI overrides Host (RFC 9112 section 3.2.2)
+		if (rq->host.len == 0)
+			return parse_authority(rq, buf, v, end - v);
+	} else if (nlen == 14 && strncasecmp(p, "Content-Length", 14) == 0) {
+		rq->content_length = 0;
+		for (; v < end; v++) {
+			if (*v < '0' || *v > '9' || rq->content_length > (1LL << 50))
+				return -1;
+			rq->content_length = rq->content_length * 10 + (*v - '0');
+		}
+	} else if (nlen == 17 && strncasecmp(p, "Transfer-Encoding", 17) == 0) {
+		rq->chunked = value_has(v, end - v, "chunked");
+	} else if (nlen == 10 && strncasecmp(p, "Connection", 10) == 0) {
+		if (value_has(v, end - v, "close"))
+			rq->keep_alive = 0;
+		else if (value_has(v, end - v, "keep-alive"))
+			rq->keep_alive = 1;
+	}
+	return 0;
+}
+
+/*
+ * Continue parsing the request at the start of buf, which now holds len
+ * bytes.  Returns 1 once the request line and headers are complete (and
+ * rq->hdr_len says where they end), 0 if more bytes are needed, or -1 if
+ * the request is malformed.
+ */
+int http_req_parse(http_req_t *rq, const char *buf, size_t len)
+{
+	const char *nl, *line;
+	size_t n;
+
+	while (rq->state != HTTP_REQ_DONE) {
+		if (rq->state == HTTP_REQ_ERROR)
+			return -1;
+		if ((nl = memchr(buf + rq->pos, '\n', len - rq->pos)) == NULL) {
+			rq->pos = len;
+			return 0;
+		}
+		line = buf + rq->line;
+		n = nl - line;
+		if (n > 0 && line[n - 1] == '\r')
+			n--;
+		rq->pos = rq->line = nl + 1 - buf;
+
+		if (rq->state == HTTP_REQ_LINE) {
+			// RFC 9112 section 2.2: ignore blank lines before the request
+			if (n == 0)
+				continue;
+			if (parse_request_line(rq, buf, line, n) < 0) {
+				rq->state = HTTP_REQ_ERROR;
+				continue;
+			}
+			rq->headers = str_at(buf, nl + 1, 0);
+			rq->state = HTTP_REQ_HEADERS;
+		} else if (n == 0) {
+			rq->headers.len = line - buf - rq->headers.off;
+			rq->hdr_len = rq->pos;
+			rq->state = rq->host.len > 0 ? HTTP_REQ_DONE : HTTP_REQ_ERROR;
+		} else if (parse_header_line(rq, buf, line, n) < 0) {
+			rq->state = HTTP_REQ_ERROR;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Account for n more response bytes.  Returns how many of them belong to
+ * this response: fewer than n only once the response is complete (state
+ * HTTP_DONE), in which case the rest belong to whatever follows.  Returns
+ * -1 if the response is malformed.
+ */
+ssize_t http_resp_feed(http_resp_t *hr, const char *buf, size_t n)
+{
+	size_t used = 0, k;
+	int v;
+	char c;
+
+	while (used < n && hr->state != HTTP_DONE && hr->state != HTTP_ERROR) {
+		switch (hr->state) {
+		case HTTP_HEADERS:
+			used += feed_headers(hr, buf + used, n - used);
+			break;
+		case HTTP_BODY_LENGTH:
+		case HTTP_CHUNK_DATA:
+			k = n - used < hr->remaining ? n - used : hr->remaining;
+			hr->remaining -= k;
+			used += k;
+			if (hr->remaining == 0)
+				hr->state = hr->state == HTTP_BODY_LENGTH ?
+					HTTP_DONE : HTTP_CHUNK_CRLF;
+			break;
+		case HTTP_BODY_CLOSE:
+			used = n;
+			break;
+		case HTTP_CHUNK_SIZE:
+			/* line_state: 0 in the hex size, 1 in a chunk extension */
+			c = buf[used++];
+			if (c == '\n') {
+				hr->line_state = 0;
+				hr->state = hr->remaining > 0 ? HTTP_CHUNK_DATA : HTTP_TRAILER;
+			} else if (hr->line_state == 0 && (v = hexval(c)) >= 0) {
+				if (hr->remaining > (1LL << 40)) {
+					hr->state = HTTP_ERROR;
+				}
+				hr->remaining = hr->remaining * 16 + v;
+			} else if (c == ';' || c == ' ' || c == '\t') {
+				hr->line_state = 1;
+			} else if (c != '\r' && hr->line_state == 0) {
+				hr->state = HTTP_ERROR;
+			}
+			break;
+		case HTTP_CHUNK_CRLF:
+			c = buf[used++];
+			if (c == '\n') {
+				hr->state = HTTP_CHUNK_SIZE;
+				hr->remaining = 0;
+			} else if (c != '\r') {
+				hr->state = HTTP_ERROR;
+			}
+			break;
+		case HTTP_TRAILER:
+			/* line_state: 0 at the start of a line, 1 inside one */
+			c = buf[used++];
+			if (c == '\n') {
+				if (hr->line_state == 0)
+					hr->state = HTTP_DONE;
+				hr->line_state = 0;
+			} else if (c != '\r') {
+				hr->line_state = 1;
+			}
+			break;
+		}
+	}
+	return hr->state == HTTP_ERROR ? -1 : (ssize_t)used;
+}
+
+/*
+ * Account for n body bytes that were relayed without being fed through
+ * http_resp_feed() (e.g., by splice()).  Only valid in HTTP_BODY_LENGTH,
+ * for at most hr->remaining bytes.
+ */
+void http_resp_advance(http_resp_t *hr, size_t n)
+{
+	hr->remaining -= n;
+	if (hr->remaining == 0)
+		hr->state = HTTP_DONE;
+}
@@ -0,0 +1,168 @@
+#include "pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+
+/*
+ * Upstream connection pool, as in the thread pool proxy, but one per
+ * reactor.  After a response that leaves its connection open, the reactor
+ * parks the socket here under the origin's host:port, and the next request
+ * to that origin takes it back instead of connecting again.  Each origin
+ * keeps at most POOL_MAX_PER_ORIGIN idle sockets, and none is kept longer
+ * than POOL_IDLE_TIMEOUT seconds; servers time out idle keep-alive
+ * connections on their own, so holding them longer only collects dead
+ * sockets.  Whether one has died sooner is for the caller to find out.
+ */
+
+static time_t now_secs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static unsigned int hash_key(const char *key)
+{
+	unsigned int h = 2166136261u;
+	while (*key) {
+		h ^= (unsigned char)*key++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* Find the origin for key, creating it if create is set */
+static pool_origin_t *find_origin(pool_t *pp, const char *key, int create)
+{
+	unsigned int b = hash_key(key) % POOL_NBUCKETS;
+	pool_origin_t *o;
+
+	for (o = pp->buckets[b]; o; o = o->next) {
+		if (strcmp(o->key, key) == 0)
+			return o;
+	}
+	if (!create || (o = calloc(1, sizeof(pool_origin_t))) == NULL)
+		return NULL;
+	if ((o->key = strdup(key)) == NULL) {
+		free(o);
+		return NULL;
+	}
+	o->next = pp->buckets[b];
+	pp->buckets[b] = o;
+	return o;
+}
+
+/*
+ * Close every idle connection that has expired.  The lists are most recent
+ * first, so the expired ones are always a tail.
+ */
+static void sweep(pool_t *pp, time_t now)
+{
+	pool_origin_t *o;
+	pool_conn_t **cpp, *c;
+	int b;
+
+	for (b = 0; b < POOL_NBUCKETS; b++) {
+		for (o = pp->buckets[b]; o; o = o->next) {
+			for (cpp = &o->idle; *cpp && (*cpp)->expires > now; cpp = &(*cpp)->next)
+				;
+			while ((c = *cpp) != NULL) {
+				*cpp = c->next;
+				pp->close(pp->arg, c->fd);
+				free(c);
+				o->nidle--;
+			}
+		}
+	}
+	pp->last_sweep = now;
+}
+
+/* Create an empty pool that drops connections with close(arg, fd) */
+void pool_init(pool_t *pp, void (*close)(void *, int), void *arg)
+{
+	memset(pp->buckets, 0, sizeof(pp->buckets));
+	pp->last_sweep = now_secs();
+	pp->close = close;
+	pp->arg = arg;
+}
+
+/* Close every pooled connection and free the pool */
+void pool_deinit(pool_t *pp)
+{
+	pool_origin_t *o, *onext;
+	pool_conn_t *c, *cnext;
+	int b;
+
+	for (b = 0; b < POOL_NBUCKETS; b++) {
+		for (o = pp->buckets[b]; o; o = onext) {
+			onext = o->next;
+			for (c = o->idle; c; c = cnext) {
+				cnext = c->next;
+				pp->close(pp->arg, c->fd);
+				free(c);
+			}
+			free(o->key);
+			free(o);
+		}
+		pp->buckets[b] = NULL;
+	}
+}
+
+/*
+ * Take an idle connection to host:port out of the pool.  Returns it, now
+ * the caller's, or -1 if there is none.
+ */
+int pool_get(pool_t *pp, const char *host, const char *port)
+{
+	char key[NI_MAXHOST + NI_MAXSERV + 2];
+	pool_origin_t *o;
+	pool_conn_t *c;
+	time_t now = now_secs();
+	int fd;
+
+	snprintf(key, sizeof(key), "%s:%s", host, port);
+	if ((o = find_origin(pp, key, 0)) == NULL)
+		return -1;
+	while ((c = o->idle) != NULL) {
+		o->idle = c->next;
+		o->nidle--;
+		fd = c->fd;
+		if (c->expires > now) {
+			free(c);
+			return fd;
+		}
+		pp->close(pp->arg, fd);
+		free(c);
+	}
+	return -1;
+}
+
+/*
+ * Return a connection to host:port to the pool once its response has been
+ * read in full.  If the origin already has POOL_MAX_PER_ORIGIN idle
+ * connections, fd is closed instead.
+ */
+void pool_put(pool_t *pp, const char *host, const char *port, int fd)
+{
+	char key[NI_MAXHOST + NI_MAXSERV + 2];
+	pool_origin_t *o;
+	pool_conn_t *c = malloc(sizeof(pool_conn_t));
+	time_t now = now_secs();
+
+	snprintf(key, sizeof(key), "%s:%s", host, port);
+	if (now != pp->last_sweep)
+		sweep(pp, now);
+	o = find_origin(pp, key, 1);
+	if (c == NULL || o == NULL || o->nidle >= POOL_MAX_PER_ORIGIN) {
+		free(c);
+		pp->close(pp->arg, fd);
+		return;
+	}
+	c->fd = fd;
+	c->expires = now + POOL_IDLE_TIMEOUT;
+	c->next = o->idle;
+	o->idle = c;
+	o->nidle++;
+}
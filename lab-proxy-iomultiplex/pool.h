@@ -0,0 +1,43 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <time.h>
+
+#define POOL_MAX_PER_ORIGIN 8   /* idle connections kept per host:port */
+#define POOL_IDLE_TIMEOUT 30    /* seconds an idle connection is kept */
+#define POOL_NBUCKETS 64
+
+/* An idle connection to an origin, waiting to be reused */
+typedef struct pool_conn {
+	int fd;
+	time_t expires;             /* CLOCK_MONOTONIC second it is dropped */
+	struct pool_conn *next;
+} pool_conn_t;
+
+/* All idle connections to one host:port, most recently used first */
+typedef struct pool_origin {
+	char *key;                  /* "host:port" */
+	pool_conn_t *idle;
+	int nidle;
+	struct pool_origin *next;   /* Next origin in the same hash bucket */
+} pool_origin_t;
+
+/*
+ * One reactor's idle origin connections.  Only the owning reactor uses
+ * it, so there is no lock.  The connections are whatever the reactor's
+ * engine calls a socket (a descriptor, or a fixed descriptor slot), and
+ * close is how the pool gets rid of one.
+ */
+typedef struct {
+	pool_origin_t *buckets[POOL_NBUCKETS];
+	time_t last_sweep;          /* When expired connections were last closed */
+	void (*close)(void *arg, int fd);
+	void *arg;
+} pool_t;
+
+void pool_init(pool_t *pp, void (*close)(void *, int), void *arg);
+void pool_deinit(pool_t *pp);
+int pool_get(pool_t *pp, const char *host, const char *port);
+void pool_put(pool_t *pp, const char *host, const char *port, int fd);
+
+#endif /* __POOL_H__ */
@@ -1,37 +1,499 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include "alog.h"
+#include "http.h"
+#include "pool.h"
+#include "resolver.h"
+#include "uring.h"
 
 /* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
+#define MAXEVENTS 64
+#define REQ_BUF_SIZE 8192
+#define RELAY_BUF_SIZE 16384
+#define RELAY_PIPE_SIZE 65536
+
+#define MAX_REACTORS 64
+
+/*
+ * Deadlines, in seconds.  A client has HEADER_TIMEOUT to get its request
+ * in, however it spaces out the bytes, and a keep-alive client has
+ * KEEPALIVE_TIMEOUT to start its next one; no request may go IDLE_TIMEOUT
+ * without either of its sockets becoming ready; and none may take longer
+ * than REQUEST_TIMEOUT all told.  Each reactor keeps its requests on a
+ * timer wheel of WHEEL_SLOTS one-second slots, so arming and checking a
+ * deadline is O(1) however many connections there are.
+ */
+#define KEEPALIVE_TIMEOUT 5
+#define HEADER_TIMEOUT 10
+#define IDLE_TIMEOUT 30
+#define REQUEST_TIMEOUT 300
+#define WHEEL_SLOTS 64
+/* One resolver thread keeps getaddrinfo() off every reactor's loop */
+#define NRESOLVERS 1
+
+/* Which deadline a request missed; indexes reactor.timed_out */
+#define TIMEOUT_HEADER 0
+#define TIMEOUT_IDLE 1
+#define TIMEOUT_REQUEST 2
+
+/*
+ * The io_uring engine (-e uring), per reactor: the submission queue size,
+ * the table of fixed descriptors that accepted and origin sockets live in,
+ * and the provided buffers that every receive lands in.
+ */
+#define URING_ENTRIES 256
+#define URING_FILES 4096
+#define URING_NBUFS 512
+#define URING_BUF_SIZE RELAY_BUF_SIZE
+
+/*
+ * What a completion is for, in the low bits of its user_data; the rest is
+ * the request it belongs to, or NULL for the reactor's own operations.
+ * Completions with user_data 0 (cancels and closes) need no handling.
+ */
+#define OP_ACCEPT 1     /* no request: the multishot accept */
+#define OP_RESOLVED 2   /* no request: the resolver's pipe is readable */
+#define OP_CRECV 1      /* multishot recv from the client */
+#define OP_SRECV 2      /* recv from the server (multishot in a tunnel) */
+#define OP_SOCKET 3     /* creating the server socket */
+#define OP_CONNECT 4    /* connecting it */
+#define OP_SREQ 5       /* sending the request to the server */
+#define OP_CSEND 6      /* sending a buffer of the response to the client */
+#define OP_SSEND 7      /* sending a body (or tunnel) buffer to the server */
+#define OP_MASK 7
+
+/* Client request states */
+#define READ_REQUEST 1
+#define RESOLVE_HOST 2
+#define SEND_REQUEST 3
+#define READ_RESPONSE 4
+#define SEND_RESPONSE 5
+#define ESTABLISH 6     /* CONNECT: connecting, then telling the client so */
+#define TUNNEL 7        /* CONNECT: relaying bytes both ways */
+#define SEND_BODY 8     /* epoll: relaying the request body to the server */
+
+/*
+ * The two directions of a tunnel, indexing request_info.tun and the uring
+ * engine's send queues: bytes on their way to the client, from the server,
+ * and on their way to the server, from the client.
+ */
+#define TO_CLIENT 0
+#define TO_SERVER 1
+
+/*
+ * One direction of an epoll engine tunnel.  Bytes go from one socket to
+ * the other through a pipe with splice(), never entering user space; if
+ * no pipe could be had, they are copied through buf instead.  buf also
+ * starts out holding anything the client sent after its CONNECT, which
+ * goes to the server first.
+ */
+struct tunnel_dir {
+	int from, to;
+	int pipe[2];                    /* -1 if copying through buf */
+	int in_pipe;                    /* bytes spliced in, not yet out */
+	char *buf;
+	int size;                       /* bytes buf holds */
+	int off, len;                   /* buf[off..len) is yet to be sent */
+	int eof;                        /* from has closed its side */
+	int shut;                       /* ...and to has been told */
+};
+
+/*
+ * One event loop.  With -r N, N reactors run in parallel, each on its own
+ * thread with its own epoll instance and its own SO_REUSEPORT listening
+ * socket, so the kernel spreads new connections across them and they
+ * share nothing while handling requests.  The counters are written only by
+ * the owning reactor.
+ */
+struct reactor {
+	int id;
+	int efd;                        /* this reactor's epoll instance */
+	uring_t *ring;                  /* ... or its ring, with -e uring */
+	uring_t uring;                  /* what ring points to */
+	struct request_info *starved;   /* uring: requests out of buffers */
+	int accept_paused;              /* uring: fixed descriptors ran out */
+	int sfd;                        /* this reactor's listening socket */
+	resolver_cq_t cq;               /* finished origin lookups */
+	pool_t pool;                    /* idle keep-alive origin connections */
+	struct request_info *active;    /* list of all active requests, */
+	                                /* for cleanup on shutdown */
+	struct request_info *released;  /* epoll: to free after this batch */
+	int nactive;                    /* requests currently open */
+	unsigned long accepted;         /* connections accepted */
+	unsigned long tunnels;          /* CONNECT tunnels established */
+	unsigned long reused;           /* requests sent on a pooled connection */
+	unsigned long completed;        /* responses relayed in full */
+	unsigned long failed;           /* requests cancelled on error */
+	unsigned long timed_out[3];     /* requests dropped, by TIMEOUT_* */
+	struct request_info *wheel[WHEEL_SLOTS]; /* requests by deadline % slots */
+	time_t wheel_next;              /* next second the wheel has to check */
+	int stats_seen;                 /* last stats_requested reported */
+	struct timespec started;
+	pthread_t tid;
+};
+
+struct request_info {
+	struct reactor *r;              /* reactor that owns this request */
+	int cfd;                        /* socket connected to the client */
+	int sfd;                        /* socket connected to the Web server */
+	int state;
+	char req[REQ_BUF_SIZE];         /* request as read from the client */
+	int req_read;                   /* bytes read from the client */
+	http_req_t parsed;              /* parser progress through req */
+	int has_body;                   /* the request has a body, */
+	http_resp_t parsed_body;        /* ...framed as this tracks */
+	int req_sent, req_end;          /* req[req_sent..req_end) is yet to go */
+	                                /* to the server: the start of a body, */
+	                                /* or what followed a CONNECT */
+	char host[NI_MAXHOST];          /* the server, as the pool knows it */
+	char port[NI_MAXSERV];
+	int reused;                     /* sfd came from the pool */
+	char sreq[REQ_BUF_SIZE + 1024]; /* request to send to the server */
+	int sreq_len;                   /* bytes to write to the server */
+	int sreq_written;               /* bytes written to the server */
+	char resp[RELAY_BUF_SIZE];      /* response bytes not yet sent on */
+	int resp_len;                   /* bytes of resp filled from the server */
+	int resp_written;               /* bytes of resp written to the client */
+	http_resp_t parsed_resp;        /* the response's framing so far */
+	int passthrough;                /* ...which did not parse: relay to EOF */
+	int leftover;                   /* server sent more than the response */
+	int server_eof;                 /* server has closed its side */
+	long resp_total;                /* total bytes relayed to the client */
+	int client_close;               /* no more requests on this connection */
+	int served;                     /* responses it has had in full */
+	int tunnel;                     /* a CONNECT: sreq is the client's 200 */
+	char logline[256];              /* its method and target, if it is to be */
+	                                /* logged; "" once it has been */
+	long long log_start;            /* ...and when it began, in us */
+	struct tunnel_dir tun[2];       /* epoll engine, in TUNNEL: by TO_* */
+	time_t started;                 /* CLOCK_MONOTONIC second accepted */
+	time_t last_active;             /* ...and of the last readiness event */
+	time_t deadline;                /* the earliest of its deadlines */
+	struct request_info *tprev;     /* neighbors in its wheel slot */
+	struct request_info *tnext;
+	struct request_info *prev;      /* neighbors in r->active */
+	struct request_info *next;
+	int closing;                    /* released; freed once nothing names it */
+	int ops;                        /* operations in flight that name it; */
+	                                /* with epoll, only a pending lookup */
+	struct request_info *rnext;     /* epoll: on r->released */
+	/* uring engine only; cfd and sfd are fixed descriptor slots */
+	int crecv, srecv;               /* multishot recv armed on each socket */
+	int sending[2];                 /* a send is in flight, by TO_* */
+	int starved;                    /* on r->starved, waiting for buffers */
+	struct request_info *snext;
+	struct sockaddr_storage addr;   /* server address, for the connect */
+	socklen_t addrlen;
+	int socktype;
+	/* buffers to send on, by TO_*: bid << 16 | len */
+	unsigned int outq[2][URING_NBUFS];
+	int outq_head[2], outq_len[2];
+	int out_off[2];                 /* bytes of each head buffer already sent */
+	int eof[2];                     /* no more will be queued, by TO_* */
+	int shut[2];                    /* tunnel: ...and the receiver was told */
+};
 
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10.15; rv:97.0) Gecko/20100101 Firefox/97.0";
 
-int all_headers_received(char *);
-int parse_request(char *, char *, char *, char *, char *, char *);
+volatile sig_atomic_t shutting_down = 0;
+volatile sig_atomic_t stats_requested = 0;
+int verbose = 0;                        /* -v or -l: keep an access log */
+
 void test_parser();
 void print_bytes(unsigned char *, int);
+int open_sfd(const char *);
+int set_nonblocking(int);
+void *run_reactor(void *);
+void print_reactor_stats(struct reactor *);
+void handle_new_clients(struct reactor *);
+void handle_resolved(struct reactor *);
+void handle_client(struct request_info *);
+time_t now_secs(void);
+long long now_us(void);
+void arm_timer(struct request_info *);
+void set_timer(struct request_info *, time_t);
+void disarm_timer(struct request_info *);
+void expire_timers(struct reactor *);
+int read_request(struct request_info *);
+void refuse_oversized(struct request_info *);
+void refuse_request(struct request_info *, const char *);
+int start_request(struct request_info *, int);
+int connect_request(struct request_info *, resolver_entry_t *);
+int lookup_origin(struct request_info *);
+int take_origin(struct request_info *);
+int reuse_origin(struct request_info *);
+int can_retry(struct request_info *);
+int retry_origin(struct request_info *);
+void close_origin(struct request_info *);
+void close_pooled(void *, int);
+int keeping_alive(struct request_info *);
+int send_request(struct request_info *);
+int send_body(struct request_info *);
+void keep_pipelined(struct request_info *, const char *, int);
+int read_response(struct request_info *);
+int send_response(struct request_info *);
+int frame_response(struct request_info *, const char *, int);
+int end_response(struct request_info *);
+int complete_response(struct request_info *);
+int server_idle(struct request_info *);
+void next_request(struct request_info *);
+int establish_tunnel(struct request_info *);
+int open_tunnel(struct request_info *);
+int relay_tunnel(struct request_info *);
+int pump_tunnel(struct tunnel_dir *);
+void cancel_request(struct request_info *);
+void finish_request(struct request_info *);
+void free_request(struct request_info *);
+void log_request(struct request_info *);
+void free_released(struct reactor *);
+void sigint_handler(int);
+void sigusr1_handler(int);
+void *run_reactor_uring(void *);
+unsigned long long op_data(struct request_info *, int);
+struct io_uring_sqe *next_sqe(struct reactor *);
+void uring_arm_accept(struct reactor *);
+void uring_arm_resolver(struct reactor *);
+void uring_new_client(struct reactor *, int);
+void uring_completion(struct reactor *, struct io_uring_cqe *);
+void uring_request_completion(struct request_info *, int, struct io_uring_cqe *);
+int uring_client_data(struct request_info *, struct io_uring_cqe *);
+int uring_relay_data(struct request_info *, int, struct io_uring_cqe *);
+int uring_sent(struct request_info *, int, int);
+int uring_send_next(struct request_info *, int);
+int uring_open_tunnel(struct request_info *);
+int uring_next_request(struct request_info *);
+void uring_arm_recv(struct request_info *, int);
+void uring_starve(struct request_info *);
+void uring_feed_starved(struct reactor *);
+int uring_connect(struct request_info *, resolver_entry_t *);
+void uring_release(struct request_info *);
+void uring_reap(struct request_info *);
 
 
-int main()
+int main(int argc, char *argv[])
 {
-	test_parser();
+	struct reactor reactors[MAX_REACTORS];
+	struct sigaction sigact;
+	void *(*run)(void *) = run_reactor;
+	int nreactors = 1;
+	const char *log_path = NULL;
+	int log_sample = 1;
+	int opt, i;
+
+	// test_parser();
 	printf("%s\n", user_agent_hdr);
+
+	while ((opt = getopt(argc, argv, "e:l:r:s:v")) != -1) {
+		switch (opt) {
+		case 'e':
+			if (strcmp(optarg, "uring") == 0) {
+				run = run_reactor_uring;
+			} else if (strcmp(optarg, "epoll") != 0) {
+				nreactors = 0;
+			}
+			break;
+		case 'l':
+			log_path = optarg;
+			verbose = 1;
+			break;
+		case 'r':
+			nreactors = atoi(optarg);
+			break;
+		case 's':
+			log_sample = atoi(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			nreactors = 0;
+		}
+	}
+	if (optind != argc - 1 || nreactors < 1 || nreactors > MAX_REACTORS || log_sample < 1) {
+		fprintf(stderr, "Usage: %s [-e epoll|uring] [-l log file] [-r reactors] [-s log 1 in n] [-v] port\n", argv[0]);
+		exit(1);
+	}
+
+	memset(&sigact, 0, sizeof(sigact));
+	sigact.sa_handler = sigint_handler;
+	sigaction(SIGINT, &sigact, NULL);
+	sigact.sa_handler = sigusr1_handler;
+	sigaction(SIGUSR1, &sigact, NULL);
+	// a client hanging up mid-response must not kill the proxy
+	signal(SIGPIPE, SIG_IGN);
+
+	// from here stdout is the log's, written in batches by its own thread
+	// underneath stdio, so whatever stdio holds goes out first
+	fflush(stdout);
+	if (verbose && alog_open(log_path, log_sample) < 0) {
+		perror(log_path != NULL ? log_path : "access log");
+		exit(1);
+	}
+	resolver_init(NRESOLVERS);
+	for (i = 0; i < nreactors; i++) {
+		memset(&reactors[i], 0, sizeof(struct reactor));
+		reactors[i].id = i;
+		reactors[i].efd = -1;
+		pool_init(&reactors[i].pool, close_pooled, &reactors[i]);
+		if (run == run_reactor && (reactors[i].efd = epoll_create1(0)) < 0) {
+			perror("epoll_create1");
+			exit(1);
+		}
+		reactors[i].sfd = open_sfd(argv[optind]);
+		if (resolver_cq_init(&reactors[i].cq) < 0) {
+			perror("resolver_cq_init");
+			exit(1);
+		}
+	}
+
+	// reactor 0 runs on the main thread, so the default of one reactor
+	// needs no threads at all
+	for (i = 1; i < nreactors; i++) {
+		pthread_create(&reactors[i].tid, NULL, run, &reactors[i]);
+	}
+	run(&reactors[0]);
+	for (i = 1; i < nreactors; i++) {
+		pthread_join(reactors[i].tid, NULL);
+	}
+
+	resolver_deinit();
+	alog_close();
+	for (i = 0; i < nreactors; i++) {
+		print_reactor_stats(&reactors[i]);
+		resolver_cq_deinit(&reactors[i].cq);
+		close(reactors[i].sfd);
+		if (reactors[i].efd >= 0) {
+			close(reactors[i].efd);
+		}
+	}
 	return 0;
 }
 
-int all_headers_received(char *request) {
-	return 0;
+/* Event loop for one reactor; returns once SIGINT has been received */
+void *run_reactor(void *vargp) {
+	struct reactor *r = (struct reactor *)vargp;
+	struct epoll_event event;
+	struct epoll_event *events;
+	int n, i;
+
+	// the listening socket is the only one registered with a NULL pointer
+	event.data.ptr = NULL;
+	event.events = EPOLLIN | EPOLLET;
+	if (epoll_ctl(r->efd, EPOLL_CTL_ADD, r->sfd, &event) < 0) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+	event.data.ptr = &r->cq;
+	if (epoll_ctl(r->efd, EPOLL_CTL_ADD, r->cq.fds[0], &event) < 0) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+
+	events = calloc(MAXEVENTS, sizeof(struct epoll_event));
+	clock_gettime(CLOCK_MONOTONIC, &r->started);
+	r->wheel_next = r->started.tv_sec;
+
+	while (!shutting_down) {
+		if (r->stats_seen != stats_requested) {
+			r->stats_seen = stats_requested;
+			print_reactor_stats(r);
+		}
+
+		n = epoll_wait(r->efd, events, MAXEVENTS, 1000);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("epoll_wait");
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == NULL) {
+				handle_new_clients(r);
+				continue;
+			}
+			if (events[i].data.ptr == &r->cq) {
+				handle_resolved(r);
+				continue;
+			}
+			// both of a request's sockets can be in one batch, and
+			// handling the first may have released it
+			if (((struct request_info *)events[i].data.ptr)->closing) {
+				continue;
+			}
+			if (events[i].events & EPOLLERR) {
+				cancel_request((struct request_info *)events[i].data.ptr);
+				continue;
+			}
+			handle_client((struct request_info *)events[i].data.ptr);
+		}
+		expire_timers(r);
+		free_released(r);
+	}
+
+	while (r->active != NULL) {
+		free_request(r->active);
+	}
+	free_released(r);
+	pool_deinit(&r->pool);
+	free(events);
+	return NULL;
 }
 
-int parse_request(char *request, char *method,
-		char *hostname, char *port, char *path, char *headers) {
-	return 0;
+/*
+ * Print one reactor's counters to stderr.  Sent for every reactor on
+ * SIGUSR1 (each reactor reports for itself within a second) and at exit.
+ */
+void print_reactor_stats(struct reactor *r) {
+	struct timespec now;
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = (now.tv_sec - r->started.tv_sec) +
+		(now.tv_nsec - r->started.tv_nsec) / 1e9;
+	fprintf(stderr, "reactor %d: %lu accepted, %lu tunnels, %lu origin reuses, "
+			"%d active, %lu completed, "
+			"%lu failed, %lu timed out (%lu header, %lu idle, %lu request), "
+			"%.1f req/s\n", r->id, r->accepted, r->tunnels, r->reused, r->nactive,
+			r->completed, r->failed,
+			r->timed_out[TIMEOUT_HEADER] + r->timed_out[TIMEOUT_IDLE] +
+			r->timed_out[TIMEOUT_REQUEST], r->timed_out[TIMEOUT_HEADER],
+			r->timed_out[TIMEOUT_IDLE], r->timed_out[TIMEOUT_REQUEST],
+			secs > 0 ? r->completed / secs : 0.0);
+	if (r->ring != NULL) {
+		fprintf(stderr, "reactor %d: %lu io_uring_enter calls, %.1f completions each\n",
+				r->id, r->ring->enters,
+				r->ring->enters ? (double)r->ring->completions / r->ring->enters : 0.0);
+	}
+}
+
+void sigint_handler(int sig) {
+	shutting_down = 1;
+}
+
+void sigusr1_handler(int sig) {
+	stats_requested++;
 }
 
 void test_parser() {
 	int i;
-	char method[16], hostname[64], port[8], path[64], headers[1024];
-
+	http_req_t rq;
        	char *reqs[] = {
 		"GET http://www.example.com/index.html HTTP/1.0\r\n"
 		"Host: www.example.com\r\n"
@@ -50,22 +512,1746 @@ void test_parser() {
 
 		"GET http://www.example.com:8080/index.html HTTP/1.0\r\n",
 
+		"CONNECT www.example.com:443 HTTP/1.1\r\n"
+		"Host: www.example.com:443\r\n\r\n",
+
 		NULL
 	};
 	
 	for (i = 0; reqs[i] != NULL; i++) {
 		printf("Testing %s\n", reqs[i]);
-		if (parse_request(reqs[i], method, hostname, port, path, headers)) {
-			printf("METHOD: %s\n", method);
-			printf("HOSTNAME: %s\n", hostname);
-			printf("PORT: %s\n", port);
-			printf("HEADERS: %s\n", headers);
+		http_req_init(&rq);
+		if (http_req_parse(&rq, reqs[i], strlen(reqs[i])) == 1) {
+			printf("METHOD: %.*s\n", (int)rq.method.len, reqs[i] + rq.method.off);
+			printf("HOSTNAME: %.*s\n", (int)rq.host.len, reqs[i] + rq.host.off);
+			printf("PORT: %.*s\n", (int)rq.port.len, reqs[i] + rq.port.off);
+			printf("PATH: %.*s\n", (int)rq.path.len, reqs[i] + rq.path.off);
+			printf("HEADERS: %.*s\n", (int)rq.headers.len, reqs[i] + rq.headers.off);
 		} else {
 			printf("REQUEST INCOMPLETE\n");
 		}
 	}
 }
 
+int set_nonblocking(int fd) {
+	return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+int open_sfd(const char *port) {
+	int sfd, s;
+	struct addrinfo hints;
+	struct addrinfo *result;
+	memset(&hints, 0, sizeof(struct addrinfo));
+
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = 0;
+	hints.ai_flags = AI_PASSIVE;
+
+	s = getaddrinfo(NULL, port, &hints, &result);
+	if (s != 0) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
+		exit(1);
+	}
+
+	if ((sfd = socket(result->ai_family, result->ai_socktype, 0)) < 0) {
+		perror("Error creating socket");
+		exit(1);
+	}
+
+	int optval = 1;
+	setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval));
+
+	if (bind(sfd, result->ai_addr, result->ai_addrlen) < 0) {
+		perror("Could not bind");
+		exit(1);
+	}
+	freeaddrinfo(result);
+
+	if (listen(sfd, 100) < 0) {
+		perror("Could not listen");
+		exit(1);
+	}
+
+	if (set_nonblocking(sfd) < 0) {
+		perror("fcntl");
+		exit(1);
+	}
+
+	return sfd;
+}
+
+/*
+ * Accept every pending client, make it non-blocking, and register it with
+ * the epoll instance.  Each connection gets a struct request_info starting
+ * in READ_REQUEST.
+ */
+void handle_new_clients(struct reactor *r) {
+	struct sockaddr_storage clientaddr;
+	socklen_t clientlen;
+	struct epoll_event event;
+	struct request_info *ri;
+	int cfd;
+
+	while (1) {
+		clientlen = sizeof(struct sockaddr_storage);
+		cfd = accept(r->sfd, (struct sockaddr *)&clientaddr, &clientlen);
+		if (cfd < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				// no more clients ready to accept
+				break;
+			}
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			// out of descriptors or memory; try again on the next event
+			perror("accept");
+			break;
+		}
+
+		if (set_nonblocking(cfd) < 0 ||
+				(ri = calloc(1, sizeof(struct request_info))) == NULL) {
+			close(cfd);
+			continue;
+		}
+		ri->r = r;
+		ri->cfd = cfd;
+		ri->sfd = -1;
+		ri->state = READ_REQUEST;
+		http_req_init(&ri->parsed);
+		ri->started = ri->last_active = now_secs();
+
+		event.data.ptr = ri;
+		event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		if (epoll_ctl(r->efd, EPOLL_CTL_ADD, cfd, &event) < 0) {
+			perror("epoll_ctl");
+			close(cfd);
+			free(ri);
+			continue;
+		}
+
+		ri->next = r->active;
+		if (r->active != NULL) {
+			r->active->prev = ri;
+		}
+		r->active = ri;
+		r->nactive++;
+		r->accepted++;
+		arm_timer(ri);
+	}
+}
+
+/*
+ * Pick up the request where it left off and advance it through as many
+ * states as possible without blocking.  Both of the request's sockets are
+ * registered edge-triggered for reading and writing, so any readiness
+ * change on either one lands here, and each state loops until its I/O
+ * would block.  Each state handler returns 1 if the request moved to a new
+ * state (so the loop should run the next one right away), 0 if it is
+ * waiting on I/O, or -1 if the request is finished or failed and has been
+ * cleaned up.
+ */
+void handle_client(struct request_info *ri) {
+	int r;
+
+	ri->last_active = now_secs();
+	do {
+		switch (ri->state) {
+		case READ_REQUEST:
+			r = read_request(ri);
+			break;
+		case RESOLVE_HOST:
+			// handle_resolved() picks this request up
+			r = 0;
+			break;
+		case SEND_REQUEST:
+			r = send_request(ri);
+			break;
+		case SEND_BODY:
+			r = send_body(ri);
+			break;
+		case READ_RESPONSE:
+			r = read_response(ri);
+			break;
+		case SEND_RESPONSE:
+			r = send_response(ri);
+			break;
+		case ESTABLISH:
+			r = establish_tunnel(ri);
+			break;
+		case TUNNEL:
+			r = relay_tunnel(ri);
+			break;
+		default:
+			r = -1;
+			cancel_request(ri);
+		}
+	} while (r == 1);
+	if (r == 0) {
+		arm_timer(ri);
+	}
+}
+
+time_t now_secs(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+long long now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*
+ * (Re)file the request under the earliest of the deadlines that apply now.
+ * A tunnel may stay open as long as it is in use, so only the idle
+ * deadline applies to it.
+ */
+void arm_timer(struct request_info *ri) {
+	time_t deadline = ri->started + (ri->state != READ_REQUEST ? REQUEST_TIMEOUT :
+			keeping_alive(ri) ? KEEPALIVE_TIMEOUT : HEADER_TIMEOUT);
+
+	if (ri->state == TUNNEL || ri->last_active + IDLE_TIMEOUT < deadline) {
+		deadline = ri->last_active + IDLE_TIMEOUT;
+	}
+	set_timer(ri, deadline);
+}
+
+/* File the request in the wheel slot for deadline */
+void set_timer(struct request_info *ri, time_t deadline) {
+	struct reactor *r = ri->r;
+	int slot;
+
+	if (ri->tprev != NULL || r->wheel[ri->deadline % WHEEL_SLOTS] == ri) {
+		if (ri->deadline == deadline) {
+			return;
+		}
+		disarm_timer(ri);
+	}
+	ri->deadline = deadline;
+	slot = deadline % WHEEL_SLOTS;
+	ri->tprev = NULL;
+	ri->tnext = r->wheel[slot];
+	if (ri->tnext != NULL) {
+		ri->tnext->tprev = ri;
+	}
+	r->wheel[slot] = ri;
+}
+
+void disarm_timer(struct request_info *ri) {
+	struct reactor *r = ri->r;
+
+	if (ri->tprev != NULL) {
+		ri->tprev->tnext = ri->tnext;
+	} else if (r->wheel[ri->deadline % WHEEL_SLOTS] == ri) {
+		r->wheel[ri->deadline % WHEEL_SLOTS] = ri->tnext;
+	} else {
+		return;
+	}
+	if (ri->tnext != NULL) {
+		ri->tnext->tprev = ri->tprev;
+	}
+	ri->tprev = ri->tnext = NULL;
+}
+
+/*
+ * Drop every request whose deadline has passed, checking each slot from
+ * the last second checked up to now.  A request still being resolved is
+ * given another second: the resolver will hand it back, so it cannot be
+ * freed yet.
+ */
+void expire_timers(struct reactor *r) {
+	struct request_info *ri, *next;
+	time_t now = now_secs(), t;
+	int why;
+
+	if (now - r->wheel_next >= WHEEL_SLOTS) {
+		r->wheel_next = now - WHEEL_SLOTS + 1;
+	}
+	for (t = r->wheel_next; t <= now; t++) {
+		for (ri = r->wheel[t % WHEEL_SLOTS]; ri != NULL; ri = next) {
+			next = ri->tnext;
+			if (ri->deadline > now) {
+				continue;       // due on a later turn of the wheel
+			}
+			if (ri->state == RESOLVE_HOST) {
+				set_timer(ri, now + 1);
+				continue;
+			}
+			if (keeping_alive(ri)) {
+				why = TIMEOUT_IDLE;
+			} else if (ri->state == READ_REQUEST &&
+					now >= ri->started + HEADER_TIMEOUT) {
+				why = TIMEOUT_HEADER;
+			} else if (now >= ri->last_active + IDLE_TIMEOUT) {
+				why = TIMEOUT_IDLE;
+			} else {
+				why = TIMEOUT_REQUEST;
+			}
+			r->timed_out[why]++;
+			free_request(ri);
+		}
+	}
+	r->wheel_next = now + 1;
+}
+
+/* Is the connection open between requests, waiting for the next one? */
+int keeping_alive(struct request_info *ri) {
+	return ri->state == READ_REQUEST && ri->served > 0 && ri->req_read == 0;
+}
+
+/* Read the client's request, then start_request() it */
+int read_request(struct request_info *ri) {
+	http_req_t *rq = &ri->parsed;
+	int n, s;
+
+	// the parser resumes where the last recv() left it
+	while ((s = http_req_parse(rq, ri->req, ri->req_read)) == 0) {
+		if (ri->req_read == REQ_BUF_SIZE) {
+			refuse_oversized(ri);
+			return -1;
+		}
+		n = recv(ri->cfd, &ri->req[ri->req_read], REQ_BUF_SIZE - ri->req_read, 0);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			perror("client recv");
+			cancel_request(ri);
+			return -1;
+		}
+		if (n == 0) {
+			// client went away before finishing;
+			// between requests, a keep-alive client is free to go
+			if (keeping_alive(ri)) {
+				free_request(ri);
+			} else {
+				cancel_request(ri);
+			}
+			return -1;
+		}
+		ri->req_read += n;
+	}
+	return start_request(ri, s);
+}
+
+/*
+ * Turn away a request whose head does not fit in req: 414 if not even its
+ * request line does, else 431 (RFC 6585 section 5).
+ */
+void refuse_oversized(struct request_info *ri) {
+	static const char uri_too_long[] = "HTTP/1.1 414 URI Too Long\r\n"
+		"Content-Length: 0\r\n"
+		"Connection: close\r\n\r\n";
+	static const char too_large[] = "HTTP/1.1 431 Request Header Fields Too Large\r\n"
+		"Content-Length: 0\r\n"
+		"Connection: close\r\n\r\n";
+
+	refuse_request(ri, ri->parsed.state == HTTP_REQ_LINE ? uri_too_long : too_large);
+}
+
+/*
+ * Answer the request with the static reply, and cancel it.  The answer is
+ * sent only if the socket takes it at once, which between requests it
+ * will.  With epoll, what the client has sent is read and dropped first,
+ * so closing does not reset the connection under the answer; with uring,
+ * the client's multishot receive keeps draining it.
+ */
+void refuse_request(struct request_info *ri, const char *reply) {
+	if (ri->r->ring != NULL) {
+		// the answer is static, so nothing need wait for the send
+		uring_prep_send(next_sqe(ri->r), ri->cfd, reply, strlen(reply), 0);
+	} else {
+		send(ri->cfd, reply, strlen(reply), MSG_DONTWAIT | MSG_NOSIGNAL);
+		shutdown(ri->cfd, SHUT_WR);
+		while (recv(ri->cfd, ri->resp, RELAY_BUF_SIZE, MSG_DONTWAIT) > 0)
+			;
+	}
+	cancel_request(ri);
+}
+
+/*
+ * Once the client's headers are in (s is what http_req_parse() returned),
+ * build the request for the server and send it on an idle connection to
+ * the server from the pool, if there is one; otherwise look up the
+ * server's address.  The request says how its body (if any) is framed,
+ * and asks to keep the connection open, so it can go back to the pool.
+ * For a CONNECT there is nothing to send the server; sreq holds the reply
+ * that tells the client its tunnel is open.  Returns as the state handlers
+ * do.
+ */
+int start_request(struct request_info *ri, int s) {
+	http_req_t *rq = &ri->parsed;
+	char framing[64] = "";
+	ssize_t used;
+
+	ri->tunnel = s > 0 && HTTP_STR_IS(ri->req, rq->method, "CONNECT");
+	ri->logline[0] = '\0';
+	// a CONNECT target must give the port (RFC 9110 section 9.3.6)
+	if (s < 0 || rq->host.len >= sizeof(ri->host) || rq->port.len >= sizeof(ri->port) ||
+			(ri->tunnel && rq->port.len == 0)) {
+		cancel_request(ri);
+		return -1;
+	}
+	// an origin-form target names a resource on the proxy itself; taking
+	// its origin from Host would only loop back here
+	if (ri->req[rq->uri.off] == '/') {
+		refuse_request(ri, "HTTP/1.1 400 Bad Request\r\n"
+				"Content-Length: 0\r\n"
+				"Connection: close\r\n\r\n");
+		return -1;
+	}
+	// the request itself may not outlive the response (a tunnel reuses
+	// its buffer), so what the log needs of it is kept aside
+	if (verbose && alog_sampled()) {
+		snprintf(ri->logline, sizeof(ri->logline), "%.*s %.*s",
+				(int)rq->method.len, ri->req + rq->method.off,
+				(int)rq->uri.len, ri->req + rq->uri.off);
+		ri->log_start = now_us();
+	}
+	memcpy(ri->host, ri->req + rq->host.off, rq->host.len);
+	ri->host[rq->host.len] = '\0';
+	if (rq->port.len > 0) {
+		memcpy(ri->port, ri->req + rq->port.off, rq->port.len);
+		ri->port[rq->port.len] = '\0';
+	} else {
+		strcpy(ri->port, "80"); // default port
+	}
+	if (ri->tunnel) {
+		ri->sreq_len = snprintf(ri->sreq, sizeof(ri->sreq),
+				"HTTP/1.0 200 Connection established\r\n\r\n");
+		return lookup_origin(ri);
+	}
+
+	// the start of the body may have come in with the headers
+	ri->has_body = rq->chunked || rq->content_length > 0;
+	ri->req_sent = ri->req_end = rq->hdr_len;
+	if (ri->has_body) {
+		http_body_init(&ri->parsed_body, rq->content_length, rq->chunked);
+		used = http_resp_feed(&ri->parsed_body, ri->req + rq->hdr_len,
+				ri->req_read - rq->hdr_len);
+		if (used < 0) {
+			cancel_request(ri);
+			return -1;
+		}
+		ri->req_end += used;
+		if (rq->chunked) {
+			strcpy(framing, "Transfer-Encoding: chunked\r\n");
+		} else {
+			sprintf(framing, "Content-Length: %lld\r\n", rq->content_length);
+		}
+	}
+	http_resp_init(&ri->parsed_resp, HTTP_STR_IS(ri->req, rq->method, "HEAD"));
+
+	int pathlen = rq->path.len > 0 ? rq->path.len : 1;
+	const char *path = rq->path.len > 0 ? ri->req + rq->path.off : "/";
+	int port80 = strcmp(ri->port, "80") == 0;
+	ri->sreq_len = snprintf(ri->sreq, sizeof(ri->sreq), "%.*s %.*s HTTP/1.1\r\nHost: %s%s%s\r\nUser-Agent: %s\r\nConnection: keep-alive\r\n%s\r\n",
+			(int)rq->method.len, ri->req + rq->method.off, pathlen, path,
+			ri->host, port80 ? "" : ":", port80 ? "" : ri->port, user_agent_hdr,
+			framing);
+	if (ri->sreq_len >= sizeof(ri->sreq)) {
+		cancel_request(ri);
+		return -1;
+	}
+
+	if ((ri->sfd = take_origin(ri)) >= 0) {
+		return reuse_origin(ri);
+	}
+	return lookup_origin(ri);
+}
+
+/* Look up the server's address, then connect_request(); as above */
+int lookup_origin(struct request_info *ri) {
+	resolver_entry_t *origin;
+	int s;
+
+	ri->state = RESOLVE_HOST;
+	s = resolver_lookup_async(&ri->r->cq, ri->host, ri->port, ri, &origin);
+	if (s < 0) {
+		cancel_request(ri);
+		return -1;
+	}
+	if (s == 0) {
+		ri->ops++;      // the resolver's queue names it until it answers
+		return 0;
+	}
+	return connect_request(ri, origin);
+}
+
+/* An idle connection to the request's server from the pool, or -1 */
+int take_origin(struct request_info *ri) {
+	char c;
+	int fd;
+
+	while ((fd = pool_get(&ri->r->pool, ri->host, ri->port)) >= 0) {
+		// the uring engine can only find out by using it (see can_retry())
+		if (ri->r->ring != NULL) {
+			return fd;
+		}
+		// an idle connection has nothing to read, so anything but
+		// EAGAIN--EOF, an error, or stray bytes--means drop it
+		if (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+				(errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return fd;
+		}
+		close(fd);
+	}
+	return -1;
+}
+
+/*
+ * Send the request on ri->sfd, an idle connection to its server just taken
+ * from the pool.  Returns as the state handlers do.
+ */
+int reuse_origin(struct request_info *ri) {
+	struct epoll_event event;
+
+	ri->reused = 1;
+	ri->r->reused++;
+	ri->state = SEND_REQUEST;
+	if (ri->r->ring != NULL) {
+		uring_prep_send(next_sqe(ri->r), ri->sfd, ri->sreq, ri->sreq_len,
+				op_data(ri, OP_SREQ));
+		ri->ops++;
+		return 0;
+	}
+	event.data.ptr = ri;
+	event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	if (epoll_ctl(ri->r->efd, EPOLL_CTL_ADD, ri->sfd, &event) < 0) {
+		perror("epoll_ctl");
+		cancel_request(ri);
+		return -1;
+	}
+	return 1;
+}
+
+/*
+ * A pooled connection may have been closed by the server just as it was
+ * taken.  If so, and nothing has come back on it, and there is no body
+ * that could not be sent again, the request can start over on a new one.
+ */
+int can_retry(struct request_info *ri) {
+	return ri->reused && !ri->has_body && ri->parsed_resp.state == HTTP_HEADERS &&
+		ri->parsed_resp.hdr_len == 0;
+}
+
+/* Start over on a new connection, as can_retry() allows; as above */
+int retry_origin(struct request_info *ri) {
+	close_origin(ri);
+	ri->reused = 0;
+	ri->sreq_written = 0;
+	return lookup_origin(ri);
+}
+
+/* Close the request's connection to its server, if it has one */
+void close_origin(struct request_info *ri) {
+	if (ri->sfd < 0) {
+		return;
+	}
+	if (ri->r->ring != NULL) {
+		uring_prep_close_fixed(next_sqe(ri->r), ri->sfd, 0);
+	} else {
+		close(ri->sfd);
+	}
+	ri->sfd = -1;
+}
+
+/* How a reactor's pool closes an idle connection it drops */
+void close_pooled(void *arg, int fd) {
+	struct reactor *r = (struct reactor *)arg;
+
+	if (r->ring != NULL) {
+		uring_prep_close_fixed(next_sqe(r), fd, 0);
+	} else {
+		close(fd);
+	}
+}
+
+/*
+ * Deliver every finished lookup to the request waiting on it.  A request
+ * released while it waited (its client went away) was kept for this, and
+ * is freed now instead.
+ */
+void handle_resolved(struct reactor *r) {
+	struct request_info *ri;
+	resolver_entry_t *origin;
+	void *arg;
+
+	while (resolver_cq_next(&r->cq, &arg, &origin)) {
+		ri = (struct request_info *)arg;
+		ri->ops--;
+		if (ri->closing) {
+			resolver_release(origin);
+			if (r->ring != NULL) {
+				uring_reap(ri);
+			} else if (ri->ops == 0) {
+				ri->rnext = r->released;
+				r->released = ri;
+			}
+			continue;
+		}
+		if (connect_request(ri, origin) == 1) {
+			handle_client(ri);
+		}
+	}
+}
+
+/*
+ * Start a non-blocking connect() to the server at the resolved address,
+ * then move on to SEND_REQUEST (or ESTABLISH, for a tunnel).  Consumes the
+ * reference to origin.
+ */
+int connect_request(struct request_info *ri, resolver_entry_t *origin) {
+	struct addrinfo *ai = origin->ai;
+	struct epoll_event event;
+
+	if (ai == NULL) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(origin->err));
+		resolver_release(origin);
+		cancel_request(ri);
+		return -1;
+	}
+	if (ri->r->ring != NULL) {
+		return uring_connect(ri, origin);
+	}
+
+	// connect() completes in the background; send_request() sees EAGAIN
+	// until it does
+	ri->sfd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK, 0);
+	if (ri->sfd < 0 ||
+			(connect(ri->sfd, ai->ai_addr, ai->ai_addrlen) < 0 &&
+			 errno != EINPROGRESS)) {
+		perror("connect");
+		resolver_release(origin);
+		cancel_request(ri);
+		return -1;
+	}
+	resolver_release(origin);
+
+	event.data.ptr = ri;
+	event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	if (epoll_ctl(ri->r->efd, EPOLL_CTL_ADD, ri->sfd, &event) < 0) {
+		perror("epoll_ctl");
+		cancel_request(ri);
+		return -1;
+	}
+
+	ri->state = ri->tunnel ? ESTABLISH : SEND_REQUEST;
+	return 1;
+}
+
+/*
+ * Write the rewritten request to the server.  A pooled connection the
+ * server has since closed fails here, and the request starts over.
+ */
+int send_request(struct request_info *ri) {
+	int n;
+
+	while (ri->sreq_written < ri->sreq_len) {
+		n = send(ri->sfd, &ri->sreq[ri->sreq_written],
+				ri->sreq_len - ri->sreq_written, 0);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			if (can_retry(ri)) {
+				return retry_origin(ri);
+			}
+			perror("server send");
+			cancel_request(ri);
+			return -1;
+		}
+		ri->sreq_written += n;
+	}
+	ri->state = ri->has_body ? SEND_BODY : READ_RESPONSE;
+	return 1;
+}
+
+/*
+ * Relay the request body to the server: first what came in with the
+ * headers, then the rest as the client sends it, through resp, which has
+ * no response to hold yet.  Whatever the client sends past the end of the
+ * body is the start of its next request, and goes into req.
+ */
+int send_body(struct request_info *ri) {
+	int n, used;
+
+	while (1) {
+		if (ri->req_sent < ri->req_end) {
+			n = send(ri->sfd, &ri->req[ri->req_sent], ri->req_end - ri->req_sent, 0);
+			ri->req_sent += n > 0 ? n : 0;
+		} else if (ri->resp_written < ri->resp_len) {
+			n = send(ri->sfd, &ri->resp[ri->resp_written],
+					ri->resp_len - ri->resp_written, 0);
+			ri->resp_written += n > 0 ? n : 0;
+		} else if (ri->parsed_body.state == HTTP_DONE) {
+			ri->resp_len = ri->resp_written = 0;
+			ri->state = READ_RESPONSE;
+			return 1;
+		} else {
+			n = recv(ri->cfd, ri->resp, RELAY_BUF_SIZE, 0);
+			if (n == 0) {
+				// client went away before finishing its body
+				cancel_request(ri);
+				return -1;
+			}
+			if (n > 0) {
+				if ((used = http_resp_feed(&ri->parsed_body, ri->resp, n)) < 0) {
+					cancel_request(ri);
+					return -1;
+				}
+				keep_pipelined(ri, ri->resp + used, n - used);
+				ri->resp_len = used;
+				ri->resp_written = 0;
+			}
+		}
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			perror("request body");
+			cancel_request(ri);
+			return -1;
+		}
+	}
+}
+
+/*
+ * Append n bytes the client sent past its request to req, for its next
+ * request.  If they do not fit, the next request cannot be served, so the
+ * connection closes after this one instead.
+ */
+void keep_pipelined(struct request_info *ri, const char *buf, int n) {
+	if (n > REQ_BUF_SIZE - ri->req_read) {
+		ri->client_close = 1;
+		return;
+	}
+	memcpy(&ri->req[ri->req_read], buf, n);
+	ri->req_read += n;
+}
+
+/*
+ * Read the server's response into resp, following its framing.  Rather
+ * than holding the whole response, switch to SEND_RESPONSE whenever resp
+ * fills up, the response ends, or the server closes, so each request
+ * needs only a fixed-size buffer no matter how large the response is.
+ */
+int read_response(struct request_info *ri) {
+	int n;
+
+	while (ri->resp_len < RELAY_BUF_SIZE && ri->parsed_resp.state != HTTP_DONE) {
+		n = recv(ri->sfd, &ri->resp[ri->resp_len], RELAY_BUF_SIZE - ri->resp_len, 0);
+		if (n <= 0 && !(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) &&
+				can_retry(ri)) {
+			return retry_origin(ri);
+		}
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (ri->resp_len > 0) {
+					break;
+				}
+				return 0;
+			}
+			perror("server recv");
+			cancel_request(ri);
+			return -1;
+		}
+		if (n == 0) {
+			ri->server_eof = 1;
+			break;
+		}
+		ri->resp_len += frame_response(ri, &ri->resp[ri->resp_len], n);
+	}
+	ri->state = SEND_RESPONSE;
+	return 1;
+}
+
+/*
+ * Write buffered response bytes to the client.  When resp drains, go back
+ * to READ_RESPONSE for more, or end the response if it is complete or the
+ * server has closed.
+ */
+int send_response(struct request_info *ri) {
+	int n;
+
+	while (ri->resp_written < ri->resp_len) {
+		n = send(ri->cfd, &ri->resp[ri->resp_written],
+				ri->resp_len - ri->resp_written, 0);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			perror("client send");
+			cancel_request(ri);
+			return -1;
+		}
+		ri->resp_written += n;
+		ri->resp_total += n;
+	}
+	ri->resp_len = ri->resp_written = 0;
+	if (ri->parsed_resp.state == HTTP_DONE || ri->server_eof) {
+		return end_response(ri);
+	}
+	ri->state = READ_RESPONSE;
+	return 1;
+}
+
+/*
+ * Follow the framing of n more response bytes at buf.  Returns how many
+ * of them belong to the response; any more mean the server is confused,
+ * and its connection is not used again.  A response that does not parse
+ * is passed on as it is, up to the server's close.
+ */
+int frame_response(struct request_info *ri, const char *buf, int n) {
+	ssize_t used;
+
+	if (ri->passthrough) {
+		return n;
+	}
+	if ((used = http_resp_feed(&ri->parsed_resp, buf, n)) < 0) {
+		ri->passthrough = 1;
+		return n;
+	}
+	if (used < n) {
+		ri->leftover = 1;
+	}
+	return used;
+}
+
+/*
+ * Everything the server sent has reached the client.  A response that
+ * runs to the server's close is complete once it closes; any other
+ * response the server closed on was cut short.  Returns as the state
+ * handlers do.
+ */
+int end_response(struct request_info *ri) {
+	if (ri->parsed_resp.state == HTTP_DONE) {
+		return complete_response(ri);
+	}
+	if (ri->passthrough || ri->parsed_resp.state == HTTP_BODY_CLOSE) {
+		finish_request(ri);
+	} else {
+		cancel_request(ri);
+	}
+	return -1;
+}
+
+/*
+ * The response was framed, and has reached the client in full, so neither
+ * side had to close to mark its end.  The server's connection goes back
+ * to the pool if the server will keep it open, and the client's stays
+ * open for its next request if it asked for that.  Returns as the state
+ * handlers do.
+ */
+int complete_response(struct request_info *ri) {
+	struct reactor *r = ri->r;
+
+	if (ri->parsed_resp.keep_alive && !ri->leftover && server_idle(ri)) {
+		if (r->ring == NULL) {
+			epoll_ctl(r->efd, EPOLL_CTL_DEL, ri->sfd, NULL);
+		}
+		pool_put(&r->pool, ri->host, ri->port, ri->sfd);
+		ri->sfd = -1;
+	}
+	if (!ri->parsed.keep_alive || ri->client_close || !server_idle(ri)) {
+		finish_request(ri);
+		return -1;
+	}
+	close_origin(ri);
+	r->completed++;
+	log_request(ri);
+	next_request(ri);
+	return r->ring != NULL ? uring_next_request(ri) : 1;
+}
+
+/* Has all of the request gone to the server, with nothing in flight? */
+int server_idle(struct request_info *ri) {
+	return ri->sreq_written == ri->sreq_len && ri->req_sent == ri->req_end &&
+		(!ri->has_body || ri->parsed_body.state == HTTP_DONE) &&
+		!ri->sending[TO_SERVER] && ri->outq_len[TO_SERVER] == 0 && !ri->srecv;
+}
+
+/*
+ * Ready the connection for the client's next request, starting from
+ * whatever the client has already sent of it.
+ */
+void next_request(struct request_info *ri) {
+	memmove(ri->req, ri->req + ri->req_end, ri->req_read - ri->req_end);
+	ri->req_read -= ri->req_end;
+	ri->req_sent = ri->req_end = 0;
+	http_req_init(&ri->parsed);
+	ri->has_body = 0;
+	ri->reused = 0;
+	ri->sreq_len = ri->sreq_written = 0;
+	ri->resp_len = ri->resp_written = 0;
+	ri->passthrough = ri->leftover = 0;
+	ri->server_eof = 0;
+	ri->eof[TO_CLIENT] = 0;
+	ri->served++;
+	ri->state = READ_REQUEST;
+	ri->started = ri->last_active = now_secs();
+}
+
+/*
+ * Wait out the connect() to the server, then send the client sreq, the
+ * reply saying its tunnel is open.  The connect is still in progress for
+ * as long as the socket has no peer and no error.
+ */
+int establish_tunnel(struct request_info *ri) {
+	struct sockaddr_storage peer;
+	socklen_t len = sizeof(peer);
+	int err = 0, n;
+
+	if (ri->sreq_written == 0 &&
+			getpeername(ri->sfd, (struct sockaddr *)&peer, &len) < 0) {
+		len = sizeof(err);
+		if (getsockopt(ri->sfd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0) {
+			return 0;
+		}
+		errno = err;
+		perror("connect");
+		cancel_request(ri);
+		return -1;
+	}
+	while (ri->sreq_written < ri->sreq_len) {
+		n = send(ri->cfd, &ri->sreq[ri->sreq_written],
+				ri->sreq_len - ri->sreq_written, 0);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			perror("client send");
+			cancel_request(ri);
+			return -1;
+		}
+		ri->sreq_written += n;
+	}
+	return open_tunnel(ri);
+}
+
+/*
+ * Set up both directions of the tunnel and move on to TUNNEL.  Each gets
+ * its own pipe, if one can be had; whatever the client sent after its
+ * CONNECT is still in req, to go to the server ahead of the rest.
+ */
+int open_tunnel(struct request_info *ri) {
+	struct tunnel_dir *d;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		d = &ri->tun[i];
+		d->from = i == TO_SERVER ? ri->cfd : ri->sfd;
+		d->to = i == TO_SERVER ? ri->sfd : ri->cfd;
+		if (pipe2(d->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+			d->pipe[0] = d->pipe[1] = -1;
+		} else {
+			fcntl(d->pipe[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+		}
+	}
+	ri->tun[TO_SERVER].buf = ri->req;
+	ri->tun[TO_SERVER].size = REQ_BUF_SIZE;
+	ri->tun[TO_SERVER].off = ri->parsed.hdr_len;
+	ri->tun[TO_SERVER].len = ri->req_read;
+	ri->tun[TO_CLIENT].buf = ri->resp;
+	ri->tun[TO_CLIENT].size = RELAY_BUF_SIZE;
+	ri->r->tunnels++;
+	ri->state = TUNNEL;
+	return 1;
+}
+
+/*
+ * Relay whatever either side has sent on to the other.  When one side
+ * closes its end, that direction is shut down at the other once it has
+ * drained, while the other direction carries on; the tunnel is done once
+ * both are shut.
+ */
+int relay_tunnel(struct request_info *ri) {
+	int n;
+
+	if (pump_tunnel(&ri->tun[TO_SERVER]) < 0 ||
+			(n = pump_tunnel(&ri->tun[TO_CLIENT])) < 0) {
+		perror("tunnel");
+		cancel_request(ri);
+		return -1;
+	}
+	ri->resp_total += n;
+	if (ri->tun[TO_SERVER].shut && ri->tun[TO_CLIENT].shut) {
+		finish_request(ri);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Move bytes in one direction until the sending side has no more for now
+ * or the receiving side can take no more.  Returns the bytes delivered,
+ * or -1 on an error.
+ */
+int pump_tunnel(struct tunnel_dir *d) {
+	int n, moved = 0;
+
+	while (1) {
+		if (d->off < d->len) {
+			n = send(d->to, &d->buf[d->off], d->len - d->off, 0);
+			if (n > 0) {
+				d->off += n;
+				moved += n;
+			}
+		} else if (d->in_pipe > 0) {
+			n = splice(d->pipe[0], NULL, d->to, NULL, d->in_pipe,
+					SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n > 0) {
+				d->in_pipe -= n;
+				moved += n;
+			}
+		} else if (d->eof) {
+			if (!d->shut) {
+				shutdown(d->to, SHUT_WR);
+				d->shut = 1;
+			}
+			return moved;
+		} else {
+			// only read once everything read so far is out, so a slow
+			// receiver holds back the sender rather than filling memory
+			d->off = d->len = 0;
+			if (d->pipe[0] >= 0) {
+				n = splice(d->from, NULL, d->pipe[1], NULL, RELAY_PIPE_SIZE,
+						SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+				if (n > 0) {
+					d->in_pipe = n;
+				}
+			} else if ((n = recv(d->from, d->buf, d->size, 0)) > 0) {
+				d->len = n;
+			}
+			if (n == 0) {
+				d->eof = 1;
+			}
+		}
+		if (n < 0) {
+			return errno == EAGAIN || errno == EWOULDBLOCK ? moved : -1;
+		}
+	}
+}
+
+/* Give up on a request that hit an error */
+void cancel_request(struct request_info *ri) {
+	ri->r->failed++;
+	free_request(ri);
+}
+
+/* Retire a request whose response was relayed in full */
+void finish_request(struct request_info *ri) {
+	ri->r->completed++;
+	free_request(ri);
+}
+
+/*
+ * With -v or -l, log the request ri is on, if it was sampled, once it is
+ * over: its method and target, the status the server answered with (0 if
+ * none came), and how long it took.  The entry only goes into this
+ * reactor's ring; the log's writer thread puts it out, so the loop never
+ * waits on the disk or on whoever reads stdout.
+ */
+void log_request(struct request_info *ri) {
+	int status;
+
+	if (ri->logline[0] == '\0') {
+		return;
+	}
+	status = ri->tunnel ? (ri->state == TUNNEL ? 200 : 0) : ri->parsed_resp.status;
+	alog_printf("%s %d %lldus", ri->logline, status, now_us() - ri->log_start);
+	ri->logline[0] = '\0';
+}
+
+/*
+ * Close the request's sockets (which also deregisters them from epoll),
+ * and a tunnel's pipes, and release it, to be freed once the events
+ * already fetched that may name it have been handled.
+ */
+void free_request(struct request_info *ri) {
+	struct reactor *r = ri->r;
+	int i;
+
+	log_request(ri);
+	if (r->ring != NULL) {
+		uring_release(ri);
+		return;
+	}
+	disarm_timer(ri);
+	close(ri->cfd);
+	if (ri->sfd >= 0) {
+		close(ri->sfd);
+	}
+	if (ri->state == TUNNEL) {
+		for (i = 0; i < 2; i++) {
+			if (ri->tun[i].pipe[0] >= 0) {
+				close(ri->tun[i].pipe[0]);
+				close(ri->tun[i].pipe[1]);
+			}
+		}
+	}
+	if (ri->prev != NULL) {
+		ri->prev->next = ri->next;
+	} else {
+		r->active = ri->next;
+	}
+	if (ri->next != NULL) {
+		ri->next->prev = ri->prev;
+	}
+	r->nactive--;
+	ri->closing = 1;
+	// with a lookup out, handle_resolved() puts it on the list instead
+	if (ri->ops == 0) {
+		ri->rnext = r->released;
+		r->released = ri;
+	}
+}
+
+void free_released(struct reactor *r) {
+	struct request_info *ri;
+
+	while ((ri = r->released) != NULL) {
+		r->released = ri->rnext;
+		free(ri);
+	}
+}
+
+/*
+ * The io_uring engine (-e uring).  Rather than being told that a socket is
+ * ready and then making the call, a reactor queues the calls themselves
+ * and is told when each is done, and everything a pass over the
+ * completions queues goes to the kernel, along with the wait for the next
+ * ones, in a single io_uring_enter().  One multishot accept keeps taking
+ * clients, straight into fixed descriptors that never touch the process's
+ * file table; one multishot recv per socket keeps receiving into buffers
+ * the kernel takes from the reactor's provided-buffer ring, and each
+ * buffer from the server is sent on to the client as it is and then given
+ * back.  Requests go through the same states as with epoll, so the timer
+ * wheel, the resolver and the counters are shared.
+ *
+ * A released request may still have operations in flight that name it,
+ * so it is only freed once the last of them has completed; cancelling its
+ * sockets' operations makes that quick.
+ */
+void *run_reactor_uring(void *vargp) {
+	struct reactor *r = (struct reactor *)vargp;
+	struct io_uring_cqe *cqe, c;
+	struct request_info *ri;
+
+	// the ring belongs to the thread that set it up
+	if (uring_init(&r->uring, URING_ENTRIES, URING_FILES, URING_NBUFS,
+				URING_BUF_SIZE) < 0) {
+		perror("io_uring");
+		exit(1);
+	}
+	r->ring = &r->uring;
+	// the ring does the waiting, for the listening socket too
+	fcntl(r->sfd, F_SETFL, fcntl(r->sfd, F_GETFL, 0) & ~O_NONBLOCK);
+	uring_arm_accept(r);
+	uring_arm_resolver(r);
+	clock_gettime(CLOCK_MONOTONIC, &r->started);
+	r->wheel_next = r->started.tv_sec;
+
+	while (!shutting_down) {
+		if (r->stats_seen != stats_requested) {
+			r->stats_seen = stats_requested;
+			print_reactor_stats(r);
+		}
+
+		if (uring_submit_wait(r->ring, 1000) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("io_uring_enter");
+			break;
+		}
+		while ((cqe = uring_peek(r->ring)) != NULL) {
+			c = *cqe;
+			uring_seen(r->ring);
+			uring_completion(r, &c);
+		}
+		uring_feed_starved(r);
+		expire_timers(r);
+	}
+
+	// closing the ring cancels whatever is still in flight
+	pool_deinit(&r->pool);
+	uring_deinit(r->ring);
+	while ((ri = r->active) != NULL) {
+		r->active = ri->next;
+		free(ri);
+	}
+	return NULL;
+}
+
+unsigned long long op_data(struct request_info *ri, int op) {
+	return (uintptr_t)ri | op;
+}
+
+/* A submission entry; a ring that cannot supply one is broken */
+struct io_uring_sqe *next_sqe(struct reactor *r) {
+	struct io_uring_sqe *sqe = uring_sqe(r->ring);
+
+	if (sqe == NULL) {
+		perror("io_uring_enter");
+		exit(1);
+	}
+	return sqe;
+}
+
+void uring_arm_accept(struct reactor *r) {
+	uring_prep_accept_multi(next_sqe(r), r->sfd, OP_ACCEPT);
+	r->accept_paused = 0;
+}
+
+void uring_arm_resolver(struct reactor *r) {
+	uring_prep_poll_multi(next_sqe(r), r->cq.fds[0], OP_RESOLVED);
+}
+
+void uring_completion(struct reactor *r, struct io_uring_cqe *cqe) {
+	struct request_info *ri = (struct request_info *)(uintptr_t)
+		(cqe->user_data & ~(unsigned long long)OP_MASK);
+	int op = cqe->user_data & OP_MASK;
+	int more = cqe->flags & IORING_CQE_F_MORE;
+
+	if (cqe->user_data == 0) {
+		return;
+	}
+	if (ri != NULL) {
+		uring_request_completion(ri, op, cqe);
+		return;
+	}
+	if (op == OP_RESOLVED) {
+		handle_resolved(r);
+		if (!more) {
+			uring_arm_resolver(r);
+		}
+		return;
+	}
+
+	if (cqe->res >= 0) {
+		uring_new_client(r, cqe->res);
+	}
+	if (!more) {
+		// with every fixed descriptor taken, wait for a request to
+		// free one rather than fail each accept as it comes in
+		if (cqe->res == -ENFILE) {
+			r->accept_paused = 1;
+		} else {
+			uring_arm_accept(r);
+		}
+	}
+}
+
+/* Start a request for the client accepted into fixed slot fx */
+void uring_new_client(struct reactor *r, int fx) {
+	struct request_info *ri;
+
+	if ((ri = calloc(1, sizeof(struct request_info))) == NULL) {
+		uring_prep_close_fixed(next_sqe(r), fx, 0);
+		return;
+	}
+	ri->r = r;
+	ri->cfd = fx;
+	ri->sfd = -1;
+	ri->state = READ_REQUEST;
+	http_req_init(&ri->parsed);
+	ri->started = ri->last_active = now_secs();
+
+	ri->next = r->active;
+	if (r->active != NULL) {
+		r->active->prev = ri;
+	}
+	r->active = ri;
+	r->nactive++;
+	r->accepted++;
+	arm_timer(ri);
+	uring_arm_recv(ri, OP_CRECV);
+}
+
+void uring_request_completion(struct request_info *ri, int op, struct io_uring_cqe *cqe) {
+	struct io_uring_sqe *sqe;
+	int bid;
+
+	// a multishot operation stays in flight for as long as it says MORE
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		ri->ops--;
+		if (op == OP_CRECV) {
+			ri->crecv = 0;
+		} else if (op == OP_SRECV) {
+			ri->srecv = 0;
+		}
+	}
+	if (ri->closing) {
+		if ((bid = uring_cqe_buf(ri->r->ring, cqe)) >= 0) {
+			uring_buf_return(ri->r->ring, bid);
+		}
+		if (op == OP_SOCKET && cqe->res >= 0) {
+			ri->sfd = cqe->res;     // for uring_reap() to close
+		}
+		uring_reap(ri);
+		return;
+	}
+
+	ri->last_active = now_secs();
+	switch (op) {
+	case OP_CRECV:
+		if (uring_client_data(ri, cqe) < 0) {
+			return;
+		}
+		break;
+	case OP_SRECV:
+		if (uring_relay_data(ri, TO_CLIENT, cqe) < 0) {
+			return;
+		}
+		break;
+	case OP_SOCKET:
+		if (cqe->res < 0) {
+			errno = -cqe->res;
+			perror("socket");
+			cancel_request(ri);
+			return;
+		}
+		// the request (or, for a tunnel, the client's 200) goes out in
+		// the same submission as the connect, linked so it is only sent
+		// if the connect succeeds
+		ri->sfd = cqe->res;
+		sqe = next_sqe(ri->r);
+		uring_prep_connect(sqe, ri->sfd, &ri->addr, ri->addrlen, op_data(ri, OP_CONNECT));
+		sqe->flags |= IOSQE_IO_LINK;
+		uring_prep_send(next_sqe(ri->r), ri->tunnel ? ri->cfd : ri->sfd,
+				ri->sreq, ri->sreq_len, op_data(ri, OP_SREQ));
+		ri->ops += 2;
+		break;
+	case OP_CONNECT:
+	case OP_SREQ:
+		if (cqe->res < 0 && op == OP_SREQ && can_retry(ri)) {
+			if (retry_origin(ri) < 0) {
+				return;
+			}
+			break;
+		}
+		if (cqe->res < 0) {
+			// a failed connect cancels the send linked to it
+			if (cqe->res != -ECANCELED) {
+				errno = -cqe->res;
+				perror(op == OP_CONNECT ? "connect" :
+						ri->tunnel ? "client send" : "server send");
+			}
+			cancel_request(ri);
+			return;
+		}
+		if (op == OP_CONNECT) {
+			break;
+		}
+		ri->sreq_written += cqe->res;
+		if (ri->sreq_written < ri->sreq_len) {
+			uring_prep_send(next_sqe(ri->r), ri->tunnel ? ri->cfd : ri->sfd,
+					&ri->sreq[ri->sreq_written],
+					ri->sreq_len - ri->sreq_written, op_data(ri, OP_SREQ));
+			ri->ops++;
+			break;
+		}
+		if (ri->tunnel) {
+			if (uring_open_tunnel(ri) < 0) {
+				return;
+			}
+			break;
+		}
+		ri->state = READ_RESPONSE;
+		uring_arm_recv(ri, OP_SRECV);
+		if (ri->has_body && uring_send_next(ri, TO_SERVER) < 0) {
+			return;
+		}
+		break;
+	case OP_CSEND:
+	case OP_SSEND:
+		if (uring_sent(ri, op == OP_CSEND ? TO_CLIENT : TO_SERVER, cqe->res) < 0) {
+			return;
+		}
+		break;
+	}
+	arm_timer(ri);
+}
+
+/*
+ * Bytes (or end of file, or an error) from the client.  While the request
+ * is being read they are copied in and parsed.  After it, the body's bytes
+ * are queued to go on to the server as they are, and anything past the
+ * body is copied in as the start of the next request; a CONNECT's bytes
+ * are all relayed to the server.  Returns -1 if the request was released,
+ * 0 otherwise.
+ */
+int uring_client_data(struct request_info *ri, struct io_uring_cqe *cqe) {
+	uring_t *u = ri->r->ring;
+	int n = cqe->res, bid, s, used = 0;
+
+	if (ri->tunnel && ri->state != READ_REQUEST) {
+		return uring_relay_data(ri, TO_SERVER, cqe);
+	}
+	if ((bid = uring_cqe_buf(u, cqe)) >= 0) {
+		if (ri->state != READ_REQUEST && n > 0 && ri->has_body &&
+				ri->parsed_body.state != HTTP_DONE) {
+			if ((used = http_resp_feed(&ri->parsed_body, uring_buf(u, bid), n)) < 0) {
+				uring_buf_return(u, bid);
+				cancel_request(ri);
+				return -1;
+			}
+			if (used > 0) {
+				ri->outq[TO_SERVER][(ri->outq_head[TO_SERVER] +
+						ri->outq_len[TO_SERVER]) % URING_NBUFS] = bid << 16 | used;
+				ri->outq_len[TO_SERVER]++;
+			}
+		}
+		if (ri->state == READ_REQUEST && n > REQ_BUF_SIZE - ri->req_read) {
+			// keep what fits; if the head does not end in it, it is
+			// refused below, and if it does, what follows is lost
+			memcpy(&ri->req[ri->req_read], uring_buf(u, bid), REQ_BUF_SIZE - ri->req_read);
+			ri->req_read = REQ_BUF_SIZE;
+			ri->client_close = 1;
+		} else if (n > used) {
+			keep_pipelined(ri, uring_buf(u, bid) + used, n - used);
+		}
+		if (used <= 0) {
+			uring_buf_return(u, bid);
+		}
+	}
+	if (n == -ENOBUFS) {
+		uring_starve(ri);
+		return 0;
+	}
+	if (n <= 0) {
+		if (n < 0) {
+			errno = -n;
+			perror("client recv");
+		}
+		if (n == 0 && keeping_alive(ri)) {
+			free_request(ri);
+		} else if (n < 0 || ri->state == READ_REQUEST ||
+				(ri->has_body && ri->parsed_body.state != HTTP_DONE)) {
+			cancel_request(ri);
+		} else {
+			// the client has sent all it will; close after its response
+			ri->eof[TO_SERVER] = 1;
+			ri->client_close = 1;
+			return 0;
+		}
+		return -1;
+	}
+	if (!ri->crecv) {
+		uring_arm_recv(ri, OP_CRECV);
+	}
+	if (used > 0 && !ri->sending[TO_SERVER] && uring_send_next(ri, TO_SERVER) < 0) {
+		return -1;
+	}
+	if (ri->state != READ_REQUEST) {
+		return 0;
+	}
+	if ((s = http_req_parse(&ri->parsed, ri->req, ri->req_read)) == 0) {
+		if (ri->req_read == REQ_BUF_SIZE) {
+			refuse_oversized(ri);
+			return -1;
+		}
+		return 0;
+	}
+	return start_request(ri, s) < 0 ? -1 : 0;
+}
+
+/*
+ * Bytes (or end of file, or an error) to relay in direction dir: from the
+ * server to the client, or in a tunnel from the client to the server too.
+ * Each buffer is queued to go on as it is, less anything a server sends
+ * past the end of its response.  Returns -1 if the request was released,
+ * 0 otherwise.
+ */
+int uring_relay_data(struct request_info *ri, int dir, struct io_uring_cqe *cqe) {
+	uring_t *u = ri->r->ring;
+	int n = cqe->res, bid, len = n;
+
+	if ((bid = uring_cqe_buf(u, cqe)) >= 0) {
+		if (n > 0 && dir == TO_CLIENT && !ri->tunnel) {
+			len = frame_response(ri, uring_buf(u, bid), n);
+		}
+		if (len > 0) {
+			ri->outq[dir][(ri->outq_head[dir] + ri->outq_len[dir]) % URING_NBUFS] =
+				bid << 16 | len;
+			ri->outq_len[dir]++;
+		} else {
+			uring_buf_return(u, bid);
+		}
+	}
+	if (n <= 0 && n != -ENOBUFS && dir == TO_CLIENT && can_retry(ri)) {
+		return retry_origin(ri) < 0 ? -1 : 0;
+	}
+	if (n == 0 || (dir == TO_CLIENT && !ri->tunnel &&
+				ri->parsed_resp.state == HTTP_DONE)) {
+		// the sender closed, or the response is complete
+		ri->eof[dir] = 1;
+	} else if (n == -ENOBUFS) {
+		uring_starve(ri);
+	} else if (n < 0) {
+		errno = -n;
+		perror(dir == TO_CLIENT ? "server recv" : "client recv");
+		cancel_request(ri);
+		return -1;
+	} else if (dir == TO_CLIENT && !ri->srecv) {
+		uring_arm_recv(ri, OP_SRECV);
+	} else if (dir == TO_SERVER && !ri->crecv) {
+		uring_arm_recv(ri, OP_CRECV);
+	}
+	return ri->sending[dir] ? 0 : uring_send_next(ri, dir);
+}
+
+/*
+ * Send the next buffer queued in direction dir, one at a time so they go
+ * out in order.  Once a response is all in and all sent, it is ended as
+ * with epoll; a tunnel shuts a direction down once its sender has closed
+ * and all is sent, and is finished once both are.  Nothing goes to the
+ * server until the request (or, for a tunnel, the client's 200) is sent,
+ * and then whatever of the body (or whatever followed the CONNECT) is in
+ * req goes first.  Returns -1 if the request was released, 0 otherwise.
+ */
+int uring_send_next(struct request_info *ri, int dir) {
+	int fx = dir == TO_CLIENT ? ri->cfd : ri->sfd;
+	int op = dir == TO_CLIENT ? OP_CSEND : OP_SSEND;
+	unsigned int e;
+
+	if (dir == TO_SERVER &&
+			(ri->tunnel ? ri->state != TUNNEL : ri->sreq_written < ri->sreq_len)) {
+		return 0;
+	}
+	if (dir == TO_SERVER && ri->req_sent < ri->req_end) {
+		uring_prep_send(next_sqe(ri->r), fx, &ri->req[ri->req_sent],
+				ri->req_end - ri->req_sent, op_data(ri, op));
+		ri->ops++;
+		ri->sending[dir] = 1;
+		return 0;
+	}
+	if (ri->outq_len[dir] == 0) {
+		if (!ri->eof[dir]) {
+			return 0;
+		}
+		if (!ri->tunnel) {
+			return dir == TO_CLIENT ? end_response(ri) : 0;
+		}
+		if (!ri->shut[dir]) {
+			uring_prep_shutdown(next_sqe(ri->r), fx, SHUT_WR, 0);
+			ri->shut[dir] = 1;
+		}
+		if (ri->shut[TO_CLIENT] && ri->shut[TO_SERVER]) {
+			finish_request(ri);
+			return -1;
+		}
+		return 0;
+	}
+	e = ri->outq[dir][ri->outq_head[dir]];
+	uring_prep_send(next_sqe(ri->r), fx,
+			uring_buf(ri->r->ring, e >> 16) + ri->out_off[dir],
+			(e & 0xffff) - ri->out_off[dir], op_data(ri, op));
+	ri->ops++;
+	ri->sending[dir] = 1;
+	return 0;
+}
+
+/* A send in direction dir completed with res */
+int uring_sent(struct request_info *ri, int dir, int res) {
+	unsigned int e = ri->outq[dir][ri->outq_head[dir]];
+
+	ri->sending[dir] = 0;
+	if (res < 0) {
+		errno = -res;
+		perror(dir == TO_CLIENT ? "client send" : "server send");
+		cancel_request(ri);
+		return -1;
+	}
+	if (dir == TO_SERVER && ri->req_sent < ri->req_end) {
+		ri->req_sent += res;
+		return uring_send_next(ri, dir);
+	}
+	if (dir == TO_CLIENT) {
+		ri->resp_total += res;
+	}
+	ri->out_off[dir] += res;
+	if (ri->out_off[dir] == (e & 0xffff)) {
+		uring_buf_return(ri->r->ring, e >> 16);
+		ri->outq_head[dir] = (ri->outq_head[dir] + 1) % URING_NBUFS;
+		ri->outq_len[dir]--;
+		ri->out_off[dir] = 0;
+	}
+	return uring_send_next(ri, dir);
+}
+
+/*
+ * The client has its 200: start relaying both ways, the server's side
+ * from scratch and the client's from where the request left off.
+ */
+int uring_open_tunnel(struct request_info *ri) {
+	ri->state = TUNNEL;
+	ri->req_sent = ri->parsed.hdr_len;
+	ri->req_end = ri->req_read;
+	ri->r->tunnels++;
+	uring_arm_recv(ri, OP_SRECV);
+	if (!ri->crecv && !ri->eof[TO_SERVER]) {
+		uring_arm_recv(ri, OP_CRECV);
+	}
+	return uring_send_next(ri, TO_SERVER);
+}
+
+/*
+ * Carry on with the client's next request on the same connection: parse
+ * whatever of it is in already, and keep receiving the rest.  Returns -1
+ * if the request was released, 0 otherwise.
+ */
+int uring_next_request(struct request_info *ri) {
+	int s;
+
+	if (!ri->crecv && !ri->starved) {
+		uring_arm_recv(ri, OP_CRECV);
+	}
+	if ((s = http_req_parse(&ri->parsed, ri->req, ri->req_read)) == 0) {
+		return 0;
+	}
+	return start_request(ri, s) < 0 ? -1 : 0;
+}
+
+/*
+ * Keep receiving on the client (OP_CRECV) or server (OP_SRECV) socket.
+ * A response is received a buffer at a time instead, so that once it is
+ * all in, nothing is left in flight on the server's connection and it can
+ * go back to the pool.
+ */
+void uring_arm_recv(struct request_info *ri, int op) {
+	if (op == OP_SRECV && !ri->tunnel) {
+		uring_prep_recv(next_sqe(ri->r), ri->sfd, op_data(ri, op));
+	} else {
+		uring_prep_recv_multi(next_sqe(ri->r), op == OP_CRECV ? ri->cfd : ri->sfd,
+				op_data(ri, op));
+	}
+	ri->ops++;
+	if (op == OP_CRECV) {
+		ri->crecv = 1;
+	} else {
+		ri->srecv = 1;
+	}
+}
+
+/*
+ * Every provided buffer is in use, so ri's receive has stopped; it waits
+ * on r->starved until uring_feed_starved() sees buffers come back.
+ */
+void uring_starve(struct request_info *ri) {
+	if (!ri->starved) {
+		ri->starved = 1;
+		ri->snext = ri->r->starved;
+		ri->r->starved = ri;
+	}
+}
+
+/* Restart as many starved receives as there are buffers free */
+void uring_feed_starved(struct reactor *r) {
+	struct request_info *ri;
+	int avail = r->ring->nbufs - r->ring->held;
+
+	while (avail > 0 && (ri = r->starved) != NULL) {
+		r->starved = ri->snext;
+		ri->starved = 0;
+		if (!ri->eof[TO_SERVER] && !ri->crecv) {
+			uring_arm_recv(ri, OP_CRECV);
+			avail--;
+		}
+		if ((ri->state == READ_RESPONSE || ri->state == TUNNEL) &&
+				!ri->eof[TO_CLIENT] && !ri->srecv) {
+			uring_arm_recv(ri, OP_SRECV);
+			avail--;
+		}
+	}
+}
+
+/*
+ * Open a socket for the server at the resolved address, connect, and send
+ * the request (or tell the client its tunnel is open), each step started
+ * by the completion of the last.  Consumes the reference to origin.
+ */
+int uring_connect(struct request_info *ri, resolver_entry_t *origin) {
+	struct addrinfo *ai = origin->ai;
+
+	memcpy(&ri->addr, ai->ai_addr, ai->ai_addrlen);
+	ri->addrlen = ai->ai_addrlen;
+	uring_prep_socket(next_sqe(ri->r), ai->ai_family, ai->ai_socktype, 0,
+			op_data(ri, OP_SOCKET));
+	resolver_release(origin);
+	ri->ops++;
+	ri->state = ri->tunnel ? ESTABLISH : SEND_REQUEST;
+	arm_timer(ri);
+	return 0;
+}
+
+/*
+ * free_request() for the uring engine: stop counting the request as
+ * active, cancel what it has in flight, and free it once that is back.
+ */
+void uring_release(struct request_info *ri) {
+	struct reactor *r = ri->r;
+
+	if (ri->closing) {
+		return;
+	}
+	ri->closing = 1;
+	r->nactive--;
+	disarm_timer(ri);
+	if (ri->ops > 0) {
+		uring_prep_cancel_fixed(next_sqe(r), ri->cfd, 0);
+		if (ri->sfd >= 0) {
+			uring_prep_cancel_fixed(next_sqe(r), ri->sfd, 0);
+		}
+	}
+	uring_reap(ri);
+}
+
+/* Free a released request once nothing in flight names it any more */
+void uring_reap(struct request_info *ri) {
+	struct reactor *r = ri->r;
+	struct request_info **pp;
+	int dir;
+
+	if (ri->ops > 0) {
+		return;
+	}
+	for (dir = 0; dir < 2; dir++) {
+		while (ri->outq_len[dir] > 0) {
+			uring_buf_return(r->ring, ri->outq[dir][ri->outq_head[dir]] >> 16);
+			ri->outq_head[dir] = (ri->outq_head[dir] + 1) % URING_NBUFS;
+			ri->outq_len[dir]--;
+		}
+	}
+	if (ri->starved) {
+		for (pp = &r->starved; *pp != ri; pp = &(*pp)->snext)
+			;
+		*pp = ri->snext;
+	}
+	uring_prep_close_fixed(next_sqe(r), ri->cfd, 0);
+	if (ri->sfd >= 0) {
+		uring_prep_close_fixed(next_sqe(r), ri->sfd, 0);
+	}
+	if (ri->prev != NULL) {
+		ri->prev->next = ri->next;
+	} else {
+		r->active = ri->next;
+	}
+	if (ri->next != NULL) {
+		ri->next->prev = ri->prev;
+	}
+	free(ri);
+	if (r->accept_paused) {
+		uring_arm_accept(r);
+	}
+}
+
 void print_bytes(unsigned char *bytes, int byteslen) {
 	int i, j, byteslen_adjusted;
 
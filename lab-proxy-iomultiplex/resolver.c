@@ -0,0 +1,397 @@
+#define _GNU_SOURCE
+#include "resolver.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+/*
+ * Resolver cache.  Every lookup goes through a table of host:port entries.
+ * Fresh entries are answered immediately; stale ones are dropped and looked
+ * up again.  While an entry is being resolved, further lookups for the same
+ * key wait for that one resolution rather than starting their own.
+ *
+ * resolver_lookup() resolves on the calling thread.  resolver_lookup_async()
+ * hands the work to the resolver threads started by resolver_init() and
+ * reports the result through a resolver_cq_t, so an event loop never blocks
+ * in getaddrinfo().
+ */
+
+static resolver_entry_t *table[RESOLVER_NBUCKETS];
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;  /* an entry resolved */
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;  /* queue non-empty */
+static resolver_entry_t *queue_head, *queue_tail;       /* awaiting a thread */
+static pthread_t *threads;
+static int nthreads;
+static int stopping;
+
+static time_t now_secs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static unsigned int hash_key(const char *key)
+{
+	unsigned int h = 2166136261u;
+	while (*key) {
+		h ^= (unsigned char)*key++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static void free_entry(resolver_entry_t *e)
+{
+	if (e->ai)
+		freeaddrinfo(e->ai);
+	free(e->key);
+	free(e);
+}
+
+/* Drop one reference.  Caller holds mutex. */
+static int put_entry_locked(resolver_entry_t *e)
+{
+	return --e->refcnt == 0;
+}
+
+/*
+ * Find the entry for key, discarding it if it has gone stale.  Caller holds
+ * mutex.
+ */
+static resolver_entry_t *find_locked(const char *key, unsigned int b)
+{
+	resolver_entry_t **pp, *e;
+
+	for (pp = &table[b]; (e = *pp) != NULL; pp = &e->next) {
+		if (strcmp(e->key, key) != 0)
+			continue;
+		if (e->pending || e->expires > now_secs())
+			return e;
+		*pp = e->next;
+		if (put_entry_locked(e))
+			free_entry(e);
+		return NULL;
+	}
+	return NULL;
+}
+
+/*
+ * Add a pending entry for host:port to the table.  It starts with two
+ * references: the table's and the caller's.  Caller holds mutex.
+ */
+static resolver_entry_t *add_locked(const char *host, const char *port,
+		unsigned int b)
+{
+	size_t hlen = strlen(host), plen = strlen(port);
+	resolver_entry_t *e = calloc(1, sizeof(resolver_entry_t));
+
+	if (e == NULL)
+		return NULL;
+	/* key, host and port share one allocation */
+	if ((e->key = malloc(2 * (hlen + plen + 2))) == NULL) {
+		free(e);
+		return NULL;
+	}
+	sprintf(e->key, "%s:%s", host, port);
+	e->host = e->key + hlen + plen + 2;
+	strcpy(e->host, host);
+	e->port = e->host + hlen + 1;
+	strcpy(e->port, port);
+	e->pending = 1;
+	e->refcnt = 2;
+	e->next = table[b];
+	table[b] = e;
+	return e;
+}
+
+static void cq_push(resolver_job_t *job)
+{
+	resolver_cq_t *cq = job->cq;
+
+	pthread_mutex_lock(&cq->mutex);
+	job->next = NULL;
+	if (cq->tail)
+		cq->tail->next = job;
+	else
+		cq->head = job;
+	cq->tail = job;
+	pthread_mutex_unlock(&cq->mutex);
+
+	/* If the pipe is full, the reader has a wakeup pending anyway */
+	while (write(cq->fds[1], "", 1) < 0 && errno == EINTR)
+		;
+}
+
+/* Resolve a pending entry and wake everyone waiting on it */
+static void resolve(resolver_entry_t *e)
+{
+	struct addrinfo hints;
+	struct addrinfo *ai = NULL;
+	resolver_job_t *job, *next;
+	int err;
+
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	err = getaddrinfo(e->host, e->port, &hints, &ai);
+
+	pthread_mutex_lock(&mutex);
+	e->err = err;
+	e->ai = err == 0 ? ai : NULL;
+	e->expires = now_secs() +
+		(err == 0 ? RESOLVER_POSITIVE_TTL : RESOLVER_NEGATIVE_TTL);
+	e->pending = 0;
+	job = e->waiters;
+	e->waiters = NULL;
+	pthread_cond_broadcast(&done);
+	pthread_mutex_unlock(&mutex);
+
+	for (; job; job = next) {
+		next = job->next;
+		cq_push(job);
+	}
+}
+
+static void *resolver_thread(void *vargp)
+{
+	resolver_entry_t *e;
+
+	pthread_mutex_lock(&mutex);
+	while (1) {
+		while (queue_head == NULL && !stopping)
+			pthread_cond_wait(&work, &mutex);
+		if (stopping)
+			break;
+		e = queue_head;
+		if ((queue_head = e->qnext) == NULL)
+			queue_tail = NULL;
+		pthread_mutex_unlock(&mutex);
+		resolve(e);
+		pthread_mutex_lock(&mutex);
+	}
+	pthread_mutex_unlock(&mutex);
+	return NULL;
+}
+
+/*
+ * Start n resolver threads for resolver_lookup_async().  With n == 0,
+ * asynchronous lookups that miss the cache resolve on the calling thread.
+ */
+void resolver_init(int n)
+{
+	int i;
+
+	stopping = 0;
+	threads = n > 0 ? calloc(n, sizeof(pthread_t)) : NULL;
+	for (i = 0; i < n; i++)
+		pthread_create(&threads[i], NULL, resolver_thread, NULL);
+	nthreads = n;
+}
+
+/*
+ * Stop the resolver threads (after any getaddrinfo() they are in returns)
+ * and empty the cache.  Lookups still waiting for a thread never complete.
+ */
+void resolver_deinit(void)
+{
+	resolver_entry_t *e, *next;
+	resolver_job_t *job, *jnext;
+	int i;
+
+	pthread_mutex_lock(&mutex);
+	stopping = 1;
+	pthread_cond_broadcast(&work);
+	pthread_mutex_unlock(&mutex);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	threads = NULL;
+	nthreads = 0;
+
+	pthread_mutex_lock(&mutex);
+	for (i = 0; i < RESOLVER_NBUCKETS; i++) {
+		for (e = table[i]; e; e = next) {
+			next = e->next;
+			for (job = e->waiters; job; job = jnext) {
+				jnext = job->next;
+				put_entry_locked(e);
+				free(job);
+			}
+			e->waiters = NULL;
+			if (put_entry_locked(e))
+				free_entry(e);
+		}
+		table[i] = NULL;
+	}
+	queue_head = queue_tail = NULL;
+	pthread_mutex_unlock(&mutex);
+}
+
+/*
+ * Resolve host:port on the calling thread, or wait for a resolution of the
+ * same key already in progress.  The returned entry holds a reference and
+ * stays valid until resolver_release(); its ai is NULL (and err says why)
+ * if resolution failed.  Returns NULL only if out of memory.
+ */
+resolver_entry_t *resolver_lookup(const char *host, const char *port)
+{
+	char key[NI_MAXHOST + NI_MAXSERV + 2];
+	unsigned int b;
+	resolver_entry_t *e;
+
+	snprintf(key, sizeof(key), "%s:%s", host, port);
+	b = hash_key(key) % RESOLVER_NBUCKETS;
+
+	pthread_mutex_lock(&mutex);
+	if ((e = find_locked(key, b)) == NULL) {
+		e = add_locked(host, port, b);
+		pthread_mutex_unlock(&mutex);
+		if (e != NULL)
+			resolve(e);
+		return e;
+	}
+	e->refcnt++;
+	while (e->pending)
+		pthread_cond_wait(&done, &mutex);
+	pthread_mutex_unlock(&mutex);
+	return e;
+}
+
+/*
+ * Look up host:port without blocking.  If the answer is cached, store the
+ * entry in *entryp and return 1.  Otherwise return 0; once the resolver
+ * threads finish, (arg, entry) is delivered through cq.  Either way the
+ * caller owns a reference to the entry and must resolver_release() it.
+ * Returns -1 if out of memory.
+ */
+int resolver_lookup_async(resolver_cq_t *cq, const char *host,
+		const char *port, void *arg, resolver_entry_t **entryp)
+{
+	char key[NI_MAXHOST + NI_MAXSERV + 2];
+	unsigned int b;
+	resolver_entry_t *e;
+	resolver_job_t *job;
+
+	snprintf(key, sizeof(key), "%s:%s", host, port);
+	b = hash_key(key) % RESOLVER_NBUCKETS;
+
+	pthread_mutex_lock(&mutex);
+	e = find_locked(key, b);
+	if (e != NULL && !e->pending) {
+		e->refcnt++;
+		pthread_mutex_unlock(&mutex);
+		*entryp = e;
+		return 1;
+	}
+	if (e == NULL && nthreads == 0) {
+		e = add_locked(host, port, b);
+		pthread_mutex_unlock(&mutex);
+		if (e == NULL)
+			return -1;
+		resolve(e);
+		*entryp = e;
+		return 1;
+	}
+
+	if ((job = malloc(sizeof(resolver_job_t))) == NULL) {
+		pthread_mutex_unlock(&mutex);
+		return -1;
+	}
+	if (e == NULL) {
+		if ((e = add_locked(host, port, b)) == NULL) {
+			pthread_mutex_unlock(&mutex);
+			free(job);
+			return -1;
+		}
+		e->qnext = NULL;
+		if (queue_tail)
+			queue_tail->qnext = e;
+		else
+			queue_head = e;
+		queue_tail = e;
+		pthread_cond_signal(&work);
+	} else {
+		e->refcnt++;
+	}
+	job->entry = e;
+	job->cq = cq;
+	job->arg = arg;
+	job->next = e->waiters;
+	e->waiters = job;
+	pthread_mutex_unlock(&mutex);
+	return 0;
+}
+
+/* Drop a reference returned by one of the lookup functions */
+void resolver_release(resolver_entry_t *entry)
+{
+	int dead;
+
+	pthread_mutex_lock(&mutex);
+	dead = put_entry_locked(entry);
+	pthread_mutex_unlock(&mutex);
+	if (dead)
+		free_entry(entry);
+}
+
+/* Create an empty completion queue.  Returns 0 on success, -1 on error. */
+int resolver_cq_init(resolver_cq_t *cq)
+{
+	if (pipe2(cq->fds, O_NONBLOCK | O_CLOEXEC) < 0)
+		return -1;
+	pthread_mutex_init(&cq->mutex, NULL);
+	cq->head = cq->tail = NULL;
+	return 0;
+}
+
+/* Close the queue and drop any completions nobody collected */
+void resolver_cq_deinit(resolver_cq_t *cq)
+{
+	void *arg;
+	resolver_entry_t *e;
+
+	while (resolver_cq_next(cq, &arg, &e))
+		resolver_release(e);
+	close(cq->fds[0]);
+	close(cq->fds[1]);
+	pthread_mutex_destroy(&cq->mutex);
+}
+
+/*
+ * Pop the next completed lookup from cq.  Returns 1 and fills in *argp and
+ * *entryp, or 0 if there are none.  Call this until it returns 0 whenever
+ * fds[0] becomes readable; it also drains the pipe.
+ */
+int resolver_cq_next(resolver_cq_t *cq, void **argp, resolver_entry_t **entryp)
+{
+	char buf[64];
+	resolver_job_t *job;
+	int tries;
+
+	for (tries = 0; tries < 2; tries++) {
+		pthread_mutex_lock(&cq->mutex);
+		if ((job = cq->head) != NULL) {
+			if ((cq->head = job->next) == NULL)
+				cq->tail = NULL;
+		}
+		pthread_mutex_unlock(&cq->mutex);
+		if (job != NULL) {
+			*argp = job->arg;
+			*entryp = job->entry;
+			free(job);
+			return 1;
+		}
+		/* Empty: consume the wakeups, then look once more for anything
+		 * queued just before the last of them was written */
+		while (read(cq->fds[0], buf, sizeof(buf)) > 0)
+			;
+	}
+	return 0;
+}
@@ -5,7 +5,7 @@
  */
 #include "csapp.h"
 
-void doit(int fd);
+int doit(int fd, char *request);
 void read_requesthdrs(rio_t *rp);
 int parse_uri(char *uri, char *filename, char *cgiargs);
 void serve_static(int fd, char *filename, int filesize);
@@ -13,11 +13,12 @@ void get_filetype(char *filename, char *filetype);
 void serve_dynamic(int fd, char *filename, char *cgiargs);
 void clienterror(int fd, char *cause, char *errnum, 
 		 char *shortmsg, char *longmsg);
+void log_access(char *hostname, char *port, char *request, int status);
 
 int main(int argc, char **argv) 
 {
-    int listenfd, connfd;
-    char hostname[MAXLINE], port[MAXLINE];
+    int listenfd, connfd, status;
+    char hostname[MAXLINE], port[MAXLINE], request[MAXLINE];
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
 
@@ -35,9 +36,9 @@ int main(int argc, char **argv)
 	    Close(listenfd);                                            //line:netp:tiny:close
             Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE, 
                         port, MAXLINE, 0);
-            printf("Accepted connection from (%s, %s)\n", hostname, port);
-	    doit(connfd);                                             //line:netp:tiny:doit
+	    status = doit(connfd, request);                           //line:netp:tiny:doit
 	    Close(connfd);                                            //line:netp:tiny:close
+	    log_access(hostname, port, request, status);
 	    exit(0);
 	}
 	Close(connfd);                                            //line:netp:tiny:close
@@ -46,10 +47,11 @@ int main(int argc, char **argv)
 /* $end tinymain */
 
 /*
- * doit - handle one HTTP request/response transaction
+ * doit - handle one HTTP request/response transaction, leaving its
+ *        request line in request; returns the status sent (0 if none)
  */
 /* $begin doit */
-void doit(int fd) 
+int doit(int fd, char *request) 
 {
     int is_static;
     struct stat sbuf;
@@ -58,15 +60,17 @@ void doit(int fd)
     rio_t rio;
 
     /* Read request line and headers */
+    strcpy(request, "");
     Rio_readinitb(&rio, fd);
     if (!Rio_readlineb(&rio, buf, MAXLINE))  //line:netp:doit:readrequest
-        return;
-    printf("%s", buf);
+        return 0;
     sscanf(buf, "%s %s %s", method, uri, version);       //line:netp:doit:parserequest
+    strcpy(request, buf);
+    request[strcspn(request, "\r\n")] = '\0';
     if (strcasecmp(method, "GET")) {                     //line:netp:doit:beginrequesterr
         clienterror(fd, method, "501", "Not Implemented",
                     "Tiny does not implement this method");
-        return;
+        return 501;
     }                                                    //line:netp:doit:endrequesterr
     read_requesthdrs(&rio);                              //line:netp:doit:readrequesthdrs
 
@@ -75,14 +79,14 @@ void doit(int fd)
     if (stat(filename, &sbuf) < 0) {                     //line:netp:doit:beginnotfound
 	clienterror(fd, filename, "404", "Not found",
 		    "Tiny couldn't find this file");
-	return;
+	return 404;
     }                                                    //line:netp:doit:endnotfound
 
     if (is_static) { /* Serve static content */          
 	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) { //line:netp:doit:readable
 	    clienterror(fd, filename, "403", "Forbidden",
 			"Tiny couldn't read the file");
-	    return;
+	    return 403;
 	}
 	serve_static(fd, filename, sbuf.st_size);        //line:netp:doit:servestatic
     }
@@ -90,10 +94,11 @@ void doit(int fd)
 	if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) { //line:netp:doit:executable
 	    clienterror(fd, filename, "403", "Forbidden",
 			"Tiny couldn't run the CGI program");
-	    return;
+	    return 403;
 	}
 	serve_dynamic(fd, filename, cgiargs);            //line:netp:doit:servedynamic
     }
+    return 200;
 }
 /* $end doit */
 
@@ -106,10 +111,8 @@ void read_requesthdrs(rio_t *rp)
     char buf[MAXLINE];
 
     Rio_readlineb(rp, buf, MAXLINE);
-    printf("%s", buf);
     while(strcmp(buf, "\r\n")) {          //line:netp:readhdrs:checkterm
 	Rio_readlineb(rp, buf, MAXLINE);
-	printf("%s", buf);
     }
     return;
 }
@@ -161,8 +164,6 @@ void serve_static(int fd, char *filename, int filesize)
     sprintf(buf, "%sContent-length: %d\r\n", buf, filesize);
     sprintf(buf, "%sContent-type: %s\r\n\r\n", buf, filetype);
     Rio_writen(fd, buf, strlen(buf));       //line:netp:servestatic:endserve
-    printf("Response headers:\n");
-    printf("%s", buf);
 
     /* Send response body to client */
     srcfd = Open(filename, O_RDONLY, 0);    //line:netp:servestatic:open
@@ -240,3 +241,27 @@ void clienterror(int fd, char *cause, char *errnum,
     Rio_writen(fd, body, strlen(body));
 }
 /* $end clienterror */
+
+/*
+ * log_access - log one line for the request a child served: the client,
+ *     the request, and the status it got.  The child writes it with a
+ *     single write, once the connection is closed, so neither the client
+ *     nor the other children ever wait on whatever reads Tiny's output.
+ */
+/* $begin log_access */
+void log_access(char *hostname, char *port, char *request, int status)
+{
+    char buf[MAXLINE];
+    int n;
+
+    if (!*request)
+	return;
+    n = snprintf(buf, MAXLINE, "%s:%s \"%s\" %d\n", hostname, port, request, status);
+    if (n >= MAXLINE) {
+	n = MAXLINE - 1;
+	buf[n - 1] = '\n';
+    }
+    if (write(STDOUT_FILENO, buf, n) < 0)
+	; /* nowhere to report it */
+}
+/* $end log_access */
@@ -0,0 +1,350 @@
+#define _GNU_SOURCE
+#include "uring.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+/*
+ * The kernel and this process share the two queues.  Each side only
+ * writes its own end of each ring: we fill submission entries and move
+ * the SQ tail, the kernel moves the SQ head as it consumes them; the
+ * kernel fills completions and moves the CQ tail, we move the CQ head once
+ * we are done with them.  A release store publishes an index, and an
+ * acquire load reads the other side's, so the entries behind an index are
+ * always visible by the time the index is.
+ *
+ * Submissions are only published, never sent one at a time: a whole
+ * pass of the event loop goes to the kernel in the one io_uring_enter()
+ * that also waits for the next completions.
+ */
+
+#define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int enter(uring_t *u, unsigned submit, unsigned wait, unsigned flags,
+		void *arg, size_t argsz)
+{
+	u->enters++;
+	return syscall(__NR_io_uring_enter, u->fd, submit, wait, flags, arg, argsz);
+}
+
+static int setup(unsigned entries, struct io_uring_params *p, unsigned flags)
+{
+	memset(p, 0, sizeof(*p));
+	p->flags = flags | IORING_SETUP_CQSIZE;
+	p->cq_entries = entries * 4;    // multishot ops post many completions each
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+/*
+ * Set up a ring of entries submissions, a table of nfiles fixed
+ * descriptors, all empty, and nbufs provided buffers of buf_size bytes
+ * (nbufs a power of two).  The ring belongs to the calling thread.
+ * Returns 0, or -1 with errno set.
+ */
+int uring_init(uring_t *u, unsigned entries, unsigned nfiles, unsigned nbufs,
+		unsigned buf_size)
+{
+	struct io_uring_params p;
+	struct io_uring_rsrc_register files;
+	struct io_uring_buf_reg reg;
+	unsigned *sq_array;
+	unsigned i;
+
+	memset(u, 0, sizeof(*u));
+	// only this thread submits, and only while it waits, so completions
+	// can be run then rather than interrupting it; older kernels lack these
+	u->fd = setup(entries, &p, IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+			IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN);
+	if (u->fd < 0 && errno == EINVAL)
+		u->fd = setup(entries, &p, 0);
+	if (u->fd < 0)
+		return -1;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+		close(u->fd);
+		errno = ENOSYS;
+		return -1;
+	}
+
+	u->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (u->cq_map_len > u->sq_map_len)
+		u->sq_map_len = u->cq_map_len;
+	u->sq_map = mmap(NULL, u->sq_map_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sq_map == MAP_FAILED || u->sqes == MAP_FAILED)
+		goto fail;
+	u->cq_map = u->sq_map;  // IORING_FEAT_SINGLE_MMAP: one mapping for both
+	u->cq_map_len = 0;
+
+	u->sq_head = (unsigned *)((char *)u->sq_map + p.sq_off.head);
+	u->sq_tail = (unsigned *)((char *)u->sq_map + p.sq_off.tail);
+	u->sq_mask = *(unsigned *)((char *)u->sq_map + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	u->sqe_tail = *u->sq_tail;
+	// entries are always used in ring order, so the indirection array
+	// can stay the identity
+	sq_array = (unsigned *)((char *)u->sq_map + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++)
+		sq_array[i] = i;
+	u->cq_head = (unsigned *)((char *)u->cq_map + p.cq_off.head);
+	u->cq_tail = (unsigned *)((char *)u->cq_map + p.cq_off.tail);
+	u->cq_mask = *(unsigned *)((char *)u->cq_map + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->cq_map + p.cq_off.cqes);
+
+	memset(&files, 0, sizeof(files));
+	files.nr = nfiles;
+	files.flags = IORING_RSRC_REGISTER_SPARSE;
+	if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_FILES2,
+				&files, sizeof(files)) < 0)
+		goto fail;
+
+	u->nbufs = nbufs;
+	u->buf_size = buf_size;
+	u->br_len = nbufs * sizeof(struct io_uring_buf);
+	u->br = mmap(NULL, u->br_len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	u->bufs = malloc((size_t)nbufs * buf_size);
+	if (u->br == MAP_FAILED || u->bufs == NULL)
+		goto fail;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)u->br;
+	reg.ring_entries = nbufs;
+	reg.bgid = URING_BGID;
+	if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		goto fail;
+	u->held = nbufs;
+	for (i = 0; i < nbufs; i++)
+		uring_buf_return(u, i);
+	return 0;
+
+fail:
+	i = errno;
+	uring_deinit(u);
+	errno = i;
+	return -1;
+}
+
+/* Close the ring; the kernel drops its fixed descriptors with it */
+void uring_deinit(uring_t *u)
+{
+	close(u->fd);
+	if (u->sq_map != NULL && u->sq_map != MAP_FAILED)
+		munmap(u->sq_map, u->sq_map_len);
+	if (u->sqes != NULL && u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqes_len);
+	if (u->br != NULL && u->br != MAP_FAILED)
+		munmap(u->br, u->br_len);
+	free(u->bufs);
+	u->fd = -1;
+	u->sq_map = NULL;
+	u->sqes = NULL;
+	u->br = NULL;
+	u->bufs = NULL;
+}
+
+/*
+ * A cleared submission entry to fill in.  It goes to the kernel with the
+ * next uring_submit_wait(), or now, if the queue has filled up.
+ */
+struct io_uring_sqe *uring_sqe(uring_t *u)
+{
+	struct io_uring_sqe *sqe;
+
+	while (u->sqe_tail - load_acquire(u->sq_head) >= u->sq_entries) {
+		store_release(u->sq_tail, u->sqe_tail);
+		if (enter(u, u->sqe_tail - load_acquire(u->sq_head), 0, 0, NULL, 0) < 0 &&
+				errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			return NULL;
+	}
+	sqe = &u->sqes[u->sqe_tail & u->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sqe_tail++;
+	return sqe;
+}
+
+/*
+ * Hand every entry filled since the last call to the kernel, and wait
+ * until there is at least one completion or timeout_ms have passed, in one
+ * system call.  Returns 0, or -1 with errno set (EINTR for a signal).
+ */
+int uring_submit_wait(uring_t *u, int timeout_ms)
+{
+	struct __kernel_timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+	struct io_uring_getevents_arg arg;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.sigmask_sz = _NSIG / 8;
+	arg.ts = (unsigned long)&ts;
+	store_release(u->sq_tail, u->sqe_tail);
+	if (enter(u, u->sqe_tail - load_acquire(u->sq_head), 1,
+				IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0 &&
+			errno != ETIME)
+		return -1;
+	return 0;
+}
+
+/* The oldest completion not yet seen, or NULL */
+struct io_uring_cqe *uring_peek(uring_t *u)
+{
+	unsigned head = *u->cq_head;
+
+	if (head == load_acquire(u->cq_tail))
+		return NULL;
+	return &u->cqes[head & u->cq_mask];
+}
+
+/* Done with the completion uring_peek() returned; the kernel may reuse it */
+void uring_seen(uring_t *u)
+{
+	store_release(u->cq_head, *u->cq_head + 1);
+	u->completions++;
+}
+
+/*
+ * The id of the provided buffer a receive completion filled, or -1 if it
+ * used none.  The buffer is the caller's until uring_buf_return().
+ */
+int uring_cqe_buf(uring_t *u, const struct io_uring_cqe *cqe)
+{
+	if (!(cqe->flags & IORING_CQE_F_BUFFER))
+		return -1;
+	u->held++;
+	return cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+}
+
+/* Where provided buffer bid is */
+char *uring_buf(uring_t *u, int bid)
+{
+	return u->bufs + (size_t)bid * u->buf_size;
+}
+
+/* Give buffer bid back for the kernel to fill again */
+void uring_buf_return(uring_t *u, int bid)
+{
+	struct io_uring_buf *b = &u->br->bufs[u->br_tail & (u->nbufs - 1)];
+
+	b->addr = (unsigned long)uring_buf(u, bid);
+	b->len = u->buf_size;
+	b->bid = bid;
+	store_release(&u->br->tail, ++u->br_tail);
+	u->held--;
+}
+
+/* Accept connections on fd until cancelled, each into a new fixed slot */
+void uring_prep_accept_multi(struct io_uring_sqe *sqe, int fd, unsigned long long data)
+{
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->file_index = IORING_FILE_INDEX_ALLOC;
+	sqe->user_data = data;
+}
+
+/* Create a socket in a new fixed slot; the completion's res is the slot */
+void uring_prep_socket(struct io_uring_sqe *sqe, int domain, int type, int protocol,
+		unsigned long long data)
+{
+	sqe->opcode = IORING_OP_SOCKET;
+	sqe->fd = domain;
+	sqe->off = type;
+	sqe->len = protocol;
+	sqe->file_index = IORING_FILE_INDEX_ALLOC;
+	sqe->user_data = data;
+}
+
+/* addr must stay valid until the connect completes */
+void uring_prep_connect(struct io_uring_sqe *sqe, int fx, const void *addr,
+		unsigned addrlen, unsigned long long data)
+{
+	sqe->opcode = IORING_OP_CONNECT;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = fx;
+	sqe->addr = (unsigned long)addr;
+	sqe->off = addrlen;
+	sqe->user_data = data;
+}
+
+void uring_prep_send(struct io_uring_sqe *sqe, int fx, const void *buf, size_t len,
+		unsigned long long data)
+{
+	sqe->opcode = IORING_OP_SEND;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = fx;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = data;
+}
+
+/* Shut down one or both directions of fixed slot fx (SHUT_WR, ...) */
+void uring_prep_shutdown(struct io_uring_sqe *sqe, int fx, int how, unsigned long long data)
+{
+	sqe->opcode = IORING_OP_SHUTDOWN;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = fx;
+	sqe->len = how;
+	sqe->user_data = data;
+}
+
+/*
+ * Receive on fx until end of file, an error, or the buffers run out
+ * (ENOBUFS), each completion into a provided buffer from URING_BGID.
+ */
+void uring_prep_recv_multi(struct io_uring_sqe *sqe, int fx, unsigned long long data)
+{
+	sqe->opcode = IORING_OP_RECV;
+	sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+	sqe->fd = fx;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = data;
+}
+
+/* Receive once on fx, into a provided buffer from URING_BGID */
+void uring_prep_recv(struct io_uring_sqe *sqe, int fx, unsigned long long data)
+{
+	sqe->opcode = IORING_OP_RECV;
+	sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+	sqe->fd = fx;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = data;
+}
+
+/* Report each time the ordinary descriptor fd becomes readable */
+void uring_prep_poll_multi(struct io_uring_sqe *sqe, int fd, unsigned long long data)
+{
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = data;
+}
+
+/* Cancel everything in flight on fixed slot fx */
+void uring_prep_cancel_fixed(struct io_uring_sqe *sqe, int fx, unsigned long long data)
+{
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = fx;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_FD_FIXED |
+		IORING_ASYNC_CANCEL_ALL;
+	sqe->user_data = data;
+}
+
+/* Close fixed slot fx, freeing it for the next accept or socket */
+void uring_prep_close_fixed(struct io_uring_sqe *sqe, int fx, unsigned long long data)
+{
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->file_index = fx + 1;
+	sqe->user_data = data;
+}
@@ -0,0 +1,70 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/*
+ * Just enough of io_uring for the proxy's uring engine, on the raw system
+ * calls: one ring, a sparse table of fixed (direct) descriptors that
+ * accept and socket fill in, and one group of provided buffers, handed out
+ * by the kernel to multishot receives.
+ */
+typedef struct {
+	int fd;
+	/* submission queue, shared with the kernel */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+	unsigned sqe_tail;          /* next entry to fill; published on submit */
+	/* completion queue, shared with the kernel */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	/* the mappings, for uring_deinit() */
+	void *sq_map, *cq_map;
+	size_t sq_map_len, cq_map_len, sqes_len;
+	/* provided buffers: a ring of nbufs ids the kernel picks from */
+	struct io_uring_buf_ring *br;
+	size_t br_len;
+	char *bufs;                 /* nbufs buffers of buf_size bytes */
+	unsigned nbufs;
+	unsigned buf_size;
+	unsigned short br_tail;     /* next slot to return a buffer to */
+	unsigned held;              /* buffers filled and not yet returned */
+	/* counters */
+	unsigned long enters;       /* io_uring_enter() calls */
+	unsigned long completions;  /* completions reaped */
+} uring_t;
+
+#define URING_BGID 0            /* the one buffer group */
+
+int uring_init(uring_t *u, unsigned entries, unsigned nfiles, unsigned nbufs,
+		unsigned buf_size);
+void uring_deinit(uring_t *u);
+struct io_uring_sqe *uring_sqe(uring_t *u);
+int uring_submit_wait(uring_t *u, int timeout_ms);
+struct io_uring_cqe *uring_peek(uring_t *u);
+void uring_seen(uring_t *u);
+int uring_cqe_buf(uring_t *u, const struct io_uring_cqe *cqe);
+char *uring_buf(uring_t *u, int bid);
+void uring_buf_return(uring_t *u, int bid);
+
+void uring_prep_accept_multi(struct io_uring_sqe *sqe, int fd, unsigned long long data);
+void uring_prep_socket(struct io_uring_sqe *sqe, int domain, int type, int protocol,
+		unsigned long long data);
+void uring_prep_connect(struct io_uring_sqe *sqe, int fx, const void *addr,
+		unsigned addrlen, unsigned long long data);
+void uring_prep_send(struct io_uring_sqe *sqe, int fx, const void *buf, size_t len,
+		unsigned long long data);
+void uring_prep_shutdown(struct io_uring_sqe *sqe, int fx, int how, unsigned long long data);
+void uring_prep_recv(struct io_uring_sqe *sqe, int fx, unsigned long long data);
+void uring_prep_recv_multi(struct io_uring_sqe *sqe, int fx, unsigned long long data);
+void uring_prep_poll_multi(struct io_uring_sqe *sqe, int fd, unsigned long long data);
+void uring_prep_cancel_fixed(struct io_uring_sqe *sqe, int fx, unsigned long long data);
+void uring_prep_close_fixed(struct io_uring_sqe *sqe, int fx, unsigned long long data);
+
+#endif /* __URING_H__ */
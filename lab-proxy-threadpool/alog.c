@@ -0,0 +1,357 @@
+#include "alog.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * The access log.  A request's entry must never wait on the disk or on
+ * whoever reads stdout, so each thread formats its entries into a ring of
+ * its own, and a background writer drains every ring, ALOG_FLUSH_MS apart,
+ * into batches of up to ALOG_BATCH bytes that go out in one write(2), or,
+ * with a log file, are copied into a shared mapping of it that the kernel
+ * writes back when it likes.  A ring has one producer (its thread) and one
+ * consumer (the writer), so it needs no lock: the producer publishes an
+ * entry by storing head after the bytes, the writer frees the space by
+ * storing tail after copying them out.  An entry that does not fit is
+ * dropped and counted instead; the producer never waits for room.  Each
+ * thread's entries come out in order, but two threads' can be swapped by
+ * up to a flush apart, so order by the timestamp that leads each entry.
+ *
+ * Rings are never freed.  As with the stats blocks, an exiting thread's
+ * ring is marked unused and the next new thread takes it over, with
+ * whatever it still holds, so no entry is lost.
+ */
+
+typedef struct alog_ring {
+	char buf[ALOG_RING_SIZE];
+	unsigned long head __attribute__((aligned(64)));  /* bytes ever written */
+	unsigned long dropped;      /* entries that did not fit */
+	unsigned long tail __attribute__((aligned(64)));  /* bytes ever drained */
+	int in_use;                 /* owned by a running thread */
+	struct alog_ring *next;
+} alog_ring_t;
+
+static alog_ring_t *rings;      /* every ring ever made */
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static __thread alog_ring_t *mine;
+static __thread unsigned seen;  /* alog_sampled() calls on this thread */
+
+static int logging;             /* alog_open() succeeded */
+static unsigned sample_every;
+static int stopping;
+static pthread_t writer_tid;
+static int out_fd = -1;
+static char *batch;
+static size_t batch_len;
+
+/* With a log file, the window of it that is mapped */
+static char *map;
+static off_t map_off;           /* file offset of map[0] */
+static size_t map_pos;          /* bytes of the window used */
+
+/* The exiting thread's ring is up for grabs */
+static void release_ring(void *arg)
+{
+	alog_ring_t *r = arg;
+
+	pthread_mutex_lock(&rings_lock);
+	r->in_use = 0;
+	pthread_mutex_unlock(&rings_lock);
+}
+
+static void make_key(void)
+{
+	pthread_key_create(&ring_key, release_ring);
+}
+
+/* This thread's ring, claimed on first use; NULL if memory runs out */
+static alog_ring_t *local(void)
+{
+	alog_ring_t *r;
+
+	if (mine != NULL)
+		return mine;
+	pthread_once(&ring_once, make_key);
+	pthread_mutex_lock(&rings_lock);
+	for (r = rings; r != NULL && r->in_use; r = r->next)
+		;
+	if (r == NULL && (r = calloc(1, sizeof(alog_ring_t))) != NULL) {
+		r->next = rings;
+		rings = r;
+	}
+	if (r != NULL)
+		r->in_use = 1;
+	pthread_mutex_unlock(&rings_lock);
+	if (r != NULL)
+		pthread_setspecific(ring_key, r);
+	return mine = r;
+}
+
+/*
+ * Move the mapped window on to the next ALOG_MAP_CHUNK bytes of the file,
+ * growing it to cover them.
+ */
+static int remap(void)
+{
+	if (map != NULL) {
+		munmap(map, ALOG_MAP_CHUNK);
+		map_off += ALOG_MAP_CHUNK;
+		map_pos = 0;
+	}
+	if (ftruncate(out_fd, map_off + ALOG_MAP_CHUNK) < 0)
+		return -1;
+	map = mmap(NULL, ALOG_MAP_CHUNK, PROT_WRITE, MAP_SHARED, out_fd, map_off);
+	if (map == MAP_FAILED) {
+		map = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/* Send the batch on its way; on an error it is dropped */
+static void flush(void)
+{
+	size_t done = 0, n;
+	ssize_t w;
+
+	while (done < batch_len) {
+		if (map != NULL) {
+			if (map_pos == ALOG_MAP_CHUNK && remap() < 0)
+				break;
+			n = batch_len - done;
+			if (n > ALOG_MAP_CHUNK - map_pos)
+				n = ALOG_MAP_CHUNK - map_pos;
+			memcpy(map + map_pos, batch + done, n);
+			map_pos += n;
+			done += n;
+		} else if ((w = write(out_fd, batch + done, batch_len - done)) > 0) {
+			done += w;
+		} else if (w < 0 && errno != EINTR) {
+			break;
+		}
+	}
+	batch_len = 0;
+}
+
+/* Copy out all that r holds, flushing whenever the batch fills */
+static void drain(alog_ring_t *r)
+{
+	unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	unsigned long tail = r->tail;
+	size_t i, n;
+
+	while (tail != head) {
+		if (batch_len == ALOG_BATCH)
+			flush();
+		i = tail & (ALOG_RING_SIZE - 1);
+		n = head - tail;
+		if (n > ALOG_RING_SIZE - i)
+			n = ALOG_RING_SIZE - i;
+		if (n > ALOG_BATCH - batch_len)
+			n = ALOG_BATCH - batch_len;
+		memcpy(batch + batch_len, r->buf + i, n);
+		batch_len += n;
+		tail += n;
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+	}
+}
+
+static void *writer(void *arg)
+{
+	struct timespec nap = { 0, ALOG_FLUSH_MS * 1000000L };
+	alog_ring_t *r;
+	int last;
+
+	for (;;) {
+		last = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+		// rings are only ever added at the front, so the list can be
+		// walked without the lock once its head is read
+		pthread_mutex_lock(&rings_lock);
+		r = rings;
+		pthread_mutex_unlock(&rings_lock);
+		for (; r != NULL; r = r->next)
+			drain(r);
+		if (batch_len > 0)
+			flush();
+		if (last)
+			return NULL;
+		nanosleep(&nap, NULL);
+	}
+}
+
+/*
+ * Where the last entry in a log file ends.  A run that died before
+ * alog_close() leaves its last mapped chunk padded with NULs; new entries
+ * go over them.
+ */
+static off_t log_end(int fd, off_t size)
+{
+	char blk[4096];
+	off_t at;
+	ssize_t n;
+
+	while (size > 0) {
+		at = size > sizeof(blk) ? size - sizeof(blk) : 0;
+		if ((n = pread(fd, blk, size - at, at)) != size - at)
+			return size;
+		while (n > 0 && blk[n - 1] == '\0')
+			n--;
+		if (n > 0)
+			return at + n;
+		size = at;
+	}
+	return 0;
+}
+
+/*
+ * Start logging to path, appended to through a mapping, or to stdout if
+ * path is NULL, keeping one request in every sample (0 or 1 keeps them
+ * all).  Returns 0, or -1 with errno set.
+ */
+int alog_open(const char *path, unsigned sample)
+{
+	sigset_t all, old;
+	struct stat st;
+	off_t end;
+	int err;
+
+	if ((batch = malloc(ALOG_BATCH)) == NULL)
+		return -1;
+	out_fd = STDOUT_FILENO;
+	if (path != NULL) {
+		if ((out_fd = open(path, O_RDWR | O_CREAT, 0644)) < 0 || fstat(out_fd, &st) < 0)
+			goto fail;
+		end = log_end(out_fd, st.st_size);
+		map_off = end & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+		map_pos = end - map_off;
+		if (remap() < 0)
+			goto fail;
+	}
+	sample_every = sample;
+	// the writer takes no signals; they are for the threads that asked
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	err = pthread_create(&writer_tid, NULL, writer, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err != 0) {
+		errno = err;
+		goto fail;
+	}
+	logging = 1;
+	return 0;
+
+fail:
+	err = errno;
+	if (map != NULL)
+		munmap(map, ALOG_MAP_CHUNK);
+	map = NULL;
+	if (out_fd >= 0 && out_fd != STDOUT_FILENO)
+		close(out_fd);
+	out_fd = -1;
+	free(batch);
+	batch = NULL;
+	errno = err;
+	return -1;
+}
+
+/*
+ * Write out every entry logged so far and stop.  Entries logged from here
+ * on are dropped, so call it once the threads that log are done.
+ */
+void alog_close(void)
+{
+	if (!logging)
+		return;
+	logging = 0;
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+	pthread_join(writer_tid, NULL);
+	if (map != NULL) {
+		munmap(map, ALOG_MAP_CHUNK);
+		map = NULL;
+		// cut off the unused end of the last chunk
+		ftruncate(out_fd, map_off + map_pos);
+		close(out_fd);
+	}
+	out_fd = -1;
+	free(batch);
+	batch = NULL;
+}
+
+/*
+ * Should the caller log the request it is on?  Counting per thread, one in
+ * every sample requests is; none are unless alog_open() has succeeded.
+ */
+int alog_sampled(void)
+{
+	return logging && (sample_every <= 1 || seen++ % sample_every == 0);
+}
+
+/*
+ * Log one entry, formatted as by printf, on a line of its own behind the
+ * wall clock time in milliseconds.  Never blocks: returns 0 once the entry
+ * is in this thread's ring, or -1 if it had to be dropped.
+ */
+int alog_printf(const char *fmt, ...)
+{
+	char entry[ALOG_ENTRY_MAX];
+	struct timespec ts;
+	alog_ring_t *r;
+	unsigned long head;
+	va_list ap;
+	size_t i, n;
+	int m;
+
+	if (!logging || (r = local()) == NULL)
+		return -1;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	n = snprintf(entry, sizeof(entry), "%ld.%03ld ", (long)ts.tv_sec,
+			ts.tv_nsec / 1000000);
+	va_start(ap, fmt);
+	m = vsnprintf(entry + n, sizeof(entry) - n - 1, fmt, ap);
+	va_end(ap);
+	if (m < 0)
+		return -1;
+	n += m;
+	if (n > sizeof(entry) - 2)
+		n = sizeof(entry) - 2;
+	entry[n++] = '\n';
+
+	head = r->head;
+	if (n > ALOG_RING_SIZE - (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))) {
+		__atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	i = head & (ALOG_RING_SIZE - 1);
+	if (n <= ALOG_RING_SIZE - i) {
+		memcpy(r->buf + i, entry, n);
+	} else {
+		memcpy(r->buf + i, entry, ALOG_RING_SIZE - i);
+		memcpy(r->buf, entry + ALOG_RING_SIZE - i, n - (ALOG_RING_SIZE - i));
+	}
+	__atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Entries dropped so far, every thread's */
+unsigned long alog_dropped(void)
+{
+	unsigned long n = 0;
+	alog_ring_t *r;
+
+	pthread_mutex_lock(&rings_lock);
+	for (r = rings; r != NULL; r = r->next)
+		n += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&rings_lock);
+	return n;
+}
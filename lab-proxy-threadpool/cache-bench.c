@@ -0,0 +1,91 @@
+/*
+ * cache-bench.c - measure cache hit throughput as the number of threads
+ * grows.  Every thread repeatedly looks up (and releases) objects from a
+ * preloaded working set, so this exercises only the hit path that the
+ * proxy's workers share.
+ *
+ * usage: ./cache-bench [seconds-per-run]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "cache.h"
+
+#define NKEYS 256
+#define OBJ_SIZE 2048
+#define MAX_BENCH_THREADS 64
+
+cache_t cache;
+char keys[NKEYS][64];
+volatile int stop;
+
+struct bench_arg {
+	unsigned int seed;
+	unsigned long hits;
+};
+
+void *run_lookups(void *vargp) {
+	struct bench_arg *arg = (struct bench_arg *)vargp;
+	unsigned int seed = arg->seed;
+	unsigned long hits = 0;
+	cache_obj_t *obj;
+
+	while (!stop) {
+		obj = cache_lookup(&cache, keys[rand_r(&seed) % NKEYS]);
+		if (obj != NULL) {
+			hits++;
+			cache_release(&cache, obj);
+		}
+	}
+	arg->hits = hits;
+	return NULL;
+}
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+	static char data[OBJ_SIZE];
+	pthread_t tids[MAX_BENCH_THREADS];
+	struct bench_arg args[MAX_BENCH_THREADS];
+	double secs = argc > 1 ? atof(argv[1]) : 1.0;
+	double start, elapsed;
+	unsigned long total;
+	int i, nthreads;
+
+	cache_init(&cache);
+	memset(data, 'x', sizeof(data));
+	for (i = 0; i < NKEYS; i++) {
+		sprintf(keys[i], "localhost:8080/object-%d.html", i);
+		cache_insert(&cache, keys[i], data, sizeof(data), 0);
+	}
+
+	printf("%8s %16s %16s\n", "threads", "hits/sec", "hits/sec/thread");
+	for (nthreads = 1; nthreads <= MAX_BENCH_THREADS; nthreads *= 2) {
+		stop = 0;
+		for (i = 0; i < nthreads; i++) {
+			args[i].seed = i + 1;
+			pthread_create(&tids[i], NULL, run_lookups, &args[i]);
+		}
+		start = now();
+		struct timespec ts = { (time_t)secs, (long)((secs - (time_t)secs) * 1e9) };
+		nanosleep(&ts, NULL);
+		stop = 1;
+		total = 0;
+		for (i = 0; i < nthreads; i++) {
+			pthread_join(tids[i], NULL);
+			total += args[i].hits;
+		}
+		elapsed = now() - start;
+		printf("%8d %16.0f %16.0f\n", nthreads, total / elapsed,
+				total / elapsed / nthreads);
+	}
+
+	cache_deinit(&cache);
+	return 0;
+}
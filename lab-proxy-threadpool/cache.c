@@ -0,0 +1,522 @@
+#include "cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* cache_obj_t.region */
+#define REGION_ANY -1
+#define REGION_MAIN 0           /* LRU and CLOCK keep everything here */
+#define REGION_WINDOW 1
+#define REGION_DOOMED 2         /* main, but picked as an admission victim */
+
+/*
+ * FNV-1a; keys are short URLs, so this is plenty.  The flights, the
+ * origin pool, the resolver and the disk tier hash their keys with it too.
+ */
+unsigned int hash_key(const char *key)
+{
+	unsigned int h = HASH_SEED;
+	while (*key) {
+		h ^= (unsigned char)*key++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/*
+ * The shard comes from the high bits and the bucket from the low bits, so
+ * the two choices are independent.
+ */
+static cache_shard_t *shard_for(cache_t *cp, unsigned int h)
+{
+	return &cp->shards[(h >> 24) % CACHE_NSHARDS];
+}
+
+static void free_obj(cache_obj_t *obj)
+{
+	free(obj->key);
+	free(obj->data);
+	free(obj);
+}
+
+static void put_obj(cache_obj_t *obj)
+{
+	if (__atomic_sub_fetch(&obj->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+		free_obj(obj);
+}
+
+/* Add obj to its shard.  Caller holds the shard lock exclusively. */
+static void link_obj(cache_shard_t *sp, cache_obj_t *obj)
+{
+	obj->hnext = sp->buckets[obj->hash % CACHE_NBUCKETS];
+	sp->buckets[obj->hash % CACHE_NBUCKETS] = obj;
+	sp->size += obj->len;
+	sp->nobjs++;
+}
+
+/*
+ * Take obj out of its shard, leaving the cache's reference with the
+ * caller.  Caller holds the shard lock exclusively.
+ */
+static void unlink_obj(cache_shard_t *sp, cache_obj_t *obj)
+{
+	cache_obj_t **pp = &sp->buckets[obj->hash % CACHE_NBUCKETS];
+
+	while (*pp != obj)
+		pp = &(*pp)->hnext;
+	*pp = obj->hnext;
+	sp->size -= obj->len;
+	sp->nobjs--;
+	if (obj->region == REGION_WINDOW)
+		sp->window_size -= obj->len;
+	if (obj->qnext != NULL) {
+		if (sp->hand == obj)
+			sp->hand = obj->qnext != obj ? obj->qnext : NULL;
+		obj->qprev->qnext = obj->qnext;
+		obj->qnext->qprev = obj->qprev;
+	}
+}
+
+/* Unlink obj and put it on the list of objects to spill and release */
+static void evict(cache_shard_t *sp, cache_obj_t *obj, cache_obj_t **evicted)
+{
+	unlink_obj(sp, obj);
+	sp->evictions++;
+	obj->hnext = *evicted;
+	*evicted = obj;
+}
+
+/*
+ * Find the least recently used object in the shard, among those in region
+ * if it is not REGION_ANY.  Hits only stamp last_used, so the victim is
+ * found by a scan; that cost lands on the miss path, which has just paid
+ * for an origin fetch anyway.  Caller holds the shard lock exclusively.
+ */
+static cache_obj_t *lru_victim(cache_shard_t *sp, int region)
+{
+	cache_obj_t *obj, *victim = NULL;
+	unsigned long oldest = 0;
+	unsigned long t;
+	int b;
+
+	for (b = 0; b < CACHE_NBUCKETS; b++) {
+		for (obj = sp->buckets[b]; obj; obj = obj->hnext) {
+			if (region != REGION_ANY && obj->region != region)
+				continue;
+			t = __atomic_load_n(&obj->last_used, __ATOMIC_RELAXED);
+			if (victim == NULL || t < oldest) {
+				victim = obj;
+				oldest = t;
+			}
+		}
+	}
+	return victim;
+}
+
+static void stamp(cache_t *cp, cache_obj_t *obj)
+{
+	__atomic_store_n(&obj->last_used,
+			__atomic_add_fetch(&cp->clock, 1, __ATOMIC_RELAXED),
+			__ATOMIC_RELAXED);
+}
+
+/*
+ * Count-min sketch.  Each row picks its counter with a different odd
+ * multiplier, taking the top bits of the product.  Counters stop at 15,
+ * and every CACHE_SKETCH_SAMPLE additions all of them are halved.  The
+ * updates race with each other and with the halving, which only makes an
+ * estimate that was approximate to begin with a little more so.
+ */
+static const unsigned int sketch_seeds[CACHE_SKETCH_DEPTH] = {
+	0x9e3779b1u, 0x85ebca6bu, 0xc2b2ae35u, 0x27d4eb2fu
+};
+
+static unsigned char *sketch_counter(cache_t *cp, unsigned int h, int row)
+{
+	return &cp->sketch[row][(h * sketch_seeds[row]) >> (32 - CACHE_SKETCH_BITS)];
+}
+
+static void sketch_add(cache_t *cp, unsigned int h)
+{
+	unsigned char *c;
+	int row, i;
+
+	for (row = 0; row < CACHE_SKETCH_DEPTH; row++) {
+		c = sketch_counter(cp, h, row);
+		if (__atomic_load_n(c, __ATOMIC_RELAXED) < 15)
+			__atomic_add_fetch(c, 1, __ATOMIC_RELAXED);
+	}
+	if (__atomic_add_fetch(&cp->sketch_adds, 1, __ATOMIC_RELAXED) == CACHE_SKETCH_SAMPLE) {
+		for (row = 0; row < CACHE_SKETCH_DEPTH; row++) {
+			for (i = 0; i < CACHE_SKETCH_WIDTH; i++) {
+				c = &cp->sketch[row][i];
+				__atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) >> 1,
+						__ATOMIC_RELAXED);
+			}
+		}
+		__atomic_store_n(&cp->sketch_adds, 0, __ATOMIC_RELAXED);
+	}
+}
+
+static unsigned int sketch_freq(cache_t *cp, unsigned int h)
+{
+	unsigned int f, min = 15;
+	int row;
+
+	for (row = 0; row < CACHE_SKETCH_DEPTH; row++) {
+		f = __atomic_load_n(sketch_counter(cp, h, row), __ATOMIC_RELAXED);
+		if (f < min)
+			min = f;
+	}
+	return min;
+}
+
+/*
+ * Policies.  Each has a hook run on every lookup (obj is NULL on a miss)
+ * under the shard's read lock, so it may only touch obj with atomics, and
+ * one that places a new object in its shard under the write lock,
+ * evicting whatever it must to make room.  place returns 1 if the new
+ * object is still cached afterward.
+ */
+struct cache_policy {
+	const char *name;
+	void (*lookup)(cache_t *cp, unsigned int h, cache_obj_t *obj);
+	int (*place)(cache_t *cp, cache_shard_t *sp, cache_obj_t *obj,
+			cache_obj_t **evicted);
+};
+
+/* LRU: a hit restamps the object; the oldest stamp goes first */
+static void lru_lookup(cache_t *cp, unsigned int h, cache_obj_t *obj)
+{
+	if (obj)
+		stamp(cp, obj);
+}
+
+static int lru_place(cache_t *cp, cache_shard_t *sp, cache_obj_t *obj,
+		cache_obj_t **evicted)
+{
+	while (sp->size + obj->len > CACHE_SHARD_SIZE)
+		evict(sp, lru_victim(sp, REGION_ANY), evicted);
+	link_obj(sp, obj);
+	return 1;
+}
+
+/*
+ * CLOCK: a hit only sets obj->ref, so hits share no cache line but their
+ * own object's.  The hand sweeps the shard in insertion order, clearing
+ * ref bits, and evicts the first object it finds without one.
+ */
+static void clock_lookup(cache_t *cp, unsigned int h, cache_obj_t *obj)
+{
+	if (obj && !__atomic_load_n(&obj->ref, __ATOMIC_RELAXED))
+		__atomic_store_n(&obj->ref, 1, __ATOMIC_RELAXED);
+}
+
+static int clock_place(cache_t *cp, cache_shard_t *sp, cache_obj_t *obj,
+		cache_obj_t **evicted)
+{
+	cache_obj_t *victim;
+
+	while (sp->size + obj->len > CACHE_SHARD_SIZE) {
+		victim = sp->hand;
+		sp->hand = victim->qnext;
+		if (victim->ref)
+			victim->ref = 0;
+		else
+			evict(sp, victim, evicted);
+	}
+	link_obj(sp, obj);
+
+	// just behind the hand, so it is looked at last
+	if (sp->hand == NULL) {
+		obj->qprev = obj->qnext = obj;
+		sp->hand = obj;
+	} else {
+		obj->qnext = sp->hand;
+		obj->qprev = sp->hand->qprev;
+		obj->qprev->qnext = obj;
+		sp->hand->qprev = obj;
+	}
+	return 1;
+}
+
+/*
+ * W-TinyLFU: every request, hit or miss, is counted in the sketch.  New
+ * objects enter the window; what the window pushes out may only displace
+ * main-region objects, least recently used first, that have been
+ * requested less often than it has.  A large object must outscore every
+ * object it would push out, so one popular small object is not traded
+ * for a big one-hit wonder.  Whichever side loses is evicted.
+ */
+static void tinylfu_lookup(cache_t *cp, unsigned int h, cache_obj_t *obj)
+{
+	sketch_add(cp, h);
+	if (obj)
+		stamp(cp, obj);
+}
+
+/*
+ * Can cand be admitted to the main region?  Either way, the victims it
+ * weighed itself against are marked REGION_DOOMED, so the scan for the
+ * next one skips them, and left on *doomed through dnext for the caller
+ * to evict or put back.  Caller holds the shard lock exclusively.
+ */
+static int tinylfu_admit(cache_t *cp, cache_shard_t *sp, cache_obj_t *cand,
+		cache_obj_t **doomed)
+{
+	size_t room = CACHE_MAIN_SIZE - (sp->size - sp->window_size);
+	unsigned int f = sketch_freq(cp, cand->hash);
+	cache_obj_t *victim;
+
+	*doomed = NULL;
+	while (room < cand->len) {
+		victim = lru_victim(sp, REGION_MAIN);
+		if (victim == NULL || sketch_freq(cp, victim->hash) >= f)
+			return 0;
+		victim->region = REGION_DOOMED;
+		victim->dnext = *doomed;
+		*doomed = victim;
+		room += victim->len;
+	}
+	return 1;
+}
+
+static int tinylfu_place(cache_t *cp, cache_shard_t *sp, cache_obj_t *obj,
+		cache_obj_t **evicted)
+{
+	cache_obj_t *cand, *doomed, *next;
+	int admitted;
+
+	obj->region = REGION_WINDOW;
+	link_obj(sp, obj);
+	sp->window_size += obj->len;
+
+	while (sp->window_size > CACHE_WINDOW_SIZE) {
+		// one larger than the window would only flush it, and then be
+		// judged anyway, so it is judged first
+		if (obj->region == REGION_WINDOW && obj->len > CACHE_WINDOW_SIZE)
+			cand = obj;
+		else
+			cand = lru_victim(sp, REGION_WINDOW);
+		admitted = tinylfu_admit(cp, sp, cand, &doomed);
+		for (; doomed != NULL; doomed = next) {
+			next = doomed->dnext;
+			if (admitted)
+				evict(sp, doomed, evicted);
+			else
+				doomed->region = REGION_MAIN;
+		}
+		if (admitted) {
+			cand->region = REGION_MAIN;
+			sp->window_size -= cand->len;
+		} else {
+			evict(sp, cand, evicted);
+			if (cand == obj)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+static const struct cache_policy policies[CACHE_NPOLICIES] = {
+	[CACHE_LRU] = { "lru", lru_lookup, lru_place },
+	[CACHE_CLOCK] = { "clock", clock_lookup, clock_place },
+	[CACHE_TINYLFU] = { "tinylfu", tinylfu_lookup, tinylfu_place },
+};
+
+/* Create an empty cache, using LRU */
+void cache_init(cache_t *cp)
+{
+	int i;
+
+	for (i = 0; i < CACHE_NSHARDS; i++) {
+		memset(cp->shards[i].buckets, 0, sizeof(cp->shards[i].buckets));
+		cp->shards[i].size = 0;
+		cp->shards[i].window_size = 0;
+		cp->shards[i].nobjs = 0;
+		cp->shards[i].evictions = 0;
+		cp->shards[i].hand = NULL;
+		pthread_rwlock_init(&cp->shards[i].lock, NULL);
+	}
+	cp->clock = 0;
+	cp->policy = CACHE_LRU;
+	cp->spill = NULL;
+	cp->spill_arg = NULL;
+	memset(cp->sketch, 0, sizeof(cp->sketch));
+	cp->sketch_adds = 0;
+}
+
+/* Free every cached object */
+void cache_deinit(cache_t *cp)
+{
+	cache_shard_t *sp;
+	cache_obj_t *obj;
+	int i, b;
+
+	for (i = 0; i < CACHE_NSHARDS; i++) {
+		sp = &cp->shards[i];
+		for (b = 0; b < CACHE_NBUCKETS; b++) {
+			while ((obj = sp->buckets[b]) != NULL) {
+				unlink_obj(sp, obj);
+				put_obj(obj);
+			}
+		}
+		pthread_rwlock_destroy(&sp->lock);
+	}
+}
+
+/* Choose the replacement policy.  Call while the cache is still empty. */
+void cache_set_policy(cache_t *cp, cache_policy_t policy)
+{
+	cp->policy = policy;
+}
+
+/*
+ * Have fn called with every object evicted to make room for another, so a
+ * second tier can keep it.  Objects replaced by a newer copy of the same
+ * key, or dropped by cache_deinit(), are not passed on.  Call before the
+ * cache is shared.
+ */
+void cache_set_spill(cache_t *cp, cache_spill_fn fn, void *arg)
+{
+	cp->spill = fn;
+	cp->spill_arg = arg;
+}
+
+/* Return the policy called name ("lru", "clock" or "tinylfu"), or -1 */
+int cache_policy_parse(const char *name)
+{
+	int i;
+
+	for (i = 0; i < CACHE_NPOLICIES; i++) {
+		if (strcmp(policies[i].name, name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+const char *cache_policy_name(cache_policy_t policy)
+{
+	return policies[policy].name;
+}
+
+/*
+ * Look up key.  On a hit the object is returned with a reference held, so
+ * it stays valid (even if evicted) until the caller hands it back with
+ * cache_release().  Returns NULL on a miss.  Only the shard's read lock is
+ * taken, so concurrent hits do not serialize; the policy notes the lookup
+ * with atomics.
+ */
+cache_obj_t *cache_lookup(cache_t *cp, const char *key)
+{
+	unsigned int h = hash_key(key);
+	cache_shard_t *sp = shard_for(cp, h);
+	cache_obj_t *obj;
+
+	pthread_rwlock_rdlock(&sp->lock);
+	obj = sp->buckets[h % CACHE_NBUCKETS];
+	while (obj && strcmp(obj->key, key) != 0)
+		obj = obj->hnext;
+	if (obj)
+		__atomic_add_fetch(&obj->refcnt, 1, __ATOMIC_RELAXED);
+	policies[cp->policy].lookup(cp, h, obj);
+	pthread_rwlock_unlock(&sp->lock);
+	return obj;
+}
+
+/* Drop the reference returned by cache_lookup() */
+void cache_release(cache_t *cp, cache_obj_t *obj)
+{
+	put_obj(obj);
+}
+
+/*
+ * Copy len bytes of data into the cache under key, to stay fresh until
+ * expires, evicting objects from the key's shard, as the policy chooses,
+ * until it fits.  Objects larger
+ * than MAX_OBJECT_SIZE are not cached.  The evicted objects are spilled
+ * once the shard is unlocked, so a slow spill never blocks its readers.
+ * Returns 1 if the object was inserted, 0 otherwise (including when
+ * TinyLFU turns it away).
+ */
+int cache_insert(cache_t *cp, const char *key, const char *data, size_t len,
+		time_t expires)
+{
+	unsigned int h = hash_key(key);
+	cache_shard_t *sp = shard_for(cp, h);
+	cache_obj_t *obj, *victim, *evicted = NULL;
+	int placed;
+
+	if (len > MAX_OBJECT_SIZE || len > CACHE_SHARD_SIZE)
+		return 0;
+
+	if ((obj = calloc(1, sizeof(cache_obj_t))) == NULL)
+		return 0;
+	obj->key = strdup(key);
+	obj->data = malloc(len);
+	if (obj->key == NULL || obj->data == NULL) {
+		free_obj(obj);
+		return 0;
+	}
+	memcpy(obj->data, data, len);
+	obj->len = len;
+	obj->hash = h;
+	obj->expires = expires;
+	obj->refcnt = 1;
+	obj->last_used = __atomic_add_fetch(&cp->clock, 1, __ATOMIC_RELAXED);
+
+	pthread_rwlock_wrlock(&sp->lock);
+
+	/* Another thread may have fetched the same object concurrently */
+	for (victim = sp->buckets[h % CACHE_NBUCKETS]; victim; victim = victim->hnext) {
+		if (strcmp(victim->key, key) == 0) {
+			unlink_obj(sp, victim);
+			put_obj(victim);
+			break;
+		}
+	}
+
+	placed = policies[cp->policy].place(cp, sp, obj, &evicted);
+	pthread_rwlock_unlock(&sp->lock);
+
+	while ((victim = evicted) != NULL) {
+		evicted = victim->hnext;
+		if (cp->spill)
+			cp->spill(cp->spill_arg, victim->key, victim->data, victim->len);
+		put_obj(victim);
+	}
+	return placed;
+}
+
+/* Can obj, returned by cache_lookup(), still be served without asking the origin? */
+int cache_is_fresh(cache_obj_t *obj, time_t now)
+{
+	time_t expires = __atomic_load_n(&obj->expires, __ATOMIC_RELAXED);
+
+	return expires == 0 || now < expires;
+}
+
+/*
+ * Make obj, returned by cache_lookup(), fresh until expires: the origin has
+ * confirmed that it is still current.
+ */
+void cache_refresh(cache_t *cp, cache_obj_t *obj, time_t expires)
+{
+	__atomic_store_n(&obj->expires, expires, __ATOMIC_RELAXED);
+}
+
+/* Add up how much the cache holds and how much it has evicted */
+void cache_stats(cache_t *cp, cache_stats_t *st)
+{
+	cache_shard_t *sp;
+	int i;
+
+	memset(st, 0, sizeof(*st));
+	for (i = 0; i < CACHE_NSHARDS; i++) {
+		sp = &cp->shards[i];
+		pthread_rwlock_rdlock(&sp->lock);
+		st->objects += sp->nobjs;
+		st->bytes += sp->size;
+		st->evictions += sp->evictions;
+		pthread_rwlock_unlock(&sp->lock);
+	}
+}
@@ -0,0 +1,107 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+
+/* Recommended max cache and object sizes */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+
+/*
+ * The cache is split into CACHE_NSHARDS independently locked segments,
+ * each holding at most MAX_CACHE_SIZE / CACHE_NSHARDS bytes.  Keep that
+ * quotient at or above MAX_OBJECT_SIZE so every cacheable object fits.
+ */
+#define CACHE_NSHARDS 8
+#define CACHE_SHARD_SIZE (MAX_CACHE_SIZE / CACHE_NSHARDS)
+#define CACHE_NBUCKETS 64
+
+/*
+ * Under CACHE_TINYLFU each shard keeps 1% of its bytes as an LRU window
+ * that admits everything; the rest is the main region, which an object
+ * only enters by being requested more often than what it would replace.
+ * An object larger than the whole window goes straight to that test.
+ * Request counts come from a count-min sketch of 4-bit counters, halved
+ * every CACHE_SKETCH_SAMPLE requests so old popularity fades.
+ */
+#define CACHE_WINDOW_SIZE (CACHE_SHARD_SIZE / 100)
+#define CACHE_MAIN_SIZE (CACHE_SHARD_SIZE - CACHE_WINDOW_SIZE)
+#define CACHE_SKETCH_DEPTH 4
+#define CACHE_SKETCH_BITS 12
+#define CACHE_SKETCH_WIDTH (1 << CACHE_SKETCH_BITS)
+#define CACHE_SKETCH_SAMPLE (10 * CACHE_SKETCH_WIDTH)
+
+/* FNV-1a's offset basis, where hash_key() starts */
+#define HASH_SEED 2166136261u
+
+/* Replacement policies; see cache.c */
+typedef enum {
+	CACHE_LRU,                  /* evict the least recently used */
+	CACHE_CLOCK,                /* second chance: a hit only sets a bit */
+	CACHE_TINYLFU,              /* W-TinyLFU: LRU window, frequency-gated main */
+	CACHE_NPOLICIES
+} cache_policy_t;
+
+typedef struct cache_obj {
+	char *key;                  /* "host:port/path" of the request */
+	char *data;                 /* Complete response, headers and body */
+	size_t len;                 /* Number of bytes in data */
+	unsigned int hash;          /* hash of key */
+	time_t expires;             /* When it goes stale; 0 for never */
+	unsigned long last_used;    /* Cache clock at the most recent hit */
+	unsigned char ref;          /* CLOCK: hit since the hand last passed */
+	unsigned char region;       /* TINYLFU: window or main */
+	int refcnt;                 /* One for the cache, plus one per reader */
+	struct cache_obj *hnext;    /* Next object in the same hash bucket */
+	struct cache_obj *qprev, *qnext;  /* CLOCK: ring in insertion order */
+	struct cache_obj *dnext;    /* TINYLFU: next victim of the same admission */
+} cache_obj_t;
+
+typedef struct {
+	cache_obj_t *buckets[CACHE_NBUCKETS];
+	size_t size;                /* Sum of len over objects in this shard */
+	size_t window_size;         /* TINYLFU: the part of size in the window */
+	unsigned long nobjs;        /* Objects in this shard */
+	unsigned long evictions;    /* Objects evicted to make room */
+	cache_obj_t *hand;          /* CLOCK: next object the hand looks at */
+	pthread_rwlock_t lock;      /* Shared for lookups, exclusive for changes */
+} cache_shard_t;
+
+/* Called with each object evicted to make room, after its shard is unlocked */
+typedef void (*cache_spill_fn)(void *arg, const char *key, const char *data, size_t len);
+
+/* Totals over every shard, from cache_stats() */
+typedef struct {
+	unsigned long objects;
+	size_t bytes;
+	unsigned long evictions;
+} cache_stats_t;
+
+typedef struct {
+	cache_shard_t shards[CACHE_NSHARDS];
+	unsigned long clock;        /* Bumped atomically on every hit */
+	cache_policy_t policy;      /* CACHE_LRU unless set with cache_set_policy() */
+	cache_spill_fn spill;       /* NULL unless set with cache_set_spill() */
+	void *spill_arg;
+	unsigned char sketch[CACHE_SKETCH_DEPTH][CACHE_SKETCH_WIDTH];
+	unsigned long sketch_adds;  /* Requests counted since the last halving */
+} cache_t;
+
+unsigned int hash_key(const char *key);
+void cache_init(cache_t *cp);
+void cache_deinit(cache_t *cp);
+void cache_set_policy(cache_t *cp, cache_policy_t policy);
+void cache_set_spill(cache_t *cp, cache_spill_fn fn, void *arg);
+int cache_policy_parse(const char *name);
+const char *cache_policy_name(cache_policy_t policy);
+cache_obj_t *cache_lookup(cache_t *cp, const char *key);
+void cache_release(cache_t *cp, cache_obj_t *obj);
+int cache_insert(cache_t *cp, const char *key, const char *data, size_t len,
+		time_t expires);
+int cache_is_fresh(cache_obj_t *obj, time_t now);
+void cache_refresh(cache_t *cp, cache_obj_t *obj, time_t expires);
+void cache_stats(cache_t *cp, cache_stats_t *st);
+
+#endif /* __CACHE_H__ */
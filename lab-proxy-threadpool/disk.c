@@ -0,0 +1,475 @@
+#include "disk.h"
+#include "cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Second cache tier on disk.  Objects the memory cache evicts are appended
+ * to the newest of a series of fixed-size segment files, which are mapped
+ * in full, so a hit is served straight from the page cache, the way tiny's
+ * serve_static() serves a file.  Segments are never rewritten: when there
+ * are more than DISK_MAX_SEGMENTS the oldest is deleted along with
+ * whatever it still held, which makes eviction FIFO by spill time.
+ *
+ * Next to each seg-<id>.dat is a seg-<id>.idx with one fixed-size entry
+ * per record, appended only once the record is in place.  At startup the
+ * in-memory index is rebuilt from those alone--a few bytes per object--
+ * and each entry is checked against its record's header, so warm start
+ * does not read the cached data, and a record whose entry never made it
+ * out is simply not found.  The header also holds a checksum of the key
+ * and data, checked the first time a lookup finds the record after a
+ * restart, so one whose data did not make it out is dropped then.
+ */
+
+#define DISK_MAGIC 0x70726f79u      /* "proy"; "prox" records had no checksum */
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+/* At the start of every record, followed by the key and then the data */
+struct rec_hdr {
+	uint32_t magic;
+	uint32_t hash;
+	uint32_t keylen;
+	uint32_t len;
+	uint32_t sum;               /* rec_sum() of the key and then the data */
+};
+
+/* One per record in the .idx file */
+struct idx_ent {
+	uint32_t off;
+	uint32_t hash;
+	uint32_t keylen;
+	uint32_t len;
+};
+
+/* FNV-1a again, continued over n more bytes from h */
+static uint32_t rec_sum(uint32_t h, const char *p, size_t n)
+{
+	while (n-- > 0) {
+		h ^= (unsigned char)*p++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static size_t rec_size(size_t keylen, size_t len)
+{
+	return ALIGN8(sizeof(struct rec_hdr) + keylen + len);
+}
+
+static const char *rec_key(const disk_ent_t *e)
+{
+	return e->seg->map + e->off + sizeof(struct rec_hdr);
+}
+
+static void seg_path(disk_t *dp, unsigned int id, const char *ext, char *path, size_t size)
+{
+	snprintf(path, size, "%s/seg-%06u.%s", dp->dir, id, ext);
+}
+
+/*
+ * Open segment id, creating its files if create is set, and map it.  The
+ * data file's blocks are allocated up front: a store through the mapping
+ * into a hole on a full disk would be a SIGBUS rather than an error.
+ */
+static disk_seg_t *seg_open(disk_t *dp, unsigned int id, int create)
+{
+	char path[4096];
+	struct stat st;
+	disk_seg_t *s;
+	int fd;
+
+	if ((s = calloc(1, sizeof(disk_seg_t))) == NULL)
+		return NULL;
+	s->id = id;
+	s->refcnt = 1;
+
+	seg_path(dp, id, "dat", path, sizeof(path));
+	if ((fd = open(path, O_RDWR | (create ? O_CREAT | O_TRUNC : 0), 0644)) < 0)
+		goto fail;
+	if (fstat(fd, &st) < 0 || (!create && st.st_size != DISK_SEGMENT_SIZE) ||
+			posix_fallocate(fd, 0, DISK_SEGMENT_SIZE) != 0) {
+		close(fd);
+		goto fail;
+	}
+	s->map = mmap(NULL, DISK_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (s->map == MAP_FAILED)
+		goto fail;
+
+	seg_path(dp, id, "idx", path, sizeof(path));
+	s->idxfd = open(path, O_RDWR | O_APPEND | (create ? O_CREAT | O_TRUNC : 0), 0644);
+	if (s->idxfd < 0) {
+		munmap(s->map, DISK_SEGMENT_SIZE);
+		goto fail;
+	}
+	return s;
+
+fail:
+	free(s);
+	return NULL;
+}
+
+static void seg_get(disk_seg_t *s)
+{
+	__atomic_add_fetch(&s->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+static void seg_put(disk_seg_t *s)
+{
+	if (__atomic_sub_fetch(&s->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+		munmap(s->map, DISK_SEGMENT_SIZE);
+		close(s->idxfd);
+		free(s);
+	}
+}
+
+/* Find the entry for key, or NULL.  Caller holds lock. */
+static disk_ent_t *find_ent(disk_t *dp, uint32_t h, const char *key, size_t keylen)
+{
+	disk_ent_t *e;
+
+	for (e = dp->buckets[h % DISK_NBUCKETS]; e; e = e->next) {
+		if (e->hash == h && e->keylen == keylen &&
+				memcmp(rec_key(e), key, keylen) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+/*
+ * Point the index at the record at off in s, replacing any older copy of
+ * the same key, and return its entry, not yet verified; NULL if memory
+ * runs out.  Caller holds lock.
+ */
+static disk_ent_t *index_add(disk_t *dp, disk_seg_t *s, const struct idx_ent *ie)
+{
+	const char *key = s->map + ie->off + sizeof(struct rec_hdr);
+	disk_ent_t *e;
+
+	if ((e = find_ent(dp, ie->hash, key, ie->keylen)) == NULL) {
+		if ((e = malloc(sizeof(disk_ent_t))) == NULL)
+			return NULL;
+		e->next = dp->buckets[ie->hash % DISK_NBUCKETS];
+		dp->buckets[ie->hash % DISK_NBUCKETS] = e;
+	}
+	e->seg = s;
+	e->hash = ie->hash;
+	e->off = ie->off;
+	e->keylen = ie->keylen;
+	e->len = ie->len;
+	e->verified = 0;
+	return e;
+}
+
+/* Take e out of the index and free it.  Caller holds lock. */
+static void index_del(disk_t *dp, disk_ent_t *e)
+{
+	disk_ent_t **pp = &dp->buckets[e->hash % DISK_NBUCKETS];
+
+	while (*pp != e)
+		pp = &(*pp)->next;
+	*pp = e->next;
+	free(e);
+}
+
+/*
+ * The segment's .idx file could not be cut back to its last whole entry,
+ * so nothing more is appended to it, and no more records go in the
+ * segment; the next insert starts a new one.  Caller holds lock, or has
+ * the segment to itself.
+ */
+static void idx_torn(disk_seg_t *s)
+{
+	s->idx_len = -1;
+	s->tail = DISK_SEGMENT_SIZE;
+}
+
+/*
+ * Rebuild the index entries for a segment found at startup, and put its
+ * tail after the last record that checks out.  A torn entry at the end of
+ * the .idx file is cut off so later appends stay aligned.
+ */
+static void seg_load(disk_t *dp, disk_seg_t *s)
+{
+	struct idx_ent ie;
+	const struct rec_hdr *rh;
+	off_t n = 0;
+
+	while (pread(s->idxfd, &ie, sizeof(ie), n) == sizeof(ie)) {
+		n += sizeof(ie);
+		// in size_t, so an offset past the end cannot wrap the check
+		if (ie.off % 8 != 0 ||
+				(size_t)ie.off + rec_size(ie.keylen, ie.len) > DISK_SEGMENT_SIZE)
+			continue;
+		rh = (const struct rec_hdr *)(s->map + ie.off);
+		if (rh->magic != DISK_MAGIC || rh->hash != ie.hash ||
+				rh->keylen != ie.keylen || rh->len != ie.len)
+			continue;
+		index_add(dp, s, &ie);
+		if (ie.off + rec_size(ie.keylen, ie.len) > s->tail)
+			s->tail = ie.off + rec_size(ie.keylen, ie.len);
+	}
+	s->idx_len = n;
+	if (ftruncate(s->idxfd, n) < 0)
+		idx_torn(s);
+}
+
+static void seg_link(disk_t *dp, disk_seg_t *s)
+{
+	if (dp->newest)
+		dp->newest->next = s;
+	else
+		dp->oldest = s;
+	dp->newest = s;
+	dp->nsegs++;
+}
+
+/* Delete the oldest segment and everything indexed in it.  Caller holds lock. */
+static void drop_oldest(disk_t *dp)
+{
+	disk_seg_t *s = dp->oldest;
+	disk_ent_t **pp, *e;
+	char path[4096];
+	int b;
+
+	for (b = 0; b < DISK_NBUCKETS; b++) {
+		pp = &dp->buckets[b];
+		while ((e = *pp) != NULL) {
+			if (e->seg == s) {
+				*pp = e->next;
+				free(e);
+			} else {
+				pp = &e->next;
+			}
+		}
+	}
+	seg_path(dp, s->id, "dat", path, sizeof(path));
+	unlink(path);
+	seg_path(dp, s->id, "idx", path, sizeof(path));
+	unlink(path);
+
+	dp->oldest = s->next;
+	if (dp->oldest == NULL)
+		dp->newest = NULL;
+	dp->nsegs--;
+	s->dropped = 1;
+	seg_put(s);
+}
+
+static int cmp_uint(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Open the disk tier in dir, creating dir if need be, and index whatever
+ * segments an earlier run left there, oldest first so the newest copy of
+ * a key wins.  The newest segment is appended to if it has room.
+ * Returns 0, or -1 if dir cannot be used.
+ */
+int disk_init(disk_t *dp, const char *dir)
+{
+	DIR *d;
+	struct dirent *de;
+	unsigned int *ids = NULL, *tmp, id;
+	int nids = 0, i, end;
+	disk_seg_t *s;
+
+	memset(dp, 0, sizeof(disk_t));
+	pthread_mutex_init(&dp->lock, NULL);
+	if ((dp->dir = strdup(dir)) == NULL)
+		return -1;
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+		return -1;
+	if ((d = opendir(dir)) == NULL)
+		return -1;
+	while ((de = readdir(d)) != NULL) {
+		end = 0;
+		if (sscanf(de->d_name, "seg-%u.idx%n", &id, &end) != 1 ||
+				de->d_name[end] != '\0' || end == 0)
+			continue;
+		if ((tmp = realloc(ids, (nids + 1) * sizeof(*ids))) == NULL)
+			break;
+		ids = tmp;
+		ids[nids++] = id;
+	}
+	closedir(d);
+
+	qsort(ids, nids, sizeof(*ids), cmp_uint);
+	for (i = 0; i < nids; i++) {
+		if ((s = seg_open(dp, ids[i], 0)) == NULL)
+			continue;
+		seg_load(dp, s);
+		seg_link(dp, s);
+	}
+	free(ids);
+	while (dp->nsegs > DISK_MAX_SEGMENTS)
+		drop_oldest(dp);
+
+	if (dp->newest == NULL) {
+		if ((s = seg_open(dp, 0, 1)) == NULL)
+			return -1;
+		seg_link(dp, s);
+	}
+	return 0;
+}
+
+/* Unmap every segment, leaving the files for the next run */
+void disk_deinit(disk_t *dp)
+{
+	disk_seg_t *s;
+	disk_ent_t *e;
+	int b;
+
+	for (b = 0; b < DISK_NBUCKETS; b++) {
+		while ((e = dp->buckets[b]) != NULL) {
+			dp->buckets[b] = e->next;
+			free(e);
+		}
+	}
+	while ((s = dp->oldest) != NULL) {
+		dp->oldest = s->next;
+		seg_put(s);
+	}
+	free(dp->dir);
+	pthread_mutex_destroy(&dp->lock);
+}
+
+/*
+ * Look up key.  On a hit, fill in obj and return 1; obj->data stays valid,
+ * even if its segment is dropped, until it is handed back with
+ * disk_release().  Returns 0 on a miss.  A record from an earlier run is
+ * checked against its checksum, outside the lock, the first time it is
+ * found, and dropped if it fails.
+ */
+int disk_lookup(disk_t *dp, const char *key, disk_obj_t *obj)
+{
+	uint32_t h = hash_key(key);
+	size_t keylen = strlen(key);
+	const struct rec_hdr *rh;
+	disk_ent_t *e;
+	uint32_t off;
+	int ok;
+
+	pthread_mutex_lock(&dp->lock);
+	if ((e = find_ent(dp, h, key, keylen)) == NULL) {
+		pthread_mutex_unlock(&dp->lock);
+		return 0;
+	}
+	seg_get(e->seg);
+	obj->seg = e->seg;
+	obj->data = rec_key(e) + e->keylen;
+	obj->len = e->len;
+	if (e->verified) {
+		pthread_mutex_unlock(&dp->lock);
+		return 1;
+	}
+	off = e->off;
+	pthread_mutex_unlock(&dp->lock);
+
+	rh = (const struct rec_hdr *)(obj->seg->map + off);
+	ok = rh->sum == rec_sum(HASH_SEED, obj->data - keylen, keylen + obj->len);
+	pthread_mutex_lock(&dp->lock);
+	// the entry may have moved on to a newer copy meanwhile
+	if ((e = find_ent(dp, h, key, keylen)) != NULL && e->seg == obj->seg &&
+			e->off == off) {
+		if (ok)
+			e->verified = 1;
+		else
+			index_del(dp, e);
+	}
+	pthread_mutex_unlock(&dp->lock);
+	if (!ok)
+		disk_release(dp, obj);
+	return ok;
+}
+
+/* Drop the reference taken by disk_lookup() */
+void disk_release(disk_t *dp, disk_obj_t *obj)
+{
+	seg_put(obj->seg);
+}
+
+/*
+ * Append a copy of len bytes of data under key, starting a new segment
+ * (and dropping the oldest, past DISK_MAX_SEGMENTS) if the current one is
+ * full.  The copy into the mapping is made outside the lock; the record
+ * is only indexed once it is complete.  An object the tier already holds
+ * byte for byte--one promoted back to memory and now evicted again--is
+ * not written twice.  Returns 1 if the object is on disk, 0 otherwise.
+ */
+int disk_insert(disk_t *dp, const char *key, const char *data, size_t len)
+{
+	size_t keylen = strlen(key);
+	size_t rs = rec_size(keylen, len);
+	struct rec_hdr rh;
+	struct idx_ent ie;
+	disk_obj_t old;
+	disk_ent_t *e;
+	disk_seg_t *s;
+	int same, ok;
+
+	if (rs > DISK_SEGMENT_SIZE)
+		return 0;
+	if (disk_lookup(dp, key, &old)) {
+		same = old.len == len && memcmp(old.data, data, len) == 0;
+		disk_release(dp, &old);
+		if (same)
+			return 1;
+	}
+
+	rh.magic = DISK_MAGIC;
+	rh.hash = hash_key(key);
+	rh.keylen = keylen;
+	rh.len = len;
+	rh.sum = rec_sum(rec_sum(HASH_SEED, key, keylen), data, len);
+
+	pthread_mutex_lock(&dp->lock);
+	s = dp->newest;
+	if (s->tail + rs > DISK_SEGMENT_SIZE) {
+		if ((s = seg_open(dp, dp->newest->id + 1, 1)) == NULL) {
+			pthread_mutex_unlock(&dp->lock);
+			return 0;
+		}
+		seg_link(dp, s);
+		while (dp->nsegs > DISK_MAX_SEGMENTS)
+			drop_oldest(dp);
+	}
+	ie.off = s->tail;
+	s->tail += rs;
+	seg_get(s);
+	pthread_mutex_unlock(&dp->lock);
+
+	memcpy(s->map + ie.off, &rh, sizeof(rh));
+	memcpy(s->map + ie.off + sizeof(rh), key, keylen);
+	memcpy(s->map + ie.off + sizeof(rh) + keylen, data, len);
+
+	ie.hash = rh.hash;
+	ie.keylen = rh.keylen;
+	ie.len = rh.len;
+	pthread_mutex_lock(&dp->lock);
+	// the segment may have been dropped while the copy was being made
+	if ((ok = !s->dropped)) {
+		if ((e = index_add(dp, s, &ie)) != NULL)
+			e->verified = 1;
+		// a short write is cut back off so later entries stay whole;
+		// the record is still served this run, just not after a restart
+		if (s->idx_len >= 0) {
+			if (write(s->idxfd, &ie, sizeof(ie)) == sizeof(ie))
+				s->idx_len += sizeof(ie);
+			else if (ftruncate(s->idxfd, s->idx_len) < 0)
+				idx_torn(s);
+		}
+	}
+	pthread_mutex_unlock(&dp->lock);
+	seg_put(s);
+	return ok;
+}
@@ -0,0 +1,57 @@
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define DISK_SEGMENT_SIZE (16 << 20)  /* bytes in each segment file */
+#define DISK_MAX_SEGMENTS 64          /* oldest segment is dropped past this */
+#define DISK_NBUCKETS 4096
+
+/* One segment: a data file mapped in full, and its index file */
+typedef struct disk_seg {
+	unsigned int id;            /* seg-<id>.dat and seg-<id>.idx */
+	char *map;                  /* DISK_SEGMENT_SIZE bytes, MAP_SHARED */
+	size_t tail;                /* Offset where the next record goes */
+	int idxfd;                  /* Index file, opened for appending */
+	off_t idx_len;              /* Bytes of whole entries in it; -1 once it is torn */
+	int refcnt;                 /* One while listed, plus one per user */
+	int dropped;                /* Set once deleted; no more records go in */
+	struct disk_seg *next;      /* Next newer segment */
+} disk_seg_t;
+
+/* Where the newest copy of a key lives */
+typedef struct disk_ent {
+	disk_seg_t *seg;
+	uint32_t hash;
+	uint32_t off;               /* Record offset in seg->map */
+	uint32_t keylen;
+	uint32_t len;
+	int verified;               /* Record's checksum has been checked */
+	struct disk_ent *next;      /* Next entry in the same hash bucket */
+} disk_ent_t;
+
+typedef struct {
+	char *dir;
+	disk_seg_t *oldest, *newest;  /* Records are appended to newest */
+	int nsegs;
+	disk_ent_t *buckets[DISK_NBUCKETS];
+	pthread_mutex_t lock;
+} disk_t;
+
+/* An object found by disk_lookup(); data points into the segment's mapping */
+typedef struct {
+	const char *data;
+	size_t len;
+	disk_seg_t *seg;
+} disk_obj_t;
+
+int disk_init(disk_t *dp, const char *dir);
+void disk_deinit(disk_t *dp);
+int disk_lookup(disk_t *dp, const char *key, disk_obj_t *obj);
+void disk_release(disk_t *dp, disk_obj_t *obj);
+int disk_insert(disk_t *dp, const char *key, const char *data, size_t len);
+
+#endif /* __DISK_H__ */
@@ -0,0 +1,103 @@
+#include "flight.h"
+#include "cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Single-flight for cache misses.  The first request to miss on a key
+ * becomes its leader and fetches from the origin; requests that miss on
+ * the same key while that fetch is running join it as waiters instead of
+ * fetching too.  When the leader has put the response in the cache, or
+ * has found it cannot (too large, origin error, client gone), it finishes
+ * the flight and the waiters look in the cache again, fetching for
+ * themselves only if the object is not there.  So a burst of identical
+ * requests for a cold, cacheable URL costs the origin one request.
+ */
+
+void flights_init(flights_t *fp)
+{
+	memset(fp->buckets, 0, sizeof(fp->buckets));
+	pthread_mutex_init(&fp->lock, NULL);
+}
+
+/*
+ * Join the flight for key, starting one if none is running.  Sets *leader
+ * to 1 if the caller started it and must fetch and then flight_finish(),
+ * or to 0 if it should flight_wait().  Either way the caller holds a
+ * reference to hand back with flight_release().  Returns NULL, with
+ * *leader set, if memory runs out; the caller then fetches on its own.
+ */
+flight_t *flight_join(flights_t *fp, const char *key, int *leader)
+{
+	unsigned int b = hash_key(key) % FLIGHT_NBUCKETS;
+	flight_t *f;
+
+	pthread_mutex_lock(&fp->lock);
+	for (f = fp->buckets[b]; f; f = f->next) {
+		if (strcmp(f->key, key) == 0) {
+			f->refcnt++;
+			pthread_mutex_unlock(&fp->lock);
+			*leader = 0;
+			return f;
+		}
+	}
+	*leader = 1;
+	if ((f = malloc(sizeof(flight_t))) == NULL ||
+			(f->key = strdup(key)) == NULL) {
+		free(f);
+		pthread_mutex_unlock(&fp->lock);
+		return NULL;
+	}
+	f->done = 0;
+	f->refcnt = 1;
+	pthread_cond_init(&f->cond, NULL);
+	f->next = fp->buckets[b];
+	fp->buckets[b] = f;
+	pthread_mutex_unlock(&fp->lock);
+	return f;
+}
+
+/* Wait for the leader of f to finish */
+void flight_wait(flights_t *fp, flight_t *f)
+{
+	pthread_mutex_lock(&fp->lock);
+	while (!f->done)
+		pthread_cond_wait(&f->cond, &fp->lock);
+	pthread_mutex_unlock(&fp->lock);
+}
+
+/*
+ * End the flight and wake its waiters; requests for the key from now on
+ * start a new one.  Called by the leader once the object is in the cache
+ * or will not be; calling it again does nothing.
+ */
+void flight_finish(flights_t *fp, flight_t *f)
+{
+	flight_t **pp;
+
+	pthread_mutex_lock(&fp->lock);
+	if (!f->done) {
+		f->done = 1;
+		pp = &fp->buckets[hash_key(f->key) % FLIGHT_NBUCKETS];
+		while (*pp != f)
+			pp = &(*pp)->next;
+		*pp = f->next;
+		pthread_cond_broadcast(&f->cond);
+	}
+	pthread_mutex_unlock(&fp->lock);
+}
+
+/* Drop the reference returned by flight_join() */
+void flight_release(flights_t *fp, flight_t *f)
+{
+	int last;
+
+	pthread_mutex_lock(&fp->lock);
+	last = --f->refcnt == 0;
+	pthread_mutex_unlock(&fp->lock);
+	if (last) {
+		pthread_cond_destroy(&f->cond);
+		free(f->key);
+		free(f);
+	}
+}
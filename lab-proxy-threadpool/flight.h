@@ -0,0 +1,28 @@
+#ifndef __FLIGHT_H__
+#define __FLIGHT_H__
+
+#include <pthread.h>
+
+#define FLIGHT_NBUCKETS 64
+
+/* An origin fetch in progress, and the requests waiting on it */
+typedef struct flight {
+	char *key;                  /* cache key being fetched */
+	int done;                   /* set once the fetch is over, or abandoned */
+	int refcnt;                 /* the fetcher plus one per waiter */
+	pthread_cond_t cond;        /* broadcast when done is set */
+	struct flight *next;        /* Next flight in the same hash bucket */
+} flight_t;
+
+typedef struct {
+	flight_t *buckets[FLIGHT_NBUCKETS];
+	pthread_mutex_t lock;
+} flights_t;
+
+void flights_init(flights_t *fp);
+flight_t *flight_join(flights_t *fp, const char *key, int *leader);
+void flight_wait(flights_t *fp, flight_t *f);
+void flight_finish(flights_t *fp, flight_t *f);
+void flight_release(flights_t *fp, flight_t *f);
+
+#endif /* __FLIGHT_H__ */
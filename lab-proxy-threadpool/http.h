@@ -0,0 +1,106 @@
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define HTTP_MAX_HEADERS 8192
+
+/* Where an http_resp_t is in the response */
+#define HTTP_HEADERS 0      /* still reading the status line and headers */
+#define HTTP_BODY_LENGTH 1  /* body delimited by Content-Length */
+#define HTTP_BODY_CLOSE 2   /* body runs until the server closes */
+#define HTTP_CHUNK_SIZE 3   /* chunked: reading a chunk-size line */
+#define HTTP_CHUNK_DATA 4   /* chunked: inside chunk data */
+#define HTTP_CHUNK_CRLF 5   /* chunked: CRLF after chunk data */
+#define HTTP_TRAILER 6      /* chunked: trailer section after last chunk */
+#define HTTP_DONE 7         /* response complete */
+#define HTTP_ERROR 8        /* malformed response */
+
+/*
+ * Tracks the framing of one HTTP response as its bytes stream past, so the
+ * proxy knows exactly where the response ends without waiting for the
+ * server to close the connection.  The bytes themselves are not modified.
+ * After http_body_init(), it tracks a request body the same way.
+ */
+typedef struct {
+	int state;
+	int status;                 /* status code, once headers are in */
+	int keep_alive;             /* server will keep the connection open */
+	long long content_length;   /* -1 if there was no Content-Length */
+	long long remaining;        /* bytes left in the body or current chunk */
+	int head_request;           /* response to HEAD: never has a body */
+	int line_state;             /* progress through chunk/trailer lines */
+	size_t hdr_len;             /* bytes in hdr */
+	char hdr[HTTP_MAX_HEADERS]; /* status line and headers */
+} http_resp_t;
+
+/* Where an http_req_t is in the request */
+#define HTTP_REQ_LINE 0     /* waiting for the request line */
+#define HTTP_REQ_HEADERS 1  /* reading header lines */
+#define HTTP_REQ_DONE 2     /* blank line seen: headers complete */
+#define HTTP_REQ_ERROR 3    /* malformed request */
+
+/* A run of bytes in the request buffer: where it is, not a copy of it */
+typedef struct {
+	size_t off;
+	size_t len;
+} http_str_t;
+
+/*
+ * An incrementally parsed request.  Each http_str_t is relative to the
+ * start of the buffer passed to http_req_parse(); an empty one (len 0)
+ * means the request did not have it.
+ */
+typedef struct {
+	int state;
+	size_t pos;                 /* bytes of the buffer scanned so far */
+	size_t line;                /* where the line being scanned starts */
+	http_str_t method;
+	http_str_t uri;             /* request target, as sent */
+	http_str_t version;         /* "HTTP/1.x" */
+	http_str_t host;            /* from the target, else the Host header */
+	http_str_t port;            /* empty if none was given */
+	http_str_t path;            /* empty for "http://host" or authority form */
+	http_str_t headers;         /* header lines, less the blank line */
+	int nheaders;
+	size_t hdr_len;             /* bytes up to and including the blank line */
+	int keep_alive;             /* client wants the connection kept open */
+	long long content_length;   /* body length; 0 if there is no body */
+	int chunked;                /* body uses chunked transfer coding */
+	http_str_t range;           /* Range header value */
+	http_str_t if_range;        /* If-Range header value */
+	int authorization;          /* carries an Authorization header */
+} http_req_t;
+
+/*
+ * What a response's headers say about caching it (RFC 9111).  etag and
+ * last_modified are relative to the start of the headers; empty if absent.
+ */
+typedef struct {
+	int no_store;               /* Cache-Control: no-store or private */
+	long long lifetime;         /* seconds it is fresh for; -1 if not given */
+	time_t date;                /* Date header; 0 if absent or unparsable */
+	http_str_t etag;            /* ETag value, quotes and all */
+	http_str_t last_modified;   /* Last-Modified value */
+} http_cache_info_t;
+
+/* Is the http_str_t s in buf equal to the string lit? */
+#define HTTP_STR_IS(buf, s, lit) \
+	((s).len == sizeof(lit) - 1 && memcmp((buf) + (s).off, lit, (s).len) == 0)
+
+void http_resp_init(http_resp_t *hr, int head_request);
+void http_body_init(http_resp_t *hr, long long content_length, int chunked);
+void http_req_init(http_req_t *rq);
+int http_req_parse(http_req_t *rq, const char *buf, size_t len);
+ssize_t http_resp_feed(http_resp_t *hr, const char *buf, size_t n);
+void http_resp_advance(http_resp_t *hr, size_t n);
+void http_cache_info(const char *hdr, size_t len, http_cache_info_t *ci);
+int http_range_parse(const char *v, size_t n, long long *first, long long *last);
+int http_range_resolve(long long *first, long long *last, long long size);
+int http_content_range(const char *hdr, size_t len, long long *first, long long *last,
+		long long *size);
+
+#endif /* __HTTP_H__ */
@@ -0,0 +1,102 @@
+#!/usr/bin/python3
+
+# latency-bench.py - Measure request latency through the proxy under the
+#                    mixed traffic the driver's concurrency test generates:
+#                    slow CGI requests that tie up a worker for a second
+#                    each, interleaved with fast requests for a static file.
+#                    Starts tiny and the proxy itself, then prints p50/p99
+#                    (and max) latency for each kind of request.
+#
+# usage: latency-bench.py [-r rounds] [-s slow] [-f fast] [-- proxy args]
+#
+import argparse
+import os
+import socket
+import subprocess
+import sys
+import threading
+import time
+
+CURRENT_DIR = os.path.dirname(os.path.abspath(__file__))
+TINY_DIR = os.path.join(CURRENT_DIR, 'tiny')
+PROXY = os.path.join(CURRENT_DIR, 'proxy')
+
+# the query is made unique per request so the cache never answers it
+SLOW_PATH = '/cgi-bin/slow?sleep=1&size=4096&n=%d'
+FAST_PATH = '/home.html'
+
+def free_port():
+    s = socket.socket()
+    s.bind(('localhost', 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+def wait_for_port(port):
+    for i in range(50):
+        try:
+            socket.create_connection(('localhost', port)).close()
+            return
+        except OSError:
+            time.sleep(0.1)
+    sys.exit('nothing listening on port %d' % port)
+
+def fetch(proxy_port, tiny_port, path, results, kind):
+    start = time.monotonic()
+    s = socket.create_connection(('localhost', proxy_port))
+    s.sendall(('GET http://localhost:%d%s HTTP/1.0\r\n'
+            'Host: localhost:%d\r\n\r\n' % (tiny_port, path, tiny_port)).encode())
+    while s.recv(65536):
+        pass
+    s.close()
+    results.append((kind, time.monotonic() - start))
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('-r', '--rounds', type=int, default=10)
+    parser.add_argument('-s', '--slow', type=int, default=5)
+    parser.add_argument('-f', '--fast', type=int, default=20)
+    parser.add_argument('proxy_args', nargs='*')
+    args = parser.parse_args()
+
+    tiny_port = free_port()
+    proxy_port = free_port()
+    devnull = open(os.devnull, 'w')
+    tiny = subprocess.Popen(['./tiny', str(tiny_port)], cwd=TINY_DIR,
+            stdout=devnull, stderr=devnull)
+    proxy = subprocess.Popen([PROXY] + args.proxy_args + [str(proxy_port)],
+            stdout=devnull, stderr=devnull)
+    try:
+        wait_for_port(tiny_port)
+        wait_for_port(proxy_port)
+        results = []
+        for r in range(args.rounds):
+            # slow requests first, as in the driver, then the fast ones
+            # arrive while the slow ones hold their workers
+            threads = [threading.Thread(target=fetch,
+                    args=(proxy_port, tiny_port,
+                        SLOW_PATH % (r * args.slow + i), results, 'slow'))
+                    for i in range(args.slow)]
+            threads += [threading.Thread(target=fetch,
+                    args=(proxy_port, tiny_port, FAST_PATH, results, 'fast'))
+                    for i in range(args.fast)]
+            for t in threads:
+                t.start()
+                time.sleep(0.001)
+            for t in threads:
+                t.join()
+    finally:
+        proxy.kill()
+        tiny.kill()
+
+    for kind in ('fast', 'slow'):
+        lat = [l * 1000 for k, l in results if k == kind]
+        print('%-5s n=%-4d p50 %8.1f ms  p99 %8.1f ms  max %8.1f ms' % (kind,
+                len(lat), percentile(lat, 50), percentile(lat, 99), max(lat)))
+
+if __name__ == '__main__':
+    main()
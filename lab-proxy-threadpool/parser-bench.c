@@ -0,0 +1,234 @@
+/*
+ * parser-bench.c - compare http_req_parse() with the parse_request() it
+ * replaced, on the requests from test_parser() plus one with a long URL
+ * and many headers.  Each request is parsed two ways: all at once, as if
+ * it arrived in a single recv(), and trickled in RECV_SIZE bytes at a time,
+ * re-checking for the end of the headers after every piece the way
+ * handle_client() used to.
+ *
+ * usage: ./parser-bench [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "http.h"
+
+#define HOST_PREFIX 2
+#define PORT_PREFIX 1
+#define REQ_BUF_SIZE 8192
+#define RECV_SIZE 64
+#define true 1
+
+/* The old parser, verbatim but for its name */
+static int legacy_all_headers_received(char *request) {
+	if (strstr(request, "\r\n\r\n") != NULL) {
+		return 1;
+	}
+	return 0;
+}
+
+static int legacy_parse_request(char *request, char *method,
+		char *hostname, char *port, char *path, char *headers) {
+
+			if (legacy_all_headers_received(request) == 0) {
+				return 0;
+			}
+
+			char* buf;
+			int found = 0;
+			unsigned int i = 0;
+			while (i < strlen(request)) {
+				if (request[i] == ' ') {
+					found = 1;
+					break;
+				}
+				 ++i;
+			}
+			if (found != 1) {
+				return 0;
+			}
+			strncpy(method, request, i);
+			method[i] = '\0';
+			
+			buf = strstr(request, "//");
+			i = HOST_PREFIX;
+			int defaultPort = 0;
+			found = 0;
+			while (i < strlen(buf)) {
+				if (buf[i] == '/') {
+					found = 1;
+					defaultPort = 1;
+					break;
+				}
+				else if (buf[i] == ':') {
+					found = 1;
+					defaultPort = 0;
+					break;
+				}
+				++i;
+			}
+			if (found != 1) {
+				return 0;
+			}
+			strncpy(hostname, &buf[HOST_PREFIX], i - HOST_PREFIX);
+			hostname[i - HOST_PREFIX] = '\0';
+
+			if (defaultPort == 1) {
+				strcpy(port, "80"); // default port
+				buf = &buf[i];
+			}
+			else {
+				found = 0;
+				buf = strchr(buf, ':');
+				i = PORT_PREFIX;
+				while (i < strlen(buf)) {
+					if (buf[i] == '/') {
+						found = 1;
+						break;
+					}
+					++i;
+				}
+				if (found != 1) {
+					return 0;
+				}
+				strncpy(port, &buf[1], i - PORT_PREFIX);
+				port[i - PORT_PREFIX] = '\0';
+				buf = &buf[i];
+			}
+
+			found = 0;
+			i = 0;
+			while (i < strlen(buf)) {
+				if (buf[i] == ' ') {
+					found = 1;
+					break;
+				}
+				++i;
+			}
+			strncpy(path, &buf[0], i);
+			path[i] = '\0';
+
+			buf = strstr(request, "\r\n");
+			strcpy (headers, &buf[2]);
+			if (true == true) {
+				//test
+			}
+			return 1;
+}
+
+
+char method[REQ_BUF_SIZE], hostname[REQ_BUF_SIZE], port[REQ_BUF_SIZE];
+char path[REQ_BUF_SIZE], headers[REQ_BUF_SIZE];
+char buf[REQ_BUF_SIZE];
+volatile size_t sink;
+
+double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void legacy_whole(const char *req, size_t len) {
+	memcpy(buf, req, len + 1);
+	sink += legacy_parse_request(buf, method, hostname, port, path, headers);
+}
+
+void legacy_trickle(const char *req, size_t len) {
+	size_t n = 0, k;
+
+	buf[0] = '\0';
+	while (legacy_all_headers_received(buf) == 0) {
+		k = len - n < RECV_SIZE ? len - n : RECV_SIZE;
+		memcpy(buf + n, req + n, k);
+		n += k;
+		buf[n] = '\0';
+	}
+	sink += legacy_parse_request(buf, method, hostname, port, path, headers);
+}
+
+void new_whole(const char *req, size_t len) {
+	http_req_t rq;
+
+	memcpy(buf, req, len);
+	http_req_init(&rq);
+	sink += http_req_parse(&rq, buf, len) + rq.path.len;
+}
+
+void new_trickle(const char *req, size_t len) {
+	http_req_t rq;
+	size_t n = 0, k;
+
+	http_req_init(&rq);
+	do {
+		k = len - n < RECV_SIZE ? len - n : RECV_SIZE;
+		memcpy(buf + n, req + n, k);
+		n += k;
+	} while (http_req_parse(&rq, buf, n) == 0);
+	sink += rq.path.len;
+}
+
+void run(const char *name, void (*fn)(const char *, size_t),
+		char **reqs, int nreqs, long iters) {
+	double start, secs;
+	size_t bytes = 0;
+	long i;
+	int j;
+
+	start = now();
+	for (i = 0; i < iters; i++) {
+		for (j = 0; j < nreqs; j++) {
+			size_t len = strlen(reqs[j]);
+			fn(reqs[j], len);
+			bytes += len;
+		}
+	}
+	secs = now() - start;
+	printf("%-16s %8.0f ns/request  %8.1f MB/s\n", name,
+			secs * 1e9 / (iters * nreqs), bytes / secs / 1e6);
+}
+
+int main(int argc, char *argv[]) {
+	long iters = argc > 1 ? atol(argv[1]) : 200000;
+	static char big[REQ_BUF_SIZE];
+	char *corpus[] = {
+		"GET http://www.example.com/index.html HTTP/1.0\r\n"
+		"Host: www.example.com\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:68.0) Gecko/20100101 Firefox/68.0\r\n"
+		"Accept-Language: en-US,en;q=0.5\r\n\r\n",
+
+		"GET http://www.example.com:8080/index.html?foo=1&bar=2 HTTP/1.0\r\n"
+		"Host: www.example.com:8080\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:68.0) Gecko/20100101 Firefox/68.0\r\n"
+		"Accept-Language: en-US,en;q=0.5\r\n\r\n",
+
+		"GET http://localhost:1234/home.html HTTP/1.0\r\n"
+		"Host: localhost:1234\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:68.0) Gecko/20100101 Firefox/68.0\r\n"
+		"Accept-Language: en-US,en;q=0.5\r\n\r\n",
+	};
+	char *large[] = { big };
+	int i, n;
+
+	// a 1 KB URL and 40 headers: the old parser is quadratic in both
+	n = sprintf(big, "GET http://www.example.com/");
+	for (i = 0; i < 1000; i++)
+		big[n++] = 'a' + i % 26;
+	n += sprintf(big + n, " HTTP/1.0\r\nHost: www.example.com\r\n");
+	for (i = 0; i < 40; i++)
+		n += sprintf(big + n, "X-Header-%d: %s\r\n", i, "some value or other");
+	sprintf(big + n, "\r\n");
+
+	printf("test_parser() corpus, %ld iterations\n", iters);
+	run("legacy whole", legacy_whole, corpus, 3, iters);
+	run("new whole", new_whole, corpus, 3, iters);
+	run("legacy trickle", legacy_trickle, corpus, 3, iters);
+	run("new trickle", new_trickle, corpus, 3, iters);
+
+	printf("\n%zu-byte request, %ld iterations\n", strlen(big), iters / 10);
+	run("legacy whole", legacy_whole, large, 1, iters / 10);
+	run("new whole", new_whole, large, 1, iters / 10);
+	run("legacy trickle", legacy_trickle, large, 1, iters / 10);
+	run("new trickle", new_trickle, large, 1, iters / 10);
+	return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -5,87 +6,123 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <signal.h>
 #include <pthread.h>
-#include <semaphore.h>
-
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
-#define HOST_PREFIX 2
-#define PORT_PREFIX 1
-#define BUF_SIZE 1049000
-#define NTHREADS 8
-#define SBUFSIZE 5
+#include <strings.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/time.h>
+#include "alog.h"
+#include "cache.h"
+#include "disk.h"
+#include "flight.h"
+#include "http.h"
+#include "pool.h"
+#include "relay.h"
+#include "resolver.h"
+#include "stats.h"
+#include "workers.h"
+
+#define REQ_BUF_SIZE 8192
+#define MIN_THREADS 8        /* default floor: workers block on origins */
+#define MAX_THREADS 256      /* default ceiling when they are all blocked */
+#define KEEPALIVE_TIMEOUT 5  /* seconds a client may sit idle between requests */
+#define HEADER_TIMEOUT 10    /* seconds a client has to get its headers in */
+#define IDLE_TIMEOUT 30      /* seconds either socket may stall mid-exchange */
+#define REQUEST_TIMEOUT 300  /* seconds for a whole request and response */
+#define DEFAULT_FRESHNESS 300 /* seconds a response that says nothing stays fresh */
+#define SLICE_SIZE 65536     /* bytes per cached slice; with its headers, */
+                             /* it must fit in MAX_OBJECT_SIZE */
+#define QUEUE_DEPTH 128      /* default: connections queued before shedding */
+#define QUEUE_DELAY 1000     /* default: ms a connection may wait for a worker */
+#define STATS_PATH "/__proxy_stats" /* origin-form GET for the proxy's own stats */
+#define STATS_PAGE_SIZE 8192
 #define true 1
 
-//=======================Sbuf stuff ==========================//
+/* What relay_response() left behind on the origin connection */
+#define RESP_NONE -1     /* origin sent nothing: the request may be retried */
+#define RESP_CLOSE 0     /* relayed; the connection must be closed */
+#define RESP_REUSE 1     /* relayed in full; the connection can be pooled */
 
+/* A client's single byte range, copied out of its request */
 typedef struct {
-    int *buf;                   
-    int n;             
-    int front;         
-    int rear;          
-    sem_t mutex;       
-    sem_t slots;       
-    sem_t items;       
-} sbuf_t;
-
-void sbuf_init(sbuf_t *sp, int n)
-{
-    sp->buf = calloc(n, sizeof(int)); 
-    sp->n = n;                       
-    sp->front = sp->rear = 0;        
-    sem_init(&sp->mutex, 0, 1);      
-    sem_init(&sp->slots, 0, n);      
-    sem_init(&sp->items, 0, 0);      
-}
-
-void sbuf_deinit(sbuf_t *sp)
-{
-    free(sp->buf);
-}
+	long long first, last;      /* as http_range_parse() left them */
+	char if_range[256];         /* If-Range value; empty if none */
+} range_t;
 
-void sbuf_insert(sbuf_t *sp, int item)
-{
-    printf("before wait(slots)\n"); fflush(stdout);
-    sem_wait(&sp->slots);                          
-    printf("after wait(slots)\n"); fflush(stdout);
-    sem_wait(&sp->mutex);                         
-    sp->buf[(++sp->rear)%(sp->n)] = item;   
-    sem_post(&sp->mutex);                         
-    printf("before post(items)\n"); fflush(stdout);
-    sem_post(&sp->items);                          
-    printf("after post(items)\n"); fflush(stdout);
-
-}
+/* One slice of an object: a cached 206, or a fetched one not cached */
+typedef struct {
+	cache_obj_t *obj;           /* the cached copy, with a reference held, */
+	char *own;                  /* ...or the fetched copy, malloc'd */
+	const char *data;           /* the origin's 206, headers and body */
+	size_t hdr_len;
+	long long first, last, size;  /* its Content-Range */
+} slice_t;
 
-int sbuf_remove(sbuf_t *sp)
-{
-    int item;
-    printf("before wait(items)\n"); fflush(stdout);
-    sem_wait(&sp->items);                          
-    printf("after wait(items)\n"); fflush(stdout);
-    sem_wait(&sp->mutex);                          
-    item = sp->buf[(++sp->front)%(sp->n)];  
-    sem_post(&sp->mutex);                          
-    printf("before post(slots)\n"); fflush(stdout);
-    sem_post(&sp->slots);                          
-    printf("after post(slots)\n"); fflush(stdout);
-    return item;
-}
-
-//============================================================//
-
-sbuf_t sbuf;
+workers_t workers;
+cache_t cache;
+disk_t disk;
+int disk_tier = 0;                            /* -d: spill evictions to disk */
+flights_t flights;                            /* cache misses being fetched */
+pool_t pool;                                  /* idle keep-alive origin connections */
+int zero_copy = 0;                            /* -z: splice() uncacheable bodies */
+static __thread int relay_pipe[2] = { -1, -1 }; /* per-worker splice() pipe */
+static pthread_key_t relay_pipe_key;          /* ... closed as its worker exits */
+static pthread_once_t relay_pipe_once = PTHREAD_ONCE_INIT;
+int verbose = 0;                              /* -v or -l: keep an access log */
+static __thread long long req_start;          /* when this worker's request began, in us */
+static __thread int first_byte_sent;          /* ... and whether its response has begun */
+volatile sig_atomic_t stats_requested = 0;
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10.15; rv:97.0) Gecko/20100101 Firefox/97.0";
 
-int all_headers_received(char *);
-int parse_request(char *, char *, char *, char *, char *, char *);
-int open_sfd();
+int open_sfd(const char *);
 void test_parser();
 void print_bytes(unsigned char *, int);
 void handle_client(int nsfd);
-void *run_thread(void *vargp);
+int serve_request(int nsfd, char *buf, size_t *nread, long long since);
+int forward_request(int nsfd, char *buf, size_t *nread, http_req_t *rq, http_resp_t *resp,
+		long long deadline);
+long long now_ms(void);
+int wait_readable(int fd, long long deadline);
+void first_byte(void);
+int open_relay_pipe(void);
+void log_request(const char *line, int status);
+int is_stats_request(const char *buf, const http_req_t *rq, int *json);
+int serve_stats(int nsfd, int json, int keep_alive);
+size_t format_stats(char *out, size_t size, int json);
+void print_stats(void);
+void sigusr1_handler(int sig);
+void shed_client(int nsfd);
+void refuse_oversized(int nsfd, const http_req_t *rq);
+int relay_request_body(int nsfd, int ssfd, char *buf, const http_req_t *rq, size_t *nread,
+		long long deadline);
+int connect_origin(const char *hostname, const char *port);
+int serve_cached(int nsfd, const char *key, const range_t *range, http_resp_t *resp,
+		cache_obj_t **stale);
+int write_cached(int nsfd, const char *data, size_t len, const range_t *range,
+		http_resp_t *resp);
+int write_partial_head(int nsfd, const char *hdr, size_t hdr_len, long long *first,
+		long long *last, long long size, http_resp_t *resp);
+int if_range_holds(const char *ifr, const char *hdr, size_t hdr_len);
+int serve_slices(int nsfd, const char *hostname, const char *port, const char *head,
+		const char *key, const range_t *range, http_resp_t *resp, long long deadline);
+int get_slice(const char *hostname, const char *port, const char *head, const char *key,
+		long long i, slice_t *sl, long long deadline);
+void put_slice(slice_t *sl);
+cache_obj_t *lookup_fresh(const char *key);
+char *fetch_slice(const char *hostname, const char *port, const char *head, long long from,
+		size_t *len, long long deadline);
+int cacheable_status(int status);
+time_t expiry(const http_cache_info_t *ci, const http_cache_info_t *old);
+void spill_to_disk(void *arg, const char *key, const char *data, size_t len);
+int relay_response(int ssfd, int nsfd, flight_t *f, cache_obj_t *stale,
+		const range_t *range, http_resp_t *resp, long long deadline);
+int is_end_to_end(const char *line, const char *eol);
+int forwards_header(const char *line, const char *eol, int cacheable);
+char *refresh_stored(const char *data, size_t len, const char *hdr, size_t hdr_len,
+		size_t *out_len);
 
 
 int main(int argc, char *argv[])
@@ -93,126 +130,134 @@ int main(int argc, char *argv[])
 	// test_parser();
 	printf("%s\n", user_agent_hdr);
 
-	int sfd = open_sfd(argc, argv);
+	// one worker per core, but a worker waiting on a slow origin holds
+	// its thread, so never fewer than MIN_THREADS unless asked with -t;
+	// the pool grows past that, up to -T, while they are all blocked
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < MIN_THREADS) {
+		nthreads = MIN_THREADS;
+	}
+	int maxthreads = 0;
+	const char *disk_dir = NULL;
+	int policy = CACHE_LRU;
+	int queue_depth = QUEUE_DEPTH;
+	long queue_delay = QUEUE_DELAY;
+	const char *log_path = NULL;
+	int log_sample = 1;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "d:l:p:q:Q:s:t:T:vz")) != -1) {
+		switch (opt) {
+		case 'd':
+			disk_dir = optarg;
+			break;
+		case 'l':
+			log_path = optarg;
+			verbose = 1;
+			break;
+		case 'p':
+			if ((policy = cache_policy_parse(optarg)) < 0) {
+				nthreads = 0;
+			}
+			break;
+		case 'q':
+			queue_depth = atoi(optarg);
+			break;
+		case 'Q':
+			queue_delay = atol(optarg);
+			break;
+		case 's':
+			log_sample = atoi(optarg);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'T':
+			maxthreads = atoi(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'z':
+			zero_copy = 1;
+			break;
+		default:
+			nthreads = 0;
+		}
+	}
+	if (maxthreads == 0) {
+		maxthreads = nthreads > MAX_THREADS ? nthreads : MAX_THREADS;
+	}
+	if (optind >= argc || nthreads < 1 || maxthreads < nthreads ||
+			queue_depth < 0 || queue_delay < 0 || log_sample < 1) {
+		fprintf(stderr, "Usage: %s [-d cache dir] [-l log file] [-p lru|clock|tinylfu] [-q queue depth] [-Q queue delay ms] [-s log 1 in n] [-t threads] [-T max threads] [-v] [-z] port\n", argv[0]);
+		exit(1);
+	}
+
+	int sfd = open_sfd(argv[optind]);
 	struct sockaddr_storage peer_addr;
 	socklen_t peer_addr_len = sizeof(struct sockaddr_storage);
-	pthread_t tid;
 
-	sbuf_init(&sbuf, SBUFSIZE); 
-	for (unsigned int i = 0; i < NTHREADS; i++) {
-		pthread_create(&tid, NULL, run_thread, NULL);  
+	// a client hanging up mid-response must not kill the proxy
+	signal(SIGPIPE, SIG_IGN);
+
+	// SIGUSR1 prints the counters; only the accept loop sees it, since
+	// it must not cut short a worker's blocking I/O
+	struct sigaction sigact;
+	sigset_t usr1;
+	memset(&sigact, 0, sizeof(sigact));
+	sigact.sa_handler = sigusr1_handler;
+	sigaction(SIGUSR1, &sigact, NULL);
+	sigemptyset(&usr1);
+	sigaddset(&usr1, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+
+	cache_init(&cache);
+	cache_set_policy(&cache, policy);
+	// objects evicted from memory go to disk, and survive a restart there
+	if (disk_dir != NULL) {
+		if (disk_init(&disk, disk_dir) < 0) {
+			perror(disk_dir);
+			exit(1);
+		}
+		disk_tier = 1;
+		cache_set_spill(&cache, spill_to_disk, &disk);
 	}
+	// from here stdout is the log's, written in batches by its own thread
+	// underneath stdio, so whatever stdio holds goes out first
+	fflush(stdout);
+	if (verbose && alog_open(log_path, log_sample) < 0) {
+		perror(log_path != NULL ? log_path : "access log");
+		exit(1);
+	}
+	flights_init(&flights);
+	pool_init(&pool);
+	// workers resolve on their own thread; the cache is what saves time here
+	resolver_init(0);
+	workers_init(&workers, nthreads, maxthreads, handle_client);
+	// past -T workers, answer the overflow with a 503 rather than let it
+	// wait in the listen backlog until it times out
+	workers_set_shed(&workers, queue_depth, queue_delay, shed_client);
+	pthread_sigmask(SIG_UNBLOCK, &usr1, NULL);
 
 	while(1) {
 		peer_addr_len = sizeof(struct sockaddr_storage);
 		int nsfd = accept(sfd, (struct sockaddr *) &peer_addr, &peer_addr_len);
-		sbuf_insert(&sbuf, nsfd);
-	}
-	return 0;
-}
-
-int all_headers_received(char *request) {
-	if (strstr(request, "\r\n\r\n") != NULL) {
-		return 1;
+		if (stats_requested) {
+			stats_requested = 0;
+			print_stats();
+		}
+		if (nsfd < 0) {
+			continue;
+		}
+		workers_submit(&workers, nsfd);
 	}
 	return 0;
 }
 
-int parse_request(char *request, char *method,
-		char *hostname, char *port, char *path, char *headers) {
-
-			if (all_headers_received(request) == 0) {
-				return 0;
-			}
-
-			char* buf;
-			int found = 0;
-			unsigned int i = 0;
-			while (i < strlen(request)) {
-				if (request[i] == ' ') {
-					found = 1;
-					break;
-				}
-				 ++i;
-			}
-			if (found != 1) {
-				return 0;
-			}
-			strncpy(method, request, i);
-			method[i] = '\0';
-			
-			buf = strstr(request, "//");
-			i = HOST_PREFIX;
-			int defaultPort = 0;
-			found = 0;
-			while (i < strlen(buf)) {
-				if (buf[i] == '/') {
-					found = 1;
-					defaultPort = 1;
-					break;
-				}
-				else if (buf[i] == ':') {
-					found = 1;
-					defaultPort = 0;
-					break;
-				}
-				++i;
-			}
-			if (found != 1) {
-				return 0;
-			}
-			strncpy(hostname, &buf[HOST_PREFIX], i - HOST_PREFIX);
-			hostname[i - HOST_PREFIX] = '\0';
-
-			if (defaultPort == 1) {
-				strcpy(port, "80"); // default port
-				buf = &buf[i];
-			}
-			else {
-				found = 0;
-				buf = strchr(buf, ':');
-				i = PORT_PREFIX;
-				while (i < strlen(buf)) {
-					if (buf[i] == '/') {
-						found = 1;
-						break;
-					}
-					++i;
-				}
-				if (found != 1) {
-					return 0;
-				}
-				strncpy(port, &buf[1], i - PORT_PREFIX);
-				port[i - PORT_PREFIX] = '\0';
-				buf = &buf[i];
-			}
-
-			found = 0;
-			i = 0;
-			while (i < strlen(buf)) {
-				if (buf[i] == ' ') {
-					found = 1;
-					break;
-				}
-				++i;
-			}
-			strncpy(path, &buf[0], i);
-			path[i] = '\0';
-
-			buf = strstr(request, "\r\n");
-			strcpy (headers, &buf[2]);
-			if (true == true) {
-				//test
-			}
-			return 1;
-}
-
 void test_parser() {
 	int i;
-	char method[16], hostname[64], port[8], path[64], headers[1024];
-	if (true == true) {
-				//test
-			}
+	http_req_t rq;
        	char *reqs[] = {
 		"GET http://www.example.com/index.html HTTP/1.0\r\n"
 		"Host: www.example.com\r\n"
@@ -236,18 +281,20 @@ void test_parser() {
 	
 	for (i = 0; reqs[i] != NULL; i++) {
 		printf("Testing %s\n", reqs[i]);
-		if (parse_request(reqs[i], method, hostname, port, path, headers)) {
-			printf("METHOD: %s\n", method);
-			printf("HOSTNAME: %s\n", hostname);
-			printf("PORT: %s\n", port);
-			printf("HEADERS: %s\n", headers);
+		http_req_init(&rq);
+		if (http_req_parse(&rq, reqs[i], strlen(reqs[i])) == 1) {
+			printf("METHOD: %.*s\n", (int)rq.method.len, reqs[i] + rq.method.off);
+			printf("HOSTNAME: %.*s\n", (int)rq.host.len, reqs[i] + rq.host.off);
+			printf("PORT: %.*s\n", (int)rq.port.len, reqs[i] + rq.port.off);
+			printf("PATH: %.*s\n", (int)rq.path.len, reqs[i] + rq.path.off);
+			printf("HEADERS: %.*s\n", (int)rq.headers.len, reqs[i] + rq.headers.off);
 		} else {
 			printf("REQUEST INCOMPLETE\n");
 		}
 	}
 }
 
-int open_sfd(int argc, char* argv[]) {
+int open_sfd(const char *port) {
 	int sfd, s;
 	struct addrinfo hints;
 	struct addrinfo *result, *rp;
@@ -258,12 +305,7 @@ int open_sfd(int argc, char* argv[]) {
 	hints.ai_protocol = 0;
 	hints.ai_flags = 0;
 
-	if(argc < 1) {
-		fprintf(stderr, "Missing command line argument");
-		exit(1);
-	}
-
-	s = getaddrinfo(NULL, argv[1], &hints, &result);
+	s = getaddrinfo(NULL, port, &hints, &result);
 	if (s != 0) {
 		fprintf(stderr, "getaddrinfo erro");
 		exit(1);
@@ -291,100 +333,1318 @@ int open_sfd(int argc, char* argv[]) {
 	return sfd;
 }
 
-void *run_thread(void *vargp) {
-	if (true == true) {
-				//test
-			}
-	pthread_detach(pthread_self());
-	while (1) {
-		int nsfd = sbuf_remove(&sbuf);
-		handle_client(nsfd);
+/*
+ * Serve requests from the client on nsfd until it closes, asks to close,
+ * or gets a response that only the connection closing can end.  Requests
+ * the client pipelined behind the current one wait in buf meanwhile.
+ */
+void handle_client(int nsfd) {
+	char buf[REQ_BUF_SIZE];
+	size_t nread = 0;
+	struct timeval tv = { IDLE_TIMEOUT, 0 };
+	// the first request's latency counts from accept, queueing and all
+	long long since = nsfd < workers.nfds ? workers.queued_at[nsfd] : stats_now_us();
+
+	stats_count(STAT_CONNECTIONS);
+	// a client that stops reading or sending must not hold on to a
+	// worker for good
+	setsockopt(nsfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(nsfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	while (serve_request(nsfd, buf, &nread, since))
+		since = 0;
+	close(nsfd);
+}
+
+long long now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Wait until fd is readable or the CLOCK_MONOTONIC millisecond deadline
+ * passes.  Returns 1 if it is readable (or has hung up), 0 otherwise.
+ */
+int wait_readable(int fd, long long deadline) {
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	long long left;
+	int n;
+
+	while ((left = deadline - now_ms()) > 0) {
+		n = poll(&pfd, 1, left);
+		if (n > 0) {
+			return 1;
+		}
+		if (n < 0 && errno != EINTR) {
+			return 0;
+		}
 	}
+	return 0;
+}
 
-	
+/* Note how long the current request took to start its response, once */
+void first_byte(void) {
+	if (!first_byte_sent) {
+		first_byte_sent = 1;
+		stats_record(STAT_FIRST_BYTE, stats_now_us() - req_start);
+	}
+}
 
+static void close_relay_pipe(void *arg) {
+	relay_pipe_close(arg);
 }
 
-void handle_client(int nsfd) {
-	if (true == true) {
-				//test
-			}
-	char buf[BUF_SIZE];
-	int nread = 0;
-	for(;;) {
-		int tmp = 0;
-		tmp = recv(nsfd, &buf[nread], BUF_SIZE, 0);
-		nread += tmp;
-		
-		if (all_headers_received(buf) == 1) {
-			break;
+static void make_relay_pipe_key(void) {
+	pthread_key_create(&relay_pipe_key, close_relay_pipe);
+}
+
+/*
+ * Open this worker's splice() pipe, if it has none.  The pool retires idle
+ * workers, so the pipe is closed when its thread exits, rather than
+ * leaking two descriptors per worker retired.  Returns as
+ * relay_pipe_open() does.
+ */
+int open_relay_pipe(void) {
+	if (relay_pipe[0] >= 0) {
+		return 0;
+	}
+	pthread_once(&relay_pipe_once, make_relay_pipe_key);
+	if (relay_pipe_open(relay_pipe) < 0) {
+		return -1;
+	}
+	pthread_setspecific(relay_pipe_key, relay_pipe);
+	return 0;
+}
+
+/*
+ * With -v or -l, log a request: line is its method and target.  The entry
+ * only goes into this worker's ring; the log's writer thread puts it out,
+ * batched with others, so a slow disk or reader never holds up a request.
+ */
+void log_request(const char *line, int status) {
+	alog_printf("%s %d %lldus", line, status, stats_now_us() - req_start);
+}
+
+/*
+ * Is rq, in buf, a request for the proxy's own stats: STATS_PATH in origin
+ * form, as it comes when the proxy is asked directly rather than used as
+ * one?  Sets *json if the query asks for format=json.
+ */
+int is_stats_request(const char *buf, const http_req_t *rq, int *json) {
+	size_t n = strlen(STATS_PATH);
+	if (!HTTP_STR_IS(buf, rq->method, "GET") || rq->uri.len < n ||
+			buf[rq->uri.off] != '/' || strncmp(buf + rq->uri.off, STATS_PATH, n) != 0) {
+		return 0;
+	}
+	if (rq->uri.len > n && buf[rq->uri.off + n] != '?') {
+		return 0;
+	}
+	*json = memmem(buf + rq->uri.off + n, rq->uri.len - n, "format=json", 11) != NULL;
+	return 1;
+}
+
+/* Answer a stats request.  Returns 1 if the connection can be kept. */
+int serve_stats(int nsfd, int json, int keep_alive) {
+	char page[STATS_PAGE_SIZE], hdr[256];
+	size_t len = format_stats(page, sizeof(page), json);
+	int n = snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\n"
+			"Content-Type: %s\r\n"
+			"Content-Length: %zu\r\n"
+			"Cache-Control: no-store\r\n"
+			"Connection: %s\r\n\r\n",
+			json ? "application/json" : "text/plain", len,
+			keep_alive ? "keep-alive" : "close");
+	first_byte();
+	return write_all(nsfd, hdr, n) == 0 && write_all(nsfd, page, len) == 0 && keep_alive;
+}
+
+/* Append to out, which holds *len of size bytes, as far as it fits */
+static void append(char *out, size_t size, size_t *len, const char *fmt, ...) {
+	va_list ap;
+	int n;
+	if (*len >= size - 1) {
+		return;
+	}
+	va_start(ap, fmt);
+	n = vsnprintf(out + *len, size - *len, fmt, ap);
+	va_end(ap);
+	if (n > 0) {
+		*len += (size_t)n < size - *len ? (size_t)n : size - *len - 1;
+	}
+}
+
+/*
+ * Render every counter, latency histogram, cache and worker gauge, and the
+ * access log's dropped entries into out, as "name value" lines or, if
+ * json, one JSON object.  Returns the length written.
+ */
+size_t format_stats(char *out, size_t size, int json) {
+	static const double pcts[] = { 50, 90, 99, 99.9, 100 };
+	static const char *pct_names[] = { "p50", "p90", "p99", "p999", "max" };
+	stats_t *st = malloc(sizeof(stats_t));   // too big for a worker's stack
+	cache_stats_t cs;
+	size_t len = 0;
+	int i, j;
+
+	out[0] = '\0';
+	if (st == NULL) {
+		return 0;
+	}
+	stats_collect(st);
+	cache_stats(&cache, &cs);
+
+	append(out, size, &len, json ? "{\"counters\":{" : "");
+	for (i = 0; i < STAT_NCOUNTERS; i++) {
+		append(out, size, &len, json ? "%s\"%s\":%lu" : "%s%s %lu\n",
+				json && i > 0 ? "," : "", stats_counter_name(i), st->counters[i]);
+	}
+	append(out, size, &len, json ? "},\"latency\":{" : "");
+	for (i = 0; i < STAT_NHISTS; i++) {
+		append(out, size, &len, json ? "%s\"%s\":{\"count\":%lu,\"mean\":%llu" :
+				"%s%s count=%lu mean=%llu", json && i > 0 ? "," : "",
+				stats_hist_name(i), st->count[i],
+				st->count[i] ? st->sum[i] / st->count[i] : 0);
+		for (j = 0; j < sizeof(pcts) / sizeof(pcts[0]); j++) {
+			append(out, size, &len, json ? ",\"%s\":%lld" : " %s=%lld",
+					pct_names[j], stats_percentile(st, i, pcts[j]));
 		}
+		append(out, size, &len, json ? "}" : "\n");
 	}
-	
+	append(out, size, &len, json ?
+			"},\"cache\":{\"policy\":\"%s\",\"objects\":%lu,\"bytes\":%zu,\"evictions\":%lu}," :
+			"cache_policy %s\ncache_objects %lu\ncache_bytes %zu\ncache_evictions %lu\n",
+			cache_policy_name(cache.policy), cs.objects, cs.bytes, cs.evictions);
+	append(out, size, &len, json ?
+			"\"workers\":{\"running\":%d,\"queued\":%d,\"grown\":%lu,\"retired\":%lu,"
+			"\"shed_full\":%lu,\"shed_late\":%lu},\"log_dropped\":%lu}\n" :
+			"workers_running %d\nworkers_queued %d\nworkers_grown %lu\nworkers_retired %lu\n"
+			"shed_full %lu\nshed_late %lu\nlog_dropped %lu\n",
+			__atomic_load_n(&workers.n, __ATOMIC_RELAXED),
+			__atomic_load_n(&workers.pending, __ATOMIC_RELAXED),
+			workers.grown, workers.retired, workers.shed_full,
+			__atomic_load_n(&workers.shed_late, __ATOMIC_RELAXED), alog_dropped());
+	free(st);
+	return len;
+}
+
+void print_stats(void) {
+	char page[STATS_PAGE_SIZE];
+	size_t len = format_stats(page, sizeof(page), 0);
+
+	fwrite(page, 1, len, stderr);
+}
+
+void sigusr1_handler(int sig) {
+	stats_requested = 1;
+}
+
+/*
+ * Turn away a connection the workers have no room for.  This runs on the
+ * accept thread as well as on workers, so nothing here may block: the 503
+ * goes out only if it fits in the socket buffer, which for a new
+ * connection it always does.  Whatever the client has sent is read and
+ * dropped before closing, since closing with unread data resets the
+ * connection, which can discard the 503 before the client sees it.
+ */
+void shed_client(int nsfd) {
+	static const char resp[] = "HTTP/1.1 503 Service Unavailable\r\n"
+		"Retry-After: 1\r\n"
+		"Content-Length: 0\r\n"
+		"Connection: close\r\n\r\n";
+	char buf[REQ_BUF_SIZE];
+
+	send(nsfd, resp, sizeof(resp) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+	shutdown(nsfd, SHUT_WR);
+	while (recv(nsfd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+		;
+	close(nsfd);
+}
+
+/*
+ * Turn away a request whose head does not fit in REQ_BUF_SIZE: 414 if not
+ * even its request line does, else 431 (RFC 6585 section 5).  As in
+ * shed_client(), what the client has sent is read and dropped before the
+ * caller closes, so a reset does not take the answer with it.
+ */
+void refuse_oversized(int nsfd, const http_req_t *rq) {
+	static const char uri_too_long[] = "HTTP/1.1 414 URI Too Long\r\n"
+		"Content-Length: 0\r\n"
+		"Connection: close\r\n\r\n";
+	static const char too_large[] = "HTTP/1.1 431 Request Header Fields Too Large\r\n"
+		"Content-Length: 0\r\n"
+		"Connection: close\r\n\r\n";
+	const char *reply = rq->state == HTTP_REQ_LINE ? uri_too_long : too_large;
+	char buf[REQ_BUF_SIZE];
+
+	first_byte();
+	write_all(nsfd, reply, strlen(reply));
+	shutdown(nsfd, SHUT_WR);
+	while (recv(nsfd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+		;
+}
+
+/*
+ * Read one request from nsfd, starting with the nread bytes already in buf,
+ * and relay its response.  On return buf holds only the bytes that came
+ * after the request.  Its latency counts from since, in microseconds, or
+ * from its first byte if since is 0.  Returns 1 if the connection can take
+ * another request, 0 if it must be closed.
+ */
+int serve_request(int nsfd, char *buf, size_t *nread, long long since) {
+	http_req_t rq;
+	http_resp_t resp;
+	char line[256];
+	int s, json, logged;
+	long long start = now_ms();
+	long long head_start = *nread > 0 ? start : 0;  /* when its first byte was in */
 
-	char method[16], hostname[64], port[8], path[64], headers[1024], newReq[BUF_SIZE];
-	if (parse_request(buf, method, hostname, port, path, headers)) {
-		if (strcmp(port, "80")) {
-			sprintf(newReq, "%s %s HTTP/1.0\r\nHost: %s:%s\r\nUser-Agent: %s\r\nConnection: close\r\nProxy-Connection: close\r\n\r\n", 
-			method, path, hostname, port, user_agent_hdr);
+	if (since == 0 && *nread > 0) {
+		since = stats_now_us();   // pipelined: it began with the last one's end
+	}
+
+	// the parser picks up where it left off, so each byte is scanned once.
+	// A keep-alive client gets KEEPALIVE_TIMEOUT to start its next request
+	// and then HEADER_TIMEOUT from its first byte to finish the headers,
+	// however it spaces out the bytes, so a slowloris client cannot pin
+	// the worker.
+	http_req_init(&rq);
+	while ((s = http_req_parse(&rq, buf, *nread)) == 0) {
+		if (*nread == REQ_BUF_SIZE) {
+			stats_count(STAT_BAD_REQUESTS);
+			refuse_oversized(nsfd, &rq);
+			return 0;
+		}
+		if (*nread == 0 && !wait_readable(nsfd, start + KEEPALIVE_TIMEOUT * 1000)) {
+			stats_count(STAT_TIMEOUT_IDLE);
+			return 0;
+		}
+		if (since == 0) {
+			since = stats_now_us();
+		}
+		if (head_start == 0) {
+			head_start = now_ms();
+		}
+		if (!wait_readable(nsfd, head_start + HEADER_TIMEOUT * 1000)) {
+			stats_count(STAT_TIMEOUT_HEADER);
+			return 0;
 		}
-		else {
-			sprintf(newReq, "%s %s HTTP/1.0\r\nHost: %s\r\nUser-Agent: %s\r\nConnection: close\r\nProxy-Connection: close\r\n\r\n", 
-			method, path, hostname, user_agent_hdr);
+		ssize_t tmp = recv(nsfd, &buf[*nread], REQ_BUF_SIZE - *nread, 0);
+		if (tmp <= 0) {
+			return 0;
 		}
-		printf("%s", newReq);
+		*nread += tmp;
+	}
+	if (s < 0) {
+		stats_count(STAT_BAD_REQUESTS);
+		return 0;
+	}
+	stats_count(STAT_REQUESTS);
+	req_start = since;
+	first_byte_sent = 0;
+	logged = verbose && alog_sampled();
+	if (logged) {
+		snprintf(line, sizeof(line), "%.*s %.*s", (int)rq.method.len, buf + rq.method.off,
+				(int)rq.uri.len, buf + rq.uri.off);
+	}
+
+	http_resp_init(&resp, HTTP_STR_IS(buf, rq.method, "HEAD"));
+	if (HTTP_STR_IS(buf, rq.method, "CONNECT")) {
+		// a tunnel would hold its worker for as long as it stays open;
+		// the event-driven proxy relays them instead
+		static const char refuse[] = "HTTP/1.1 501 Not Implemented\r\n"
+			"Content-Length: 0\r\n"
+			"Connection: close\r\n\r\n";
+		first_byte();
+		write_all(nsfd, refuse, sizeof(refuse) - 1);
+		resp.status = 501;
+		s = 0;
+	} else if (is_stats_request(buf, &rq, &json)) {
+		memmove(buf, buf + rq.hdr_len, *nread - rq.hdr_len);
+		*nread -= rq.hdr_len;
+		s = serve_stats(nsfd, json, rq.keep_alive);
+		resp.status = 200;
+	} else if (buf[rq.uri.off] == '/') {
+		// any other origin-form target names a resource on the proxy
+		// itself; taking its origin from Host would only loop back here
+		static const char refuse[] = "HTTP/1.1 400 Bad Request\r\n"
+			"Content-Length: 0\r\n"
+			"Connection: close\r\n\r\n";
+		stats_count(STAT_BAD_REQUESTS);
+		first_byte();
+		write_all(nsfd, refuse, sizeof(refuse) - 1);
+		resp.status = 400;
+		s = 0;
 	} else {
-		printf("REQUEST INCOMPLETE\n");
-		close(nsfd);
-		return;
+		s = forward_request(nsfd, buf, nread, &rq, &resp, start + REQUEST_TIMEOUT * 1000);
+	}
+	stats_record(STAT_TOTAL, stats_now_us() - since);
+	if (logged) {
+		log_request(line, resp.status);
 	}
+	return s;
+}
 
-	int ssfd, s;
-	struct addrinfo hints;
-	struct addrinfo *result, *rp;
-	memset(&hints, 0, sizeof(struct addrinfo));
+/*
+ * Relay the request rq, parsed from the front of buf, to its origin, or
+ * answer it from the cache, writing the response to nsfd and tracking its
+ * framing in resp.  Gives up once the CLOCK_MONOTONIC millisecond deadline
+ * passes.  Returns as serve_request() does.
+ */
+int forward_request(int nsfd, char *buf, size_t *nread, http_req_t *rq, http_resp_t *resp,
+		long long deadline) {
+	int s;
 
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_protocol = 0;
-	hints.ai_flags = 0;
+	// the resolver and pool want strings; everything else stays in buf
+	char hostname[NI_MAXHOST], port[NI_MAXSERV];
+	char newReq[REQ_BUF_SIZE + 1024], key[REQ_BUF_SIZE + NI_MAXHOST + NI_MAXSERV];
+	char framing[64] = "";
+	if (rq->host.len >= sizeof(hostname) || rq->port.len >= sizeof(port)) {
+		return 0;
+	}
+	memcpy(hostname, buf + rq->host.off, rq->host.len);
+	hostname[rq->host.len] = '\0';
+	if (rq->port.len > 0) {
+		memcpy(port, buf + rq->port.off, rq->port.len);
+		port[rq->port.len] = '\0';
+	} else {
+		strcpy(port, "80"); // default port
+	}
+	int pathlen = rq->path.len > 0 ? rq->path.len : 1;
+	const char *path = rq->path.len > 0 ? buf + rq->path.off : "/";
+	int has_body = rq->chunked || rq->content_length > 0;
+	// a response to a request with credentials is not for sharing (RFC
+	// 9111 section 3.5)
+	int cacheable = HTTP_STR_IS(buf, rq->method, "GET") && !has_body &&
+		!rq->authorization;
+	if (rq->chunked) {
+		strcpy(framing, "Transfer-Encoding: chunked\r\n");
+	} else if (rq->content_length > 0) {
+		sprintf(framing, "Content-Length: %lld\r\n", rq->content_length);
+	}
+	// the blank line goes on once any conditional headers are known
+	int port80 = strcmp(port, "80") == 0;
+	size_t reqlen = snprintf(newReq, sizeof(newReq), "%.*s %.*s HTTP/1.1\r\nHost: %s%s%s\r\nUser-Agent: %s\r\nConnection: keep-alive\r\n",
+			(int)rq->method.len, buf + rq->method.off, pathlen, path,
+			hostname, port80 ? "" : ":", port80 ? "" : port,
+			user_agent_hdr);
+	// then the client's own headers, less the ones written here; they
+	// were read into REQ_BUF_SIZE, so they fit unless the host is long
+	const char *line = buf + rq->headers.off, *end = line + rq->headers.len, *eol;
+	if (reqlen >= sizeof(newReq)) {
+		reqlen = sizeof(newReq) - 1;    // truncated, as it always was
+	}
+	for (; line < end; line = eol + 1) {
+		eol = memchr(line, '\n', end - line);  // every header line has one
+		size_t n = eol > line && eol[-1] == '\r' ? eol - 1 - line : eol - line;
+		if (forwards_header(line, eol, cacheable) &&
+				reqlen + n + 2 + strlen(framing) < sizeof(newReq)) {
+			memcpy(newReq + reqlen, line, n);
+			memcpy(newReq + reqlen + n, "\r\n", 2);
+			reqlen += n + 2;
+		}
+	}
+	snprintf(newReq + reqlen, sizeof(newReq) - reqlen, "%s", framing);
+	snprintf(key, sizeof(key), "%s:%s%.*s", hostname, port, pathlen, path);
 
-	s = getaddrinfo(hostname, port, &hints, &result);
-	if (s != 0) {
-		fprintf(stderr, "getaddrinfo error\n");
-		exit(1);
+	// a single byte range may be answered from the cache; copy it out
+	// now, since buf is about to move on
+	range_t rbuf, *range = NULL;
+	if (cacheable && rq->range.len > 0 &&
+			rq->if_range.len < sizeof(rbuf.if_range) &&
+			http_range_parse(buf + rq->range.off, rq->range.len,
+				&rbuf.first, &rbuf.last) == 0) {
+		memcpy(rbuf.if_range, buf + rq->if_range.off, rq->if_range.len);
+		rbuf.if_range[rq->if_range.len] = '\0';
+		range = &rbuf;
 	}
-	if (true == true) {
-				//test
+
+	// a request with a body is consumed as the body is relayed
+	if (!has_body) {
+		memmove(buf, buf + rq->hdr_len, *nread - rq->hdr_len);
+		*nread -= rq->hdr_len;
+	}
+
+	// serve repeat GETs straight from the cache; a miss on a key that
+	// another request is already fetching waits for that fetch and then
+	// looks again, so a burst of misses reaches the origin once.  A stale
+	// entry counts as a miss, but if it has a validator the origin is
+	// only asked whether it has changed.  A range of an object that is
+	// not cached whole comes from its slices, if the origin does ranges.
+	flight_t *f = NULL;
+	cache_obj_t *stale = NULL;
+	if (cacheable) {
+		if ((s = serve_cached(nsfd, key, range, resp, &stale)) >= 0) {
+			return s && rq->keep_alive && resp->state == HTTP_DONE;
+		}
+		if (range != NULL && (s = serve_slices(nsfd, hostname, port, newReq, key,
+						range, resp, deadline)) >= 0) {
+			if (stale != NULL) {
+				cache_release(&cache, stale);
 			}
-	for (rp = result; rp != NULL; rp = rp->ai_next) {
+			return s && rq->keep_alive && resp->state == HTTP_DONE;
+		}
+		stats_count(STAT_CACHE_MISSES);
+		int leader;
+		f = flight_join(&flights, key, &leader);
+		if (!leader) {
+			stats_count(STAT_COALESCED);
+			if (stale != NULL) {
+				cache_release(&cache, stale);
+				stale = NULL;
+			}
+			flight_wait(&flights, f);
+			flight_release(&flights, f);
+			f = NULL;
+			if ((s = serve_cached(nsfd, key, range, resp, &stale)) >= 0) {
+				return s && rq->keep_alive && resp->state == HTTP_DONE;
+			}
+		}
+	}
+
+	size_t head_len = strlen(newReq);
+	reqlen = head_len;
+	if (stale != NULL) {
+		http_cache_info_t ci;
+		http_cache_info(stale->data, stale->len, &ci);
+		if (ci.etag.len > 0) {
+			reqlen += snprintf(newReq + reqlen, sizeof(newReq) - reqlen,
+					"If-None-Match: %.*s\r\n",
+					(int)ci.etag.len, stale->data + ci.etag.off);
+		}
+		if (ci.last_modified.len > 0 && reqlen < sizeof(newReq)) {
+			reqlen += snprintf(newReq + reqlen, sizeof(newReq) - reqlen,
+					"If-Modified-Since: %.*s\r\n",
+					(int)ci.last_modified.len, stale->data + ci.last_modified.off);
+		}
+	}
+	if (reqlen + 3 > sizeof(newReq)) {
+		reqlen = head_len;      // validators too long: ask for it outright
+	}
+	strcpy(newReq + reqlen, "\r\n");
+
+	// a pooled connection may have been closed by the origin just as it
+	// was taken; if so, nothing has reached the client yet, so try once
+	// more on a fresh connection (unless a body has already been sent)
+	int ssfd = pool_get(&pool, hostname, port);
+	int reused = ssfd >= 0;
+	int status = RESP_NONE;
+	if (reused) {
+		stats_count(STAT_ORIGIN_REUSED);
+	} else {
+		ssfd = connect_origin(hostname, port);
+	}
+	while (ssfd >= 0) {
+		if (write_all(ssfd, newReq, strlen(newReq)) == 0) {
+			if (has_body && relay_request_body(nsfd, ssfd, buf, rq, nread,
+						deadline) < 0) {
+				break;
+			}
+			status = relay_response(ssfd, nsfd, f, stale, range, resp,
+					deadline);
+		}
+		if (status != RESP_NONE || !reused || has_body) {
+			break;
+		}
+		close(ssfd);
+		ssfd = connect_origin(hostname, port);
+		reused = 0;
+	}
+	if (f != NULL) {
+		flight_finish(&flights, f);
+		flight_release(&flights, f);
+	}
+	if (stale != NULL) {
+		cache_release(&cache, stale);
+	}
+	if (status == RESP_REUSE) {
+		pool_put(&pool, hostname, port, ssfd);
+	} else if (ssfd >= 0) {
+		close(ssfd);
+	}
+	return status != RESP_NONE && rq->keep_alive && resp->state == HTTP_DONE;
+}
+
+/*
+ * Forward the body of the request rq, whose headers are at the front of
+ * buf, to ssfd.
+ * Body bytes already in buf go first, then the rest is read from nsfd.
+ * Whatever follows the body is left at the front of buf, with *nread
+ * updated to match.  Returns 0 on success, -1 if either side fails, the
+ * body is malformed, or the CLOCK_MONOTONIC millisecond deadline passes.
+ */
+int relay_request_body(int nsfd, int ssfd, char *buf, const http_req_t *rq, size_t *nread,
+		long long deadline) {
+	http_resp_t body;
+	size_t start = rq->hdr_len;
+	ssize_t n, used;
+
+	http_body_init(&body, rq->content_length, rq->chunked);
+	while (1) {
+		if ((used = http_resp_feed(&body, buf + start, *nread - start)) < 0 ||
+				write_all(ssfd, buf + start, used) < 0) {
+			return -1;
+		}
+		start += used;
+		if (body.state == HTTP_DONE) {
+			break;
+		}
+		// all of buf has been sent on, so it can take the next read
+		if (now_ms() >= deadline) {
+			stats_count(STAT_TIMEOUT_REQUEST);
+			return -1;
+		}
+		if ((n = recv(nsfd, buf, REQ_BUF_SIZE, 0)) <= 0) {
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				stats_count(STAT_TIMEOUT_IDLE);
+			}
+			return -1;
+		}
+		start = 0;
+		*nread = n;
+	}
+	memmove(buf, buf + start, *nread - start);
+	*nread -= start;
+	return 0;
+}
+
+/* Open a new connection to hostname:port.  Returns the socket, or -1. */
+int connect_origin(const char *hostname, const char *port) {
+	int ssfd = -1;
+	struct addrinfo *rp;
+	long long begun = stats_now_us();
+	resolver_entry_t *origin = resolver_lookup(hostname, port);
+	if (origin == NULL || origin->ai == NULL) {
+		stats_count(STAT_ORIGIN_ERRORS);
+		fprintf(stderr, "getaddrinfo: %s\n",
+				origin ? gai_strerror(origin->err) : "out of memory");
+		if (origin != NULL) {
+			resolver_release(origin);
+		}
+		return -1;
+	}
+	for (rp = origin->ai; rp != NULL; rp = rp->ai_next) {
 		ssfd = socket(rp->ai_family, rp->ai_socktype,
 				rp->ai_protocol);
 		if (ssfd == -1)
 			continue;
 
-		if (connect(ssfd, rp->ai_addr, rp->ai_addrlen) != -1)
+		if (connect(ssfd, rp->ai_addr, rp->ai_addrlen) != -1) {
+			// nor may an origin that stops answering
+			struct timeval tv = { IDLE_TIMEOUT, 0 };
+			setsockopt(ssfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+			setsockopt(ssfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
 			break;  /* Success */
+		}
 
 		close(ssfd);
+		ssfd = -1;
 	}
+	resolver_release(origin);
+	if (ssfd < 0) {
+		stats_count(STAT_ORIGIN_ERRORS);
+		return -1;
+	}
+	stats_count(STAT_ORIGIN_CONNECTS);
+	stats_record(STAT_CONNECT, stats_now_us() - begun);
+	return ssfd;
+}
+
+/*
+ * Write the cached response for key, if there is a fresh one, to nsfd, or
+ * for a Range request (range non-NULL) as much of it as write_cached()
+ * allows.  A miss in memory is looked up on disk, and a hit there is
+ * written straight from its segment's mapping and then moved back into
+ * memory.  Returns -1 on a miss, otherwise 1 if it was written in full
+ * and 0 if not.
+ *
+ * A stale entry is a miss; if it has a validator and stale is non-NULL,
+ * it is handed back in *stale, with a reference held, for revalidation.
+ */
+int serve_cached(int nsfd, const char *key, const range_t *range, http_resp_t *resp,
+		cache_obj_t **stale) {
+	int s;
+	http_cache_info_t ci;
+	time_t now = time(NULL);
+	cache_obj_t *obj = cache_lookup(&cache, key);
 
-	write(ssfd, newReq, BUF_SIZE);
-	char sBuf[BUF_SIZE];
-	nread = 0;
-	for (;;) {
-		int tmp = 0;
-		tmp = recv(ssfd, &sBuf[nread], BUF_SIZE, 0);
-		nread += tmp;
-		
-		if (tmp == 0) {
+	disk_obj_t dobj;
+	if (obj == NULL && disk_tier && disk_lookup(&disk, key, &dobj)) {
+		// the stored Date says how long it has really been
+		http_cache_info(dobj.data, dobj.len, &ci);
+		time_t expires = expiry(&ci, NULL);
+		if (now >= expires) {
+			cache_insert(&cache, key, dobj.data, dobj.len, expires);
+			disk_release(&disk, &dobj);
+			obj = cache_lookup(&cache, key);
+		} else {
+			stats_count(STAT_DISK_HITS);
+			s = write_cached(nsfd, dobj.data, dobj.len, range, resp) == 0;
+			cache_insert(&cache, key, dobj.data, dobj.len, expires);
+			disk_release(&disk, &dobj);
+			return s;
+		}
+	}
+	if (obj == NULL) {
+		return -1;
+	}
+
+	if (!cache_is_fresh(obj, now)) {
+		http_cache_info(obj->data, obj->len, &ci);
+		if (stale != NULL && (ci.etag.len > 0 || ci.last_modified.len > 0)) {
+			*stale = obj;
+		} else {
+			cache_release(&cache, obj);
+		}
+		return -1;
+	}
+	stats_count(STAT_CACHE_HITS);
+	s = write_cached(nsfd, obj->data, obj->len, range, resp) == 0;
+	cache_release(&cache, obj);
+	return s;
+}
+
+/*
+ * Write the stored response data (len bytes) to nsfd, running it past the
+ * framing check in resp, as a relayed response would be.  For a Range
+ * request on a stored 200 whose length is known, only the range goes out,
+ * as a 206 (or a 416, if it starts past the end)--unless If-Range says the
+ * stored copy is not the one the client holds part of.  Returns 0, or -1
+ * if the client could not be written to.
+ */
+int write_cached(int nsfd, const char *data, size_t len, const range_t *range,
+		http_resp_t *resp) {
+	http_resp_t stored;
+	long long first, last;
+	int s;
+
+	// a body of Content-Length bytes is the one kind a range can index
+	if (range != NULL) {
+		http_resp_init(&stored, 0);
+		http_resp_feed(&stored, data, len);
+	}
+	if (range == NULL || stored.status != 200 || stored.content_length < 0 ||
+			stored.hdr_len + stored.content_length != len ||
+			!if_range_holds(range->if_range, data, stored.hdr_len)) {
+		http_resp_feed(resp, data, len);
+		first_byte();
+		return write_all(nsfd, data, len);
+	}
+	stats_count(STAT_RANGE_HITS);
+	first = range->first;
+	last = range->last;
+	if ((s = write_partial_head(nsfd, data, stored.hdr_len, &first, &last,
+					stored.content_length, resp)) <= 0) {
+		return s;
+	}
+	http_resp_advance(resp, last - first + 1);
+	return write_all(nsfd, data + stored.hdr_len + first, last - first + 1);
+}
+
+/*
+ * Start the response to a Range request for bytes *first..*last of a
+ * size-byte object, resolving the range against size: a 206 carrying the
+ * stored headers hdr (hdr_len bytes, of a 200 or of a slice's 206) less
+ * their framing, or a 416 if none of the range exists.  resp tracks its
+ * framing.  Returns 1 if the range's bytes are to follow, 0 if not (the
+ * 416), or -1 if the client could not be written to.
+ */
+int write_partial_head(int nsfd, const char *hdr, size_t hdr_len, long long *first,
+		long long *last, long long size, http_resp_t *resp) {
+	char out[HTTP_MAX_HEADERS + 256];
+	const char *line, *eol, *end = hdr + hdr_len - 2;
+	size_t n;
+
+	if (http_range_resolve(first, last, size) < 0) {
+		n = snprintf(out, sizeof(out), "HTTP/1.1 416 Range Not Satisfiable\r\n"
+				"Content-Range: bytes */%lld\r\nContent-Length: 0\r\n\r\n", size);
+	} else {
+		n = snprintf(out, sizeof(out), "HTTP/1.1 206 Partial Content\r\n");
+		for (line = memchr(hdr, '\n', hdr_len) + 1; line < end; line = eol + 1) {
+			eol = memchr(line, '\n', end - line);
+			if (strncasecmp(line, "Content-Length:", 15) == 0 ||
+					strncasecmp(line, "Content-Range:", 14) == 0 ||
+					strncasecmp(line, "Transfer-Encoding:", 18) == 0 ||
+					n + (eol + 1 - line) > sizeof(out) - 128) {
+				continue;
+			}
+			memcpy(out + n, line, eol + 1 - line);
+			n += eol + 1 - line;
+		}
+		n += snprintf(out + n, sizeof(out) - n, "Content-Range: bytes %lld-%lld/%lld\r\n"
+				"Content-Length: %lld\r\n\r\n", *first, *last, size, *last - *first + 1);
+	}
+	http_resp_feed(resp, out, n);
+	first_byte();
+	if (write_all(nsfd, out, n) < 0) {
+		return -1;
+	}
+	return resp->state != HTTP_DONE;
+}
+
+/*
+ * Does the If-Range value ifr (empty if there was none) name the stored
+ * response with headers hdr?  Only a strong ETag or the exact
+ * Last-Modified date does (RFC 9110 section 13.1.5).
+ */
+int if_range_holds(const char *ifr, const char *hdr, size_t hdr_len) {
+	http_cache_info_t ci;
+	size_t n = strlen(ifr);
+
+	if (n == 0) {
+		return 1;
+	}
+	http_cache_info(hdr, hdr_len, &ci);
+	if (ifr[0] == '"') {
+		return ci.etag.len == n && memcmp(hdr + ci.etag.off, ifr, n) == 0;
+	}
+	return ci.last_modified.len == n && memcmp(hdr + ci.last_modified.off, ifr, n) == 0;
+}
+
+/*
+ * Answer the Range request range for the object at key from its slices
+ * (see get_slice()), so that an object too large to cache whole is still
+ * cached, a slice at a time, and a client resuming a download of it gets
+ * the bytes the proxy already holds without the origin sending them
+ * again.  The client gets a single 206 with the first slice's headers;
+ * every later slice must be of the same size and carry the same ETag, or
+ * the object has changed underneath and the response is cut short.
+ *
+ * Returns -1, having written nothing, if the first slice cannot be had as
+ * a 206 (the origin ignores ranges, or the object is gone) or If-Range
+ * rules it out, so the caller can fetch the object whole; otherwise as
+ * serve_cached().
+ */
+int serve_slices(int nsfd, const char *hostname, const char *port, const char *head,
+		const char *key, const range_t *range, http_resp_t *resp, long long deadline) {
+	long long first = range->first, last = range->last, size, i, from, to;
+	http_cache_info_t ci;
+	char etag[256] = "";
+	slice_t sl;
+	int s;
+
+	// a suffix range needs the size first, which any slice gives
+	if (get_slice(hostname, port, head, key, first >= 0 ? first / SLICE_SIZE : 0,
+				&sl, deadline) < 0) {
+		return -1;
+	}
+	if (!if_range_holds(range->if_range, sl.data, sl.hdr_len)) {
+		put_slice(&sl);
+		return -1;
+	}
+	size = sl.size;
+	http_cache_info(sl.data, sl.hdr_len, &ci);
+	if (ci.etag.len < sizeof(etag)) {
+		memcpy(etag, sl.data + ci.etag.off, ci.etag.len);
+	}
+	if ((s = write_partial_head(nsfd, sl.data, sl.hdr_len, &first, &last, size,
+					resp)) <= 0) {
+		put_slice(&sl);
+		return s == 0;
+	}
+
+	for (i = first / SLICE_SIZE; i <= last / SLICE_SIZE; i++) {
+		if (sl.first != i * SLICE_SIZE) {
+			put_slice(&sl);
+			if (get_slice(hostname, port, head, key, i, &sl, deadline) < 0) {
+				return 0;
+			}
+			http_cache_info(sl.data, sl.hdr_len, &ci);
+			if (sl.size != size || ci.etag.len != strlen(etag) ||
+					memcmp(sl.data + ci.etag.off, etag, ci.etag.len) != 0) {
+				put_slice(&sl);
+				return 0;
+			}
+		}
+		from = first > sl.first ? first : sl.first;
+		to = last < sl.last ? last : sl.last;
+		if (write_all(nsfd, sl.data + sl.hdr_len + (from - sl.first), to - from + 1) < 0) {
+			put_slice(&sl);
+			return 0;
+		}
+		http_resp_advance(resp, to - from + 1);
+	}
+	put_slice(&sl);
+	return 1;
+}
+
+/*
+ * Get slice i of the object at key: bytes i * SLICE_SIZE on, up to
+ * SLICE_SIZE of them, as the origin's 206 for them.  It comes from the
+ * cache, under "key#slice=i" (a fragment is never sent, so no URL's key
+ * has a '#'), if it is there and fresh; otherwise it is fetched with the
+ * request head, which has no blank line yet, plus a Range, and cached if
+ * the origin allows.  Misses on one slice are coalesced, as for whole
+ * objects.  Returns 0, or -1 if there is no such 206 to be had.
+ */
+int get_slice(const char *hostname, const char *port, const char *head, const char *key,
+		long long i, slice_t *sl, long long deadline) {
+	char skey[REQ_BUF_SIZE + NI_MAXHOST + NI_MAXSERV + 32];
+	const char *end;
+	http_cache_info_t ci;
+	flight_t *f = NULL;
+	size_t len = 0;
+	int leader, minor, status = 0;
+
+	memset(sl, 0, sizeof(slice_t));
+	snprintf(skey, sizeof(skey), "%s#slice=%lld", key, i);
+	if ((sl->obj = lookup_fresh(skey)) == NULL) {
+		f = flight_join(&flights, skey, &leader);
+		if (!leader) {
+			stats_count(STAT_COALESCED);
+			flight_wait(&flights, f);
+			flight_release(&flights, f);
+			f = NULL;
+			sl->obj = lookup_fresh(skey);
+		}
+	}
+	if (sl->obj != NULL) {
+		stats_count(STAT_SLICE_HITS);
+		sl->data = sl->obj->data;
+		len = sl->obj->len;
+	} else {
+		stats_count(STAT_SLICE_FETCHES);
+		sl->data = sl->own = fetch_slice(hostname, port, head, i * SLICE_SIZE, &len,
+				deadline);
+	}
+
+	// it must be the 206 for this slice, with nothing missing
+	if (sl->data != NULL && (end = memmem(sl->data, len, "\r\n\r\n", 4)) != NULL) {
+		sl->hdr_len = end + 4 - sl->data;
+		sscanf(sl->data, "HTTP/1.%d %d", &minor, &status);
+	}
+	if (status != 206 || http_content_range(sl->data, sl->hdr_len, &sl->first,
+				&sl->last, &sl->size) < 0 || sl->first != i * SLICE_SIZE ||
+			sl->last - sl->first + 1 != len - sl->hdr_len) {
+		put_slice(sl);
+		sl->data = NULL;
+	} else if (sl->own != NULL) {
+		http_cache_info(sl->data, sl->hdr_len, &ci);
+		if (!ci.no_store) {
+			cache_insert(&cache, skey, sl->data, len, expiry(&ci, NULL));
+		}
+	}
+	if (f != NULL) {
+		flight_finish(&flights, f);
+		flight_release(&flights, f);
+	}
+	return sl->data != NULL ? 0 : -1;
+}
+
+/* Let go of a slice from get_slice() */
+void put_slice(slice_t *sl) {
+	if (sl->obj != NULL) {
+		cache_release(&cache, sl->obj);
+	}
+	free(sl->own);
+	sl->obj = NULL;
+	sl->own = NULL;
+}
+
+/*
+ * The fresh cached copy of key, with a reference held: from memory, or
+ * else from disk, moving it back into memory.  NULL if there is none.
+ */
+cache_obj_t *lookup_fresh(const char *key) {
+	cache_obj_t *obj = cache_lookup(&cache, key);
+	http_cache_info_t ci;
+	disk_obj_t dobj;
+
+	if (obj == NULL && disk_tier && disk_lookup(&disk, key, &dobj)) {
+		http_cache_info(dobj.data, dobj.len, &ci);
+		cache_insert(&cache, key, dobj.data, dobj.len, expiry(&ci, NULL));
+		disk_release(&disk, &dobj);
+		obj = cache_lookup(&cache, key);
+	}
+	if (obj != NULL && !cache_is_fresh(obj, time(NULL))) {
+		cache_release(&cache, obj);
+		obj = NULL;
+	}
+	return obj;
+}
+
+/*
+ * Fetch bytes from..from + SLICE_SIZE - 1 of the object at the request
+ * head from its origin, over a pooled connection if there is one, as
+ * forward_request() does.  Returns the origin's 206, headers and body,
+ * malloc'd, with its length in *len; or NULL if it sent anything else,
+ * in which case reading stops as soon as the status line shows it.
+ */
+char *fetch_slice(const char *hostname, const char *port, const char *head, long long from,
+		size_t *len, long long deadline) {
+	char req[REQ_BUF_SIZE + 1024 + 64];
+	size_t cap = SLICE_SIZE + HTTP_MAX_HEADERS;
+	char *buf = malloc(cap);
+	http_resp_t hr;
+	ssize_t n, used;
+	int ssfd, reused, leftover = 0;
+
+	if (buf == NULL || snprintf(req, sizeof(req), "%sRange: bytes=%lld-%lld\r\n\r\n",
+				head, from, from + SLICE_SIZE - 1) >= sizeof(req)) {
+		free(buf);
+		return NULL;
+	}
+	http_resp_init(&hr, 0);
+	ssfd = pool_get(&pool, hostname, port);
+	reused = ssfd >= 0;
+	if (reused) {
+		stats_count(STAT_ORIGIN_REUSED);
+	} else {
+		ssfd = connect_origin(hostname, port);
+	}
+	while (ssfd >= 0) {
+		*len = 0;
+		http_resp_init(&hr, 0);
+		if (write_all(ssfd, req, strlen(req)) == 0) {
+			while (hr.state != HTTP_DONE &&
+					(hr.state == HTTP_HEADERS || hr.status == 206) &&
+					*len < cap && now_ms() < deadline &&
+					(n = recv(ssfd, buf + *len, cap - *len, 0)) > 0) {
+				if ((used = http_resp_feed(&hr, buf + *len, n)) < 0) {
+					break;
+				}
+				leftover = used < n;
+				*len += used;
+			}
+		}
+		if (*len > 0 || !reused) {
 			break;
 		}
+		close(ssfd);
+		ssfd = connect_origin(hostname, port);
+		reused = 0;
+	}
+	if (ssfd >= 0 && hr.state == HTTP_DONE && hr.keep_alive && !leftover) {
+		pool_put(&pool, hostname, port, ssfd);
+	} else if (ssfd >= 0) {
+		close(ssfd);
+	}
+	if (hr.state != HTTP_DONE || hr.status != 206) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+/*
+ * May a response with this status be stored without a freshness lifetime
+ * of its own?  Only those a cache may reuse without being told to (RFC
+ * 9110 section 15.1); an error page is the origin's answer for now, not
+ * for the next request, unless it says how long it holds.
+ */
+int cacheable_status(int status) {
+	switch (status) {
+	case 200: case 203: case 204: case 206: case 300: case 301: case 308:
+	case 404: case 405: case 410: case 414: case 501:
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * When a response with the caching headers ci goes stale: its Date (or
+ * now, without one) plus its freshness lifetime.  For a 304, old is the
+ * stored response it revalidated, whose lifetime stands unless the 304
+ * gives a new one.  A response that gives none gets DEFAULT_FRESHNESS;
+ * only those with a cacheable_status() are ever stored without one.
+ */
+time_t expiry(const http_cache_info_t *ci, const http_cache_info_t *old) {
+	long long lifetime = ci->lifetime;
+	if (lifetime < 0 && old != NULL) {
+		lifetime = old->lifetime;
+	}
+	if (lifetime < 0) {
+		lifetime = DEFAULT_FRESHNESS;
+	}
+	time_t expires = (ci->date ? ci->date : time(NULL)) + lifetime;
+	return expires > 0 ? expires : 1;   // 0 would mean never stale
+}
+
+/*
+ * Is the header line at line (ending at eol, its '\n') one that a 304 may
+ * update in a stored response?  Not the ones that frame the stored body,
+ * nor the ones that only concern a single connection (RFC 9111 sections
+ * 3.1 and 4.3.4).
+ */
+int is_end_to_end(const char *line, const char *eol) {
+	static const char *skip[] = { "Content-Length:", "Content-Range:",
+		"Transfer-Encoding:", "Connection:", "Keep-Alive:" };
+	int i;
+
+	for (i = 0; i < sizeof(skip) / sizeof(skip[0]); i++) {
+		if (eol - line > strlen(skip[i]) &&
+				strncasecmp(line, skip[i], strlen(skip[i])) == 0) {
+			return 0;
+		}
 	}
+	return 1;
+}
 
-	write(nsfd, sBuf, nread + 1);
-	close(nsfd);
-	close(ssfd);
+/*
+ * Does the client's header line at line (ending at eol, its '\n') go on to
+ * the origin?  Not the ones forward_request() writes itself, nor the
+ * hop-by-hop ones (RFC 9110 section 7.6.1).  A cacheable GET fetches the
+ * whole object, unconditionally, so it drops the client's range and
+ * conditionals too; the proxy answers those itself.
+ */
+int forwards_header(const char *line, const char *eol, int cacheable) {
+	static const char *skip[] = { "Host:", "User-Agent:", "Content-Length:",
+		"Transfer-Encoding:", "Connection:", "Proxy-Connection:", "Keep-Alive:",
+		"Proxy-Authorization:", "TE:", "Trailer:", "Upgrade:",
+		// only when cacheable
+		"Range:", "If-Range:", "If-None-Match:", "If-Modified-Since:",
+		"If-Match:", "If-Unmodified-Since:" };
+	int i, n = sizeof(skip) / sizeof(skip[0]) - (cacheable ? 0 : 6);
+
+	for (i = 0; i < n; i++) {
+		if (eol - line > strlen(skip[i]) &&
+				strncasecmp(line, skip[i], strlen(skip[i])) == 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * The stored response data (len bytes), brought up to date with the
+ * headers hdr (hdr_len bytes) of the 304 that revalidated it: every field
+ * the 304 carries replaces the stored fields of that name (RFC 9111
+ * section 4.3.4), and the body stays as it was.  Returns the new response
+ * on the heap, setting *out_len, or NULL if it cannot be made.
+ */
+char *refresh_stored(const char *data, size_t len, const char *hdr, size_t hdr_len,
+		size_t *out_len) {
+	const char *end = memmem(data, len, "\r\n\r\n", 4);
+	const char *line, *eol, *l2, *e2, *colon;
+	char *out;
+	size_t n;
+
+	if (end == NULL || (out = malloc(len + hdr_len)) == NULL) {
+		return NULL;
+	}
+	// the stored status line, then each stored field the 304 leaves be
+	line = memchr(data, '\n', end - data) + 1;
+	n = line - data;
+	memcpy(out, data, n);
+	for (; line < end + 2; line = eol + 1) {
+		eol = memchr(line, '\n', end + 2 - line);
+		colon = memchr(line, ':', eol - line);
+		for (l2 = memchr(hdr, '\n', hdr_len) + 1; colon != NULL && l2 < hdr + hdr_len - 2;
+				l2 = e2 + 1) {
+			e2 = memchr(l2, '\n', hdr + hdr_len - l2);
+			if (e2 - l2 > colon - line && strncasecmp(l2, line, colon + 1 - line) == 0 &&
+					is_end_to_end(l2, e2)) {
+				break;
+			}
+		}
+		if (colon == NULL || l2 >= hdr + hdr_len - 2) {
+			memcpy(out + n, line, eol + 1 - line);
+			n += eol + 1 - line;
+		}
+	}
+	// then the 304's own, and the stored body
+	for (l2 = memchr(hdr, '\n', hdr_len) + 1; l2 < hdr + hdr_len - 2; l2 = e2 + 1) {
+		e2 = memchr(l2, '\n', hdr + hdr_len - l2);
+		if (is_end_to_end(l2, e2)) {
+			memcpy(out + n, l2, e2 + 1 - l2);
+			n += e2 + 1 - l2;
+		}
+	}
+	memcpy(out + n, "\r\n", 2);
+	n += 2;
+	memcpy(out + n, end + 4, data + len - (end + 4));
+	*out_len = n + (data + len - (end + 4));
+	return out;
+}
+
+/* cache_spill_fn for the -d tier */
+void spill_to_disk(void *arg, const char *key, const char *data, size_t len) {
+	disk_insert((disk_t *)arg, key, data, len);
+}
+
+/*
+ * Forward the origin's response on ssfd to the client on nsfd as it arrives,
+ * through a small fixed buffer, so the client sees the first byte as soon as
+ * the proxy does.  The bytes are also fed through resp, which the caller
+ * has set up with http_resp_init(), to find where the response ends
+ * (Content-Length, chunked, or the server closing); relaying stops there,
+ * so a keep-alive connection can go back to the pool and the client
+ * connection can carry another request.
+ *
+ * If f is non-NULL, the response is also collected on the heap and
+ * inserted into the cache under f->key once it is complete--unless it
+ * grows past MAX_OBJECT_SIZE, or its status or headers forbid storing it,
+ * at which point collecting stops and it is only relayed.  The flight is
+ * finished as soon as that is known, so the requests waiting on it go
+ * fetch for themselves without waiting out the rest of the body.
+ *
+ * If stale is non-NULL, the request was a conditional GET to revalidate
+ * it, so the headers are held back until the status is known.  A 304
+ * refreshes stale, taking on the 304's headers, and the client gets the
+ * refreshed copy, as write_cached() would serve a hit (so only the range,
+ * if range is non-NULL and can be served); anything else is relayed (and
+ * cached) as usual.
+ *
+ * With -z, a body that will not be cached is handed to relay_splice() as
+ * soon as its headers have been relayed, so it never enters user space.
+ * The splice stops at the end of the Content-Length, or runs to EOF for a
+ * body delimited by the server closing; chunked bodies are copied, since
+ * their end can only be found by reading them.
+ *
+ * Relaying gives up once the CLOCK_MONOTONIC millisecond deadline has
+ * passed, or when either side stalls for IDLE_TIMEOUT.
+ *
+ * Returns RESP_REUSE, RESP_CLOSE or RESP_NONE, as described above.
+ */
+int relay_response(int ssfd, int nsfd, flight_t *f, cache_obj_t *stale,
+		const range_t *range, http_resp_t *resp, long long deadline) {
+	char buf[RELAY_BUF_SIZE];
+	char *obj = NULL, *fresh;
+	size_t objlen = 0, total = 0, held, fresh_len;
+	int leftover = 0, in_headers, reuse;
+	ssize_t n = 0, used, skip;
+	long long want;
+	time_t expires = 0;
+	http_cache_info_t ci, old;
+
+	int splice_ok = zero_copy && open_relay_pipe() == 0;
+
+	if (f != NULL) {
+		obj = malloc(MAX_OBJECT_SIZE);
+	}
+	while (resp->state != HTTP_DONE) {
+		if (now_ms() >= deadline) {
+			stats_count(STAT_TIMEOUT_REQUEST);
+			free(obj);
+			return RESP_CLOSE;
+		}
+		// a body that is not being stored is spliced a pipeful at a
+		// time, so the deadline is checked between pipefuls as it is
+		// between reads below; a shorter pipeful means the origin closed
+		if (splice_ok && obj == NULL && (resp->state == HTTP_BODY_LENGTH ||
+					resp->state == HTTP_BODY_CLOSE)) {
+			want = RELAY_PIPE_SIZE;
+			if (resp->state == HTTP_BODY_LENGTH && resp->remaining < want) {
+				want = resp->remaining;
+			}
+			if ((n = relay_splice(ssfd, nsfd, relay_pipe, want)) < want) {
+				return RESP_CLOSE;
+			}
+			if (resp->state == HTTP_BODY_LENGTH) {
+				http_resp_advance(resp, n);
+			}
+			continue;
+		}
+		if ((n = recv(ssfd, buf, sizeof(buf), 0)) <= 0) {
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				stats_count(STAT_TIMEOUT_IDLE);
+			}
+			break;
+		}
+		total += n;
+		in_headers = resp->state == HTTP_HEADERS;
+		held = in_headers ? resp->hdr_len : 0;
+		if ((used = http_resp_feed(resp, buf, n)) < 0) {
+			// not HTTP we understand; pass it through untouched
+			free(obj);
+			first_byte();
+			if ((stale == NULL || write_all(nsfd, resp->hdr, held) == 0) &&
+					write_all(nsfd, buf, n) == 0) {
+				relay_copy(ssfd, nsfd);
+			}
+			return RESP_CLOSE;
+		}
+		leftover = used < n;
+
+		skip = 0;
+		if (in_headers && resp->state != HTTP_HEADERS) {
+			http_cache_info(resp->hdr, resp->hdr_len, &ci);
+			if (stale != NULL && resp->status == 304) {
+				// the stored copy, with the 304's headers, goes out
+				// as a hit would, so resp tracks its framing now
+				reuse = resp->keep_alive && !leftover;
+				http_cache_info(stale->data, stale->len, &old);
+				expires = expiry(&ci, &old);
+				stats_count(STAT_REVALIDATED);
+				free(obj);
+				fresh = refresh_stored(stale->data, stale->len, resp->hdr,
+						resp->hdr_len, &fresh_len);
+				if (fresh != NULL) {
+					cache_insert(&cache, stale->key, fresh, fresh_len, expires);
+				} else {
+					cache_refresh(&cache, stale, expires);
+				}
+				http_resp_init(resp, 0);
+				if (write_cached(nsfd, fresh != NULL ? fresh : stale->data,
+							fresh != NULL ? fresh_len : stale->len, range, resp) < 0) {
+					reuse = 0;
+				}
+				free(fresh);
+				return reuse ? RESP_REUSE : RESP_CLOSE;
+			}
+			expires = expiry(&ci, NULL);
+			// without a lifetime of its own, only a status that may be
+			// reused by default is stored (and gets DEFAULT_FRESHNESS)
+			if (obj != NULL && (ci.no_store ||
+						(!cacheable_status(resp->status) && ci.lifetime < 0))) {
+				free(obj);
+				obj = NULL;
+				flight_finish(&flights, f);
+			}
+			// release what was held back, then the rest of this read
+			if (stale != NULL) {
+				first_byte();
+				if (write_all(nsfd, resp->hdr, resp->hdr_len) < 0) {
+					free(obj);
+					return RESP_CLOSE;
+				}
+				skip = resp->hdr_len - held;
+			}
+		} else if (in_headers && stale != NULL) {
+			skip = used;
+		}
+
+		if (obj != NULL) {
+			if (objlen + used <= MAX_OBJECT_SIZE &&
+					resp->content_length <= MAX_OBJECT_SIZE) {
+				memcpy(obj + objlen, buf, used);
+				objlen += used;
+			} else {
+				free(obj);
+				obj = NULL;
+				flight_finish(&flights, f);
+			}
+		}
+		if (used > skip) {
+			first_byte();
+		}
+		if (write_all(nsfd, buf + skip, used - skip) < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				stats_count(STAT_TIMEOUT_IDLE);
+			}
+			free(obj);
+			return RESP_CLOSE;
+		}
+	}
+
+	if (total == 0 && n <= 0) {
+		free(obj);
+		return RESP_NONE;
+	}
+
+	// a response is complete once its framing says so, or, if only the
+	// server closing delimits it, once that happens
+	int complete = resp->state == HTTP_DONE ||
+		(resp->state == HTTP_BODY_CLOSE && n == 0);
+	if (obj != NULL && complete) {
+		cache_insert(&cache, f->key, obj, objlen, expires);
+	}
+	free(obj);
+
+	// bytes past the end of the response mean the origin is confused
+	if (resp->state == HTTP_DONE && resp->keep_alive && !leftover) {
+		return RESP_REUSE;
+	}
+	return RESP_CLOSE;
 }
 
 void print_bytes(unsigned char *bytes, int byteslen) {
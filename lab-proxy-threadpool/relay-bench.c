@@ -0,0 +1,118 @@
+/*
+ * relay-bench.c - compare the CPU cost of relaying bytes between two TCP
+ * sockets with relay_copy() (recv()/write() through a user buffer) and
+ * relay_splice() (splice() through a pipe).  A sender thread pushes the
+ * data over loopback, the relay thread forwards it to a second connection,
+ * and a sink thread drains that.  Only the relay thread's CPU time is
+ * counted, which is what a proxy worker pays.
+ *
+ * usage: ./relay-bench [megabytes]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "relay.h"
+
+size_t total_bytes;
+
+/* Return a connected pair of loopback TCP sockets in fds */
+void tcp_pair(int fds[2]) {
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	int lfd = socket(AF_INET, SOCK_STREAM, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	bind(lfd, (struct sockaddr *)&addr, sizeof(addr));
+	listen(lfd, 1);
+	getsockname(lfd, (struct sockaddr *)&addr, &addrlen);
+	fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+	connect(fds[0], (struct sockaddr *)&addr, sizeof(addr));
+	fds[1] = accept(lfd, NULL, NULL);
+	close(lfd);
+}
+
+void *run_sender(void *vargp) {
+	int fd = *(int *)vargp;
+	static char buf[RELAY_PIPE_SIZE];
+	size_t sent = 0;
+
+	memset(buf, 'x', sizeof(buf));
+	while (sent < total_bytes) {
+		size_t n = total_bytes - sent < sizeof(buf) ? total_bytes - sent : sizeof(buf);
+		if (write_all(fd, buf, n) < 0)
+			break;
+		sent += n;
+	}
+	close(fd);
+	return NULL;
+}
+
+void *run_sink(void *vargp) {
+	int fd = *(int *)vargp;
+	static char buf[RELAY_PIPE_SIZE];
+
+	while (recv(fd, buf, sizeof(buf), 0) > 0)
+		;
+	close(fd);
+	return NULL;
+}
+
+double tv_secs(struct timeval tv) {
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void run(const char *name, int use_splice) {
+	int in[2], out[2];
+	int pipefd[2] = { -1, -1 };
+	pthread_t sender, sink;
+	struct rusage before, after;
+	struct timeval start, end;
+	ssize_t n;
+	double cpu, wall, gb;
+
+	tcp_pair(in);
+	tcp_pair(out);
+	pthread_create(&sender, NULL, run_sender, &in[0]);
+	pthread_create(&sink, NULL, run_sink, &out[1]);
+
+	getrusage(RUSAGE_THREAD, &before);
+	gettimeofday(&start, NULL);
+	if (use_splice) {
+		relay_pipe_open(pipefd);
+		n = relay_splice(in[1], out[0], pipefd, -1);
+		relay_pipe_close(pipefd);
+	} else {
+		n = relay_copy(in[1], out[0]);
+	}
+	gettimeofday(&end, NULL);
+	getrusage(RUSAGE_THREAD, &after);
+	close(in[1]);
+	close(out[0]);
+	pthread_join(sender, NULL);
+	pthread_join(sink, NULL);
+
+	cpu = tv_secs(after.ru_utime) - tv_secs(before.ru_utime) +
+		tv_secs(after.ru_stime) - tv_secs(before.ru_stime);
+	wall = tv_secs(end) - tv_secs(start);
+	gb = n / 1e9;
+	printf("%-8s %10zd bytes  %8.3f cpu-s/GB  %8.1f MB/s\n",
+			name, n, cpu / gb, n / wall / 1e6);
+}
+
+int main(int argc, char *argv[]) {
+	total_bytes = (size_t)(argc > 1 ? atof(argv[1]) : 1024) * 1000000;
+
+	run("copy", 0);
+	run("splice", 1);
+	return 0;
+}
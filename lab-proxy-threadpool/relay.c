@@ -0,0 +1,99 @@
+#define _GNU_SOURCE
+#include "relay.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+/* Write all len bytes of buf to fd.  Returns 0 on success, -1 on error. */
+int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n < 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Copy everything from one socket to the other, through a user-space
+ * buffer, until the sender closes.  Returns the number of bytes relayed, or
+ * -1 on error.
+ */
+ssize_t relay_copy(int from, int to)
+{
+	char buf[RELAY_BUF_SIZE];
+	ssize_t n, total = 0;
+
+	while ((n = recv(from, buf, sizeof(buf), 0)) > 0) {
+		if (write_all(to, buf, n) < 0)
+			return -1;
+		total += n;
+	}
+	return n < 0 ? -1 : total;
+}
+
+/*
+ * Create the pipe used by relay_splice() if pipefd does not already hold
+ * one.  Returns 0 on success, -1 on error.
+ */
+int relay_pipe_open(int pipefd[2])
+{
+	if (pipefd[0] >= 0)
+		return 0;
+	if (pipe2(pipefd, O_CLOEXEC) < 0) {
+		pipefd[0] = pipefd[1] = -1;
+		return -1;
+	}
+	fcntl(pipefd[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+	return 0;
+}
+
+void relay_pipe_close(int pipefd[2])
+{
+	if (pipefd[0] >= 0) {
+		close(pipefd[0]);
+		close(pipefd[1]);
+	}
+	pipefd[0] = pipefd[1] = -1;
+}
+
+/*
+ * Like relay_copy(), but the bytes never enter user space: splice() moves
+ * them from the source socket into pipefd and from there into the
+ * destination socket.  At most limit bytes are relayed, or everything up to
+ * EOF if limit is negative.  If an error leaves bytes stranded in the pipe,
+ * the pipe is closed (and pipefd reset) so the next relay_pipe_open()
+ * starts clean.  Returns the number of bytes relayed (less than limit only
+ * if the sender closed first), or -1 on error.
+ */
+ssize_t relay_splice(int from, int to, int pipefd[2], long long limit)
+{
+	ssize_t n, m, total = 0;
+	size_t want;
+
+	while (limit < 0 || total < limit) {
+		want = RELAY_PIPE_SIZE;
+		if (limit >= 0 && limit - total < (long long)want)
+			want = limit - total;
+		n = splice(from, NULL, pipefd[1], NULL, want,
+				SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (n <= 0)
+			return n < 0 ? -1 : total;
+		while (n > 0) {
+			m = splice(pipefd[0], NULL, to, NULL, n,
+					SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (m <= 0) {
+				relay_pipe_close(pipefd);
+				return -1;
+			}
+			n -= m;
+			total += m;
+		}
+	}
+	return total;
+}
@@ -0,0 +1,16 @@
+#ifndef __RELAY_H__
+#define __RELAY_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define RELAY_BUF_SIZE 8192
+#define RELAY_PIPE_SIZE 65536
+
+int write_all(int fd, const char *buf, size_t len);
+ssize_t relay_copy(int from, int to);
+int relay_pipe_open(int pipefd[2]);
+void relay_pipe_close(int pipefd[2]);
+ssize_t relay_splice(int from, int to, int pipefd[2], long long limit);
+
+#endif /* __RELAY_H__ */
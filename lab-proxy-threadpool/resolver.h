@@ -0,0 +1,58 @@
+#ifndef __RESOLVER_H__
+#define __RESOLVER_H__
+
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+
+#define RESOLVER_POSITIVE_TTL 60    /* seconds to keep a successful lookup */
+#define RESOLVER_NEGATIVE_TTL 5     /* seconds to keep a failed lookup */
+#define RESOLVER_NBUCKETS 256
+
+struct resolver_job;
+
+/* The cached result of resolving one host:port */
+typedef struct resolver_entry {
+	char *key;                  /* "host:port" */
+	char *host;                 /* points into key */
+	char *port;                 /* points into key */
+	struct addrinfo *ai;        /* addresses, or NULL if resolution failed */
+	int err;                    /* getaddrinfo() return value */
+	int pending;                /* resolution still in progress */
+	time_t expires;             /* CLOCK_MONOTONIC second it goes stale */
+	int refcnt;                 /* one for the cache, plus one per user */
+	struct resolver_job *waiters; /* async lookups waiting on this entry */
+	struct resolver_entry *next;  /* next entry in the same hash bucket */
+	struct resolver_entry *qnext; /* next entry waiting for a thread */
+} resolver_entry_t;
+
+/*
+ * Completion queue for asynchronous lookups.  Each finished lookup is
+ * appended here and a byte is written to the pipe, so an event loop can
+ * watch fds[0] with epoll alongside its sockets.
+ */
+typedef struct {
+	int fds[2];
+	pthread_mutex_t mutex;
+	struct resolver_job *head;
+	struct resolver_job *tail;
+} resolver_cq_t;
+
+typedef struct resolver_job {
+	resolver_entry_t *entry;
+	resolver_cq_t *cq;
+	void *arg;
+	struct resolver_job *next;
+} resolver_job_t;
+
+void resolver_init(int nthreads);
+void resolver_deinit(void);
+resolver_entry_t *resolver_lookup(const char *host, const char *port);
+int resolver_lookup_async(resolver_cq_t *cq, const char *host,
+		const char *port, void *arg, resolver_entry_t **entryp);
+void resolver_release(resolver_entry_t *entry);
+int resolver_cq_init(resolver_cq_t *cq);
+void resolver_cq_deinit(resolver_cq_t *cq);
+int resolver_cq_next(resolver_cq_t *cq, void **argp, resolver_entry_t **entryp);
+
+#endif /* __RESOLVER_H__ */
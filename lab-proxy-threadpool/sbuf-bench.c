@@ -0,0 +1,153 @@
+/*
+ * sbuf-bench.c - hand-offs per second through the lock-free sbuf_t and
+ * through the semaphore-based buffer it replaced, with N producers and N
+ * consumers for N = 1, 2, 4, ... 64.  Every producer inserts its share of
+ * the items and then one -1 per consumer it owes, so each consumer stops
+ * after seeing one -1.
+ *
+ * usage: ./sbuf-bench [items] [slots]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include "sbuf.h"
+
+/* The semaphore-based buffer, as it was in proxy.c less the printf()s */
+typedef struct {
+	int *buf;
+	int n;
+	int front;
+	int rear;
+	sem_t mutex;
+	sem_t slots;
+	sem_t items;
+} sem_sbuf_t;
+
+void sem_sbuf_init(sem_sbuf_t *sp, int n)
+{
+	sp->buf = calloc(n, sizeof(int));
+	sp->n = n;
+	sp->front = sp->rear = 0;
+	sem_init(&sp->mutex, 0, 1);
+	sem_init(&sp->slots, 0, n);
+	sem_init(&sp->items, 0, 0);
+}
+
+void sem_sbuf_deinit(sem_sbuf_t *sp)
+{
+	free(sp->buf);
+}
+
+void sem_sbuf_insert(sem_sbuf_t *sp, int item)
+{
+	sem_wait(&sp->slots);
+	sem_wait(&sp->mutex);
+	sp->buf[(++sp->rear)%(sp->n)] = item;
+	sem_post(&sp->mutex);
+	sem_post(&sp->items);
+}
+
+int sem_sbuf_remove(sem_sbuf_t *sp)
+{
+	int item;
+	sem_wait(&sp->items);
+	sem_wait(&sp->mutex);
+	item = sp->buf[(++sp->front)%(sp->n)];
+	sem_post(&sp->mutex);
+	sem_post(&sp->slots);
+	return item;
+}
+
+sbuf_t ring;
+sem_sbuf_t sem;
+int use_sem;
+long per_producer;
+
+void put(int item) {
+	if (use_sem)
+		sem_sbuf_insert(&sem, item);
+	else
+		sbuf_insert(&ring, item);
+}
+
+int get(void) {
+	return use_sem ? sem_sbuf_remove(&sem) : sbuf_remove(&ring);
+}
+
+void *producer(void *vargp) {
+	long i;
+
+	for (i = 0; i < per_producer; i++)
+		put(i & 0x7fffffff);
+	put(-1);  /* one consumer's stop signal */
+	return NULL;
+}
+
+void *consumer(void *vargp) {
+	long n = 0;
+
+	while (get() >= 0)
+		n++;
+	*(long *)vargp = n;
+	return NULL;
+}
+
+double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double run(int n, long items, int slots) {
+	pthread_t prod[64], cons[64];
+	long got[64], total = 0;
+	double start, secs;
+	int i;
+
+	per_producer = items / n;
+	if (use_sem)
+		sem_sbuf_init(&sem, slots);
+	else
+		sbuf_init(&ring, slots);
+
+	start = now();
+	for (i = 0; i < n; i++) {
+		pthread_create(&cons[i], NULL, consumer, &got[i]);
+		pthread_create(&prod[i], NULL, producer, NULL);
+	}
+	for (i = 0; i < n; i++) {
+		pthread_join(prod[i], NULL);
+		pthread_join(cons[i], NULL);
+		total += got[i];
+	}
+	secs = now() - start;
+
+	if (use_sem)
+		sem_sbuf_deinit(&sem);
+	else
+		sbuf_deinit(&ring);
+	if (total != per_producer * n)
+		fprintf(stderr, "lost items: %ld of %ld\n", per_producer * n - total,
+				per_producer * n);
+	return total / secs;
+}
+
+int main(int argc, char *argv[]) {
+	long items = argc > 1 ? atol(argv[1]) : 2000000;
+	int slots = argc > 2 ? atoi(argv[2]) : 64;
+	int n;
+
+	printf("%ld items, %d slots\n", items, slots);
+	printf("%-22s %14s %14s\n", "producers/consumers", "semaphore/s", "lock-free/s");
+	for (n = 1; n <= 64; n *= 2) {
+		double s, r;
+		use_sem = 1;
+		s = run(n, items, slots);
+		use_sem = 0;
+		r = run(n, items, slots);
+		printf("%10d/%-11d %14.0f %14.0f\n", n, n, s, r);
+	}
+	return 0;
+}
@@ -0,0 +1,208 @@
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Counters and latency histograms, kept per thread so that recording an
+ * event never contends: each thread only ever writes its own block, with
+ * a plain load and a relaxed store, so there is no locked instruction and
+ * no cache line bouncing between workers.  A reader sums every block;
+ * since each word is written whole it sees a count that is at most a few
+ * events behind, which is all a stats page needs.
+ *
+ * Blocks are never freed.  When a thread exits (the pool shrinks), its
+ * block is marked unused and the next new thread takes it over, counts
+ * and all, so nothing is lost from the totals and the list only grows to
+ * the most threads ever running at once.
+ */
+
+typedef struct stats_block {
+	stats_t st;
+	int in_use;                 /* owned by a running thread */
+	struct stats_block *next;
+} stats_block_t;
+
+static stats_block_t *blocks;   /* every block ever made */
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t block_key;
+static pthread_once_t block_once = PTHREAD_ONCE_INIT;
+static __thread stats_block_t *mine;
+
+static const char *counter_names[STAT_NCOUNTERS] = {
+	[STAT_CONNECTIONS] = "connections",
+	[STAT_REQUESTS] = "requests",
+	[STAT_BAD_REQUESTS] = "bad_requests",
+	[STAT_CACHE_HITS] = "cache_hits",
+	[STAT_DISK_HITS] = "disk_hits",
+	[STAT_CACHE_MISSES] = "cache_misses",
+	[STAT_REVALIDATED] = "revalidated",
+	[STAT_COALESCED] = "coalesced",
+	[STAT_RANGE_HITS] = "range_hits",
+	[STAT_SLICE_HITS] = "slice_hits",
+	[STAT_SLICE_FETCHES] = "slice_fetches",
+	[STAT_ORIGIN_CONNECTS] = "origin_connects",
+	[STAT_ORIGIN_REUSED] = "origin_reused",
+	[STAT_ORIGIN_ERRORS] = "origin_errors",
+	[STAT_TIMEOUT_HEADER] = "timeout_header",
+	[STAT_TIMEOUT_IDLE] = "timeout_idle",
+	[STAT_TIMEOUT_REQUEST] = "timeout_request",
+};
+
+static const char *hist_names[STAT_NHISTS] = {
+	[STAT_FIRST_BYTE] = "first_byte_us",
+	[STAT_CONNECT] = "connect_us",
+	[STAT_TOTAL] = "total_us",
+};
+
+/* The exiting thread's block is up for grabs */
+static void release_block(void *arg)
+{
+	stats_block_t *b = arg;
+
+	pthread_mutex_lock(&blocks_lock);
+	b->in_use = 0;
+	pthread_mutex_unlock(&blocks_lock);
+}
+
+static void make_key(void)
+{
+	pthread_key_create(&block_key, release_block);
+}
+
+/* This thread's block, claimed on first use; NULL if memory runs out */
+static stats_block_t *local(void)
+{
+	stats_block_t *b;
+
+	if (mine != NULL)
+		return mine;
+	pthread_once(&block_once, make_key);
+	pthread_mutex_lock(&blocks_lock);
+	for (b = blocks; b != NULL && b->in_use; b = b->next)
+		;
+	if (b == NULL && (b = calloc(1, sizeof(stats_block_t))) != NULL) {
+		b->next = blocks;
+		blocks = b;
+	}
+	if (b != NULL)
+		b->in_use = 1;
+	pthread_mutex_unlock(&blocks_lock);
+	if (b != NULL)
+		pthread_setspecific(block_key, b);
+	return mine = b;
+}
+
+/* Only the owning thread writes, so no read-modify-write is needed */
+static void bump(unsigned long *p, unsigned long n)
+{
+	__atomic_store_n(p, *p + n, __ATOMIC_RELAXED);
+}
+
+static int bucket(unsigned long long v)
+{
+	int shift;
+
+	if (v < STATS_SUB_BUCKETS)
+		return v;
+	shift = 63 - __builtin_clzll(v) - STATS_SUB_BITS;
+	if (shift > STATS_MAX_SHIFT)
+		return STATS_NBUCKETS - 1;
+	return (shift + 1) * STATS_SUB_BUCKETS + (v >> shift) - STATS_SUB_BUCKETS;
+}
+
+/* The largest value that falls in bucket i */
+static long long bucket_top(int i)
+{
+	int shift = i / STATS_SUB_BUCKETS - 1;
+
+	if (shift <= 0)
+		return i;
+	return ((long long)(i % STATS_SUB_BUCKETS + STATS_SUB_BUCKETS) << shift) +
+		(1LL << shift) - 1;
+}
+
+void stats_count(stat_counter_t c)
+{
+	stats_block_t *b = local();
+
+	if (b != NULL)
+		bump(&b->st.counters[c], 1);
+}
+
+/* Note that an event of kind h took usec microseconds */
+void stats_record(stat_hist_t h, long long usec)
+{
+	stats_block_t *b = local();
+
+	if (b == NULL)
+		return;
+	if (usec < 0)
+		usec = 0;
+	bump(&b->st.buckets[h][bucket(usec)], 1);
+	bump(&b->st.count[h], 1);
+	__atomic_store_n(&b->st.sum[h], b->st.sum[h] + usec, __ATOMIC_RELAXED);
+}
+
+/* Sum every thread's counts into st */
+void stats_collect(stats_t *st)
+{
+	stats_block_t *b;
+	int h, i;
+
+	memset(st, 0, sizeof(*st));
+	pthread_mutex_lock(&blocks_lock);
+	for (b = blocks; b != NULL; b = b->next) {
+		for (i = 0; i < STAT_NCOUNTERS; i++)
+			st->counters[i] += __atomic_load_n(&b->st.counters[i], __ATOMIC_RELAXED);
+		for (h = 0; h < STAT_NHISTS; h++) {
+			for (i = 0; i < STATS_NBUCKETS; i++)
+				st->buckets[h][i] += __atomic_load_n(&b->st.buckets[h][i], __ATOMIC_RELAXED);
+			st->count[h] += __atomic_load_n(&b->st.count[h], __ATOMIC_RELAXED);
+			st->sum[h] += __atomic_load_n(&b->st.sum[h], __ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock(&blocks_lock);
+}
+
+/*
+ * The value at or below which pct percent of h's samples fall, rounded up
+ * to the top of its bucket; 0 if there are none.
+ */
+long long stats_percentile(const stats_t *st, stat_hist_t h, double pct)
+{
+	unsigned long want, seen = 0;
+	int i;
+
+	if (st->count[h] == 0)
+		return 0;
+	want = st->count[h] * pct / 100;
+	if (want < st->count[h] * pct / 100 || want == 0)
+		want++;
+	for (i = 0; i < STATS_NBUCKETS; i++) {
+		seen += st->buckets[h][i];
+		if (seen >= want)
+			break;
+	}
+	return bucket_top(i < STATS_NBUCKETS ? i : STATS_NBUCKETS - 1);
+}
+
+const char *stats_counter_name(stat_counter_t c)
+{
+	return counter_names[c];
+}
+
+const char *stats_hist_name(stat_hist_t h)
+{
+	return hist_names[h];
+}
+
+/* CLOCK_MONOTONIC in microseconds, for timing what stats_record() takes */
+long long stats_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
@@ -0,0 +1,65 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stddef.h>
+
+/*
+ * Latency histograms are log-linear, as in HdrHistogram: values below
+ * STATS_SUB_BUCKETS microseconds get a bucket each, and every power of two
+ * above that is split into STATS_SUB_BUCKETS equal buckets, so a bucket
+ * is never wider than 1/STATS_SUB_BUCKETS of the values in it.  Values
+ * past 2^(STATS_MAX_SHIFT + STATS_SUB_BITS + 1) us (a few days) land in
+ * the last bucket.
+ */
+#define STATS_SUB_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_MAX_SHIFT 32
+#define STATS_NBUCKETS ((STATS_MAX_SHIFT + 2) * STATS_SUB_BUCKETS)
+
+/* Event counts */
+typedef enum {
+	STAT_CONNECTIONS,           /* client connections served */
+	STAT_REQUESTS,              /* requests read in full */
+	STAT_BAD_REQUESTS,          /* requests that did not parse or were refused */
+	STAT_CACHE_HITS,            /* served fresh from memory */
+	STAT_DISK_HITS,             /* served fresh from the disk tier */
+	STAT_CACHE_MISSES,          /* GETs that had to go to the origin */
+	STAT_REVALIDATED,           /* stale entries the origin confirmed (304) */
+	STAT_COALESCED,             /* misses that waited on another's fetch */
+	STAT_RANGE_HITS,            /* ranges cut from a whole cached object */
+	STAT_SLICE_HITS,            /* object slices found in the cache */
+	STAT_SLICE_FETCHES,         /* ...and fetched from the origin */
+	STAT_ORIGIN_CONNECTS,       /* new origin connections opened */
+	STAT_ORIGIN_REUSED,         /* requests sent on a pooled connection */
+	STAT_ORIGIN_ERRORS,         /* origins that could not be reached */
+	STAT_TIMEOUT_HEADER,        /* clients too slow sending their headers */
+	STAT_TIMEOUT_IDLE,          /* either side stalled mid-exchange */
+	STAT_TIMEOUT_REQUEST,       /* requests over the whole-request limit */
+	STAT_NCOUNTERS
+} stat_counter_t;
+
+/* Latencies, in microseconds */
+typedef enum {
+	STAT_FIRST_BYTE,            /* accept (or request start) to first byte out */
+	STAT_CONNECT,               /* resolving and connecting to an origin */
+	STAT_TOTAL,                 /* whole request, to the last byte out */
+	STAT_NHISTS
+} stat_hist_t;
+
+/* The counts of every thread, summed by stats_collect() */
+typedef struct {
+	unsigned long counters[STAT_NCOUNTERS];
+	unsigned long buckets[STAT_NHISTS][STATS_NBUCKETS];
+	unsigned long count[STAT_NHISTS];
+	unsigned long long sum[STAT_NHISTS];
+} stats_t;
+
+void stats_count(stat_counter_t c);
+void stats_record(stat_hist_t h, long long usec);
+void stats_collect(stats_t *st);
+long long stats_percentile(const stats_t *st, stat_hist_t h, double pct);
+const char *stats_counter_name(stat_counter_t c);
+const char *stats_hist_name(stat_hist_t h);
+long long stats_now_us(void);
+
+#endif /* __STATS_H__ */
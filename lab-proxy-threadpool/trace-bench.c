@@ -0,0 +1,139 @@
+/*
+ * trace-bench.c - replay a request trace against each cache policy and
+ * report how many requests, and how many bytes, the cache would have
+ * saved the origins.  Every request is looked up; a miss inserts an
+ * object of the request's size, as the proxy does once it has relayed
+ * the response.
+ *
+ * A trace has one request per line: the cache key ("host:port/path") and
+ * the size of the response in bytes, separated by white space.  Without a
+ * trace file, a synthetic one is generated: Zipf-distributed requests
+ * over a fixed set of objects, broken up by scans of objects that are
+ * requested once and never again--the pattern that flushes an LRU cache.
+ *
+ * usage: ./trace-bench [trace-file]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "cache.h"
+
+#define KEY_SIZE 512
+
+/* Synthetic workload */
+#define SYN_OBJECTS 2000
+#define SYN_REQUESTS 200000
+#define SYN_ZIPF_S 0.9
+#define SYN_SCAN_EVERY 5000    /* requests between scans */
+#define SYN_SCAN_LEN 500       /* one-hit wonders per scan */
+#define SYN_MAX_SIZE 16384
+
+struct req {
+	char *key;
+	size_t len;
+};
+
+struct req *reqs;
+int nreqs, reqcap;
+cache_t cache;
+
+void add_req(const char *key, size_t len) {
+	if (nreqs == reqcap) {
+		reqcap = reqcap ? reqcap * 2 : 1024;
+		if ((reqs = realloc(reqs, reqcap * sizeof(struct req))) == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	reqs[nreqs].key = strdup(key);
+	reqs[nreqs].len = len;
+	nreqs++;
+}
+
+void load_trace(const char *path) {
+	char key[KEY_SIZE];
+	unsigned long len;
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		perror(path);
+		exit(1);
+	}
+	while (fscanf(fp, "%511s %lu", key, &len) == 2) {
+		add_req(key, len);
+	}
+	fclose(fp);
+}
+
+/* Object sizes are fixed per key, as they would be for a real origin */
+size_t syn_size(int i, unsigned int seed) {
+	return 256 + (i * 2654435761u ^ seed) % SYN_MAX_SIZE;
+}
+
+void make_trace() {
+	double cdf[SYN_OBJECTS], sum = 0, u;
+	char key[KEY_SIZE];
+	unsigned int seed = 1;
+	int i, j, lo, hi, scanned = 0;
+
+	for (i = 0; i < SYN_OBJECTS; i++) {
+		sum += 1.0 / pow(i + 1, SYN_ZIPF_S);
+		cdf[i] = sum;
+	}
+	for (i = 0; i < SYN_REQUESTS; i++) {
+		if (i % SYN_SCAN_EVERY == SYN_SCAN_EVERY - 1) {
+			for (j = 0; j < SYN_SCAN_LEN; j++, scanned++) {
+				sprintf(key, "localhost:8080/scan/%d", scanned);
+				add_req(key, syn_size(scanned, 7));
+			}
+		}
+		u = rand_r(&seed) / (RAND_MAX + 1.0) * sum;
+		for (lo = 0, hi = SYN_OBJECTS - 1; lo < hi; ) {
+			int mid = (lo + hi) / 2;
+			if (cdf[mid] < u) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		sprintf(key, "localhost:8080/object/%d", lo);
+		add_req(key, syn_size(lo, 3));
+	}
+}
+
+int main(int argc, char *argv[]) {
+	static char data[MAX_OBJECT_SIZE];
+	unsigned long hits, bytes, hit_bytes;
+	cache_obj_t *obj;
+	int i, p;
+
+	if (argc > 1) {
+		load_trace(argv[1]);
+	} else {
+		make_trace();
+	}
+	memset(data, 'x', sizeof(data));
+
+	printf("%d requests\n", nreqs);
+	printf("%8s %12s %12s %16s\n", "policy", "hit ratio", "byte ratio", "bytes saved");
+	for (p = 0; p < CACHE_NPOLICIES; p++) {
+		cache_init(&cache);
+		cache_set_policy(&cache, p);
+		hits = bytes = hit_bytes = 0;
+		for (i = 0; i < nreqs; i++) {
+			bytes += reqs[i].len;
+			if ((obj = cache_lookup(&cache, reqs[i].key)) != NULL) {
+				hits++;
+				hit_bytes += obj->len;
+				cache_release(&cache, obj);
+			} else if (reqs[i].len <= MAX_OBJECT_SIZE) {
+				cache_insert(&cache, reqs[i].key, data, reqs[i].len, 0);
+			}
+		}
+		printf("%8s %11.2f%% %11.2f%% %16lu\n", cache_policy_name(p),
+				100.0 * hits / nreqs, 100.0 * hit_bytes / bytes, hit_bytes);
+		cache_deinit(&cache);
+	}
+	return 0;
+}
@@ -0,0 +1,308 @@
+#include "workers.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+/*
+ * Work-stealing worker pool.  Each worker has its own queue, and the
+ * acceptor deals connections out to them in turn, so no single queue is
+ * shared by every hand-off.  A worker serves its own queue first; when
+ * that is empty it steals from the others, starting with its neighbor, so
+ * a connection dealt to a worker stuck on a slow origin is picked up by
+ * whoever is free.  Only when every queue is empty does a worker sleep.
+ *
+ * The queues are FIFO rather than the usual LIFO deques: a queued
+ * connection is a client waiting for its first byte, so oldest first is
+ * what keeps tail latency down, and the owner and the thieves both take
+ * from the front.
+ *
+ * The pool is elastic.  A monitor thread watches for every worker being
+ * busy while connections wait, with the CPU mostly idle -- the workers are
+ * blocked on slow origins or idle clients, not computing -- and starts
+ * more, up to max.  The highest-numbered worker exits once it has had
+ * nothing to do for WORKERS_IDLE_TIMEOUT, down to min, so the running
+ * workers are always 0..n-1.
+ *
+ * Growth stops at max, and past that the queues would only fill, the
+ * acceptor would block, and the backlog would build up in the kernel
+ * where nothing can see how old it is.  With workers_set_shed() the pool
+ * instead turns connections away: the acceptor refuses one outright when
+ * max_pending are already queued or every queue is full, and a worker
+ * drops one that has waited longer than max_delay, since its client has
+ * likely given up or soon will.  Either way shed() gets the connection,
+ * to answer it quickly and close it, so an overloaded proxy fails some
+ * requests fast instead of timing out all of them.
+ */
+
+static long elapsed_ms(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000 +
+		(to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+static long long clock_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* Whether fd has been queued too long to be worth serving */
+static int late(workers_t *wp, int fd)
+{
+	return wp->shed != NULL && wp->max_delay > 0 && fd < wp->nfds &&
+		clock_us() - wp->queued_at[fd] > wp->max_delay * 1000;
+}
+
+/* Take a connection for worker w, from its own queue or another's */
+static int take(worker_t *w, int *fdp)
+{
+	workers_t *wp = w->wp;
+	int hi = __atomic_load_n(&wp->hi, __ATOMIC_ACQUIRE);
+	int i;
+
+	if (sbuf_try_remove(&w->queue, fdp))
+		goto took;
+	for (i = 1; i < hi; i++) {
+		if (sbuf_try_remove(&wp->workers[(w->id + i) % hi].queue, fdp)) {
+			w->stolen++;
+			goto took;
+		}
+	}
+	return 0;
+took:
+	__atomic_sub_fetch(&wp->pending, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+/*
+ * Sleep until there may be work, and return 1 with it in *fdp, or return 0
+ * if w should exit because it is the last worker, the pool is above its
+ * floor, and w has been idle long enough.  The idle count is raised before
+ * the last look at the queues, and workers_submit() checks it after
+ * queuing, so one of the two always sees the other (see wake() in sbuf.c).
+ */
+static int wait_for_work(worker_t *w, int *fdp)
+{
+	workers_t *wp = w->wp;
+	struct timespec now, deadline;
+	int got;
+
+	pthread_mutex_lock(&wp->lock);
+	__atomic_add_fetch(&wp->idle, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	clock_gettime(CLOCK_MONOTONIC, &w->idle_since);
+	deadline = w->idle_since;
+	deadline.tv_sec += WORKERS_IDLE_TIMEOUT;
+	while (!(got = take(w, fdp))) {
+		if (w->id != wp->n - 1 || wp->n <= wp->min) {
+			pthread_cond_wait(&wp->work, &wp->lock);
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (elapsed_ms(&deadline, &now) >= 0) {
+			__atomic_store_n(&wp->n, wp->n - 1, __ATOMIC_RELEASE);
+			wp->retired++;
+			/* the new last worker may have been idle long enough too */
+			pthread_cond_broadcast(&wp->work);
+			break;
+		}
+		pthread_cond_timedwait(&wp->work, &wp->lock, &deadline);
+	}
+	__atomic_sub_fetch(&wp->idle, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&wp->lock);
+	return got;
+}
+
+static void *run_worker(void *vargp)
+{
+	worker_t *w = vargp;
+	int fd;
+
+	pthread_detach(pthread_self());
+	while (1) {
+		if (!take(w, &fd) && !wait_for_work(w, &fd))
+			break;
+		if (late(w->wp, fd)) {
+			__atomic_add_fetch(&w->wp->shed_late, 1, __ATOMIC_RELAXED);
+			w->wp->shed(fd);
+			continue;
+		}
+		w->handled++;
+		w->wp->handler(fd);
+	}
+	return NULL;
+}
+
+/* Start worker n; wp->lock must be held once the pool is running */
+static int start_worker(workers_t *wp)
+{
+	worker_t *w = &wp->workers[wp->n];
+
+	w->wp = wp;
+	w->id = wp->n;
+	__atomic_store_n(&wp->n, wp->n + 1, __ATOMIC_RELEASE);
+	if (wp->n > wp->hi)
+		__atomic_store_n(&wp->hi, wp->n, __ATOMIC_RELEASE);
+	if (pthread_create(&w->tid, NULL, run_worker, w) != 0) {
+		__atomic_store_n(&wp->n, wp->n - 1, __ATOMIC_RELEASE);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Grow the pool when, for WORKERS_STALL_MS, no worker has been idle,
+ * connections have been waiting, and the process has used less than half
+ * the CPU it could have: the workers are blocked, so more of them will
+ * get through the queue where more computing would not.
+ */
+static void *run_monitor(void *vargp)
+{
+	workers_t *wp = vargp;
+	struct timespec tick = { 0, WORKERS_CHECK_MS * 1000000L };
+	struct timespec start, cpu_start, now, cpu_now;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int stalled = 0;
+	int pending;
+
+	pthread_detach(pthread_self());
+	if (ncpu < 1)
+		ncpu = 1;
+	while (1) {
+		nanosleep(&tick, NULL);
+		if (__atomic_load_n(&wp->idle, __ATOMIC_RELAXED) > 0 ||
+				__atomic_load_n(&wp->pending, __ATOMIC_RELAXED) <= 0) {
+			stalled = 0;
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_now);
+		if (!stalled) {
+			stalled = 1;
+			start = now;
+			cpu_start = cpu_now;
+			continue;
+		}
+		if (elapsed_ms(&start, &now) < WORKERS_STALL_MS)
+			continue;
+		stalled = 0;
+		if (elapsed_ms(&cpu_start, &cpu_now) * 2 >=
+				elapsed_ms(&start, &now) * ncpu)
+			continue;
+
+		/* one new worker for each waiting connection, up to max */
+		pthread_mutex_lock(&wp->lock);
+		pending = __atomic_load_n(&wp->pending, __ATOMIC_RELAXED);
+		while (pending-- > 0 && wp->n < wp->max && start_worker(wp))
+			wp->grown++;
+		pthread_mutex_unlock(&wp->lock);
+	}
+	return NULL;
+}
+
+/*
+ * Start min workers, each of which passes the connections it gets to
+ * handler, and let the pool grow to max of them when they are blocked.
+ */
+void workers_init(workers_t *wp, int min, int max, void (*handler)(int))
+{
+	pthread_condattr_t attr;
+	struct rlimit rl;
+	pthread_t tid;
+	int i;
+
+	wp->workers = calloc(max, sizeof(worker_t));
+	wp->n = 0;
+	wp->min = min;
+	wp->max = max;
+	wp->hi = 0;
+	wp->next = 0;
+	wp->handler = handler;
+	wp->idle = 0;
+	wp->pending = 0;
+	wp->grown = 0;
+	wp->retired = 0;
+	wp->max_pending = 0;
+	wp->max_delay = 0;
+	wp->shed = NULL;
+	wp->shed_full = 0;
+	wp->shed_late = 0;
+	/* fds are numbered from 0 and reused, so they index their queue times */
+	wp->nfds = 1024;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+		wp->nfds = rl.rlim_cur < (1 << 20) ? rl.rlim_cur : (1 << 20);
+	wp->queued_at = calloc(wp->nfds, sizeof(long long));
+	pthread_mutex_init(&wp->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wp->work, &attr);
+	pthread_condattr_destroy(&attr);
+	for (i = 0; i < max; i++)
+		sbuf_init(&wp->workers[i].queue, WORKERS_QUEUE_SIZE);
+	pthread_mutex_lock(&wp->lock);
+	for (i = 0; i < min; i++)
+		start_worker(wp);
+	pthread_mutex_unlock(&wp->lock);
+	if (max > min)
+		pthread_create(&tid, NULL, run_monitor, wp);
+}
+
+/*
+ * Turn connections away instead of queuing them once max_pending are
+ * waiting (0 for no limit), and drop those that have waited more than
+ * max_delay milliseconds (0 for no limit), passing each to shed.  Call
+ * before the first workers_submit().
+ */
+void workers_set_shed(workers_t *wp, int max_pending, long max_delay,
+		void (*shed)(int))
+{
+	wp->max_pending = max_pending;
+	wp->max_delay = max_delay;
+	wp->shed = shed;
+}
+
+/*
+ * Hand fd to the next worker in turn, or to the first after it with room.
+ * If every queue is full, shed fd if shedding is set up, or else wait for
+ * room in the next one.  Then wake a sleeping worker, if any, so an idle
+ * one can steal fd when its owner is busy.  Returns 1 if fd was queued, 0
+ * if it was shed.  Called only from the acceptor thread.
+ */
+int workers_submit(workers_t *wp, int fd)
+{
+	int n = __atomic_load_n(&wp->n, __ATOMIC_ACQUIRE);
+	int first = wp->next++ % n;
+	int i;
+
+	if (wp->shed != NULL && wp->max_pending > 0 &&
+			__atomic_load_n(&wp->pending, __ATOMIC_RELAXED) >= wp->max_pending)
+		goto shed;
+	if (fd < wp->nfds)
+		wp->queued_at[fd] = clock_us();
+	__atomic_add_fetch(&wp->pending, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < n; i++) {
+		if (sbuf_try_insert(&wp->workers[(first + i) % n].queue, fd))
+			break;
+	}
+	if (i == n) {
+		if (wp->shed != NULL) {
+			__atomic_sub_fetch(&wp->pending, 1, __ATOMIC_RELAXED);
+			goto shed;
+		}
+		sbuf_insert(&wp->workers[first].queue, fd);
+	}
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&wp->idle, __ATOMIC_RELAXED) > 0) {
+		pthread_mutex_lock(&wp->lock);
+		pthread_cond_signal(&wp->work);
+		pthread_mutex_unlock(&wp->lock);
+	}
+	return 1;
+shed:
+	wp->shed_full++;
+	wp->shed(fd);
+	return 0;
+}
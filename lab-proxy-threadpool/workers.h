@@ -0,0 +1,59 @@
+#ifndef __WORKERS_H__
+#define __WORKERS_H__
+
+#include <pthread.h>
+#include <time.h>
+#include "sbuf.h"
+
+#define WORKERS_QUEUE_SIZE 64   /* connections queued per worker */
+#define WORKERS_STALL_MS 100    /* all busy with work queued this long: grow */
+#define WORKERS_CHECK_MS 20     /* how often the monitor looks for a stall */
+#define WORKERS_IDLE_TIMEOUT 30 /* seconds idle before a spare worker exits */
+
+typedef struct workers workers_t;
+
+/* One worker thread and the connections handed to it */
+typedef struct {
+	workers_t *wp;
+	int id;
+	sbuf_t queue;               /* filled by the acceptor, emptied by anyone */
+	pthread_t tid;
+	struct timespec idle_since; /* when it last ran out of work */
+	unsigned long handled;      /* connections this worker served */
+	unsigned long stolen;       /* ... of which it took from another queue */
+} worker_t;
+
+/*
+ * Workers 0..n-1 are running; slots n..max-1 hold no thread, but their
+ * queues may still hold connections dealt to a worker that has since
+ * exited, so stealing covers every slot up to hi.
+ */
+struct workers {
+	worker_t *workers;
+	int n;                      /* running workers */
+	int min;                    /* never shrink below this */
+	int max;                    /* never grow beyond this */
+	int hi;                     /* slots ever used */
+	unsigned int next;          /* acceptor's round-robin position */
+	void (*handler)(int);       /* called with each connection */
+	int idle;                   /* workers asleep waiting for work */
+	int pending;                /* connections queued, not yet taken */
+	unsigned long grown;        /* workers started beyond min */
+	unsigned long retired;      /* workers that exited idle */
+	int max_pending;            /* shed beyond this many queued; 0: never */
+	long max_delay;             /* shed a connection queued this many ms */
+	void (*shed)(int);          /* called with each connection turned away */
+	long long *queued_at;       /* CLOCK_MONOTONIC us each fd was queued */
+	int nfds;                   /* entries in queued_at */
+	unsigned long shed_full;    /* connections refused with the queue full */
+	unsigned long shed_late;    /* connections dropped for waiting too long */
+	pthread_mutex_t lock;       /* protects sleeping and n, not the queues */
+	pthread_cond_t work;
+};
+
+void workers_init(workers_t *wp, int min, int max, void (*handler)(int));
+void workers_set_shed(workers_t *wp, int max_pending, long max_delay,
+		void (*shed)(int));
+int workers_submit(workers_t *wp, int fd);
+
+#endif /* __WORKERS_H__ */